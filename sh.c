@@ -20,6 +20,9 @@
 char *history[MAX_HISTORY];
 int history_count = 0;
 
+/* Exit status of the last command segment, substituted for "$?" */
+int last_status = 0;
+
 /* Termios structure for raw mode */
 struct termios orig_termios;
 
@@ -29,11 +32,13 @@ void disableRawMode();
 void add_to_history(char *command);
 char *get_history_command(int index);
 char **sh_split_line(char *line);
+int status_code(int status);
 int handle_redirection(char **args);
 int sh_execute_simple(char **args);
 int sh_execute_logical(char **args);
 char *sh_read_line(void);
 int autocomplete(char *buffer, int pos);
+void reap_background(void);
 void sh_loop(void);
 
 /* --- Terminal (raw mode) functions --- */
@@ -195,12 +200,23 @@ int handle_redirection(char **args) {
     return 0;
 }
 
+/* Turn a waitpid() status into a shell status: the exit code, or
+   128 plus the signal number for a command killed by a signal. */
+int status_code(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
 /* --- Execution functions ---
    sh_execute_simple() executes a command segment. It handles background execution,
    pipes, and calls handle_redirection() in the child process before execvp(). */
 int sh_execute_simple(char **args) {
     if (args[0] == NULL)
         return 0;
+    int status, result = 0;
 
     /* Check for background execution: if the last token is "&" */
     int background = 0;
@@ -238,13 +254,13 @@ int sh_execute_simple(char **args) {
         if (pid1 == 0) {
             /* In left child, process any redirection in left_cmd */
             if (handle_redirection(left_cmd) < 0)
-                exit(EXIT_FAILURE);
+                _exit(EXIT_FAILURE);
             close(fd[0]); // Close unused read end
             dup2(fd[1], STDOUT_FILENO); // Redirect stdout to pipe
             close(fd[1]);
             if (execvp(left_cmd[0], left_cmd) == -1) {
                 perror("execvp");
-                exit(EXIT_FAILURE);
+                _exit(127);
             }
         }
 
@@ -252,21 +268,23 @@ int sh_execute_simple(char **args) {
         if (pid2 == 0) {
             /* In right child, process any redirection in right_cmd */
             if (handle_redirection(right_cmd) < 0)
-                exit(EXIT_FAILURE);
+                _exit(EXIT_FAILURE);
             close(fd[1]); // Close unused write end
             dup2(fd[0], STDIN_FILENO); // Redirect stdin from pipe
             close(fd[0]);
             if (execvp(right_cmd[0], right_cmd) == -1) {
                 perror("execvp");
-                exit(EXIT_FAILURE);
+                _exit(127);
             }
         }
 
         close(fd[0]);
         close(fd[1]);
         if (!background) {
+            /* A pipeline's status is that of its last command */
             waitpid(pid1, NULL, 0);
-            waitpid(pid2, NULL, 0);
+            waitpid(pid2, &status, 0);
+            result = status_code(status);
         } else {
             printf("[Background pid %d]\n", pid1);
             printf("[Background pid %d]\n", pid2);
@@ -277,28 +295,31 @@ int sh_execute_simple(char **args) {
         if (pid == 0) {
             /* In child, handle any I/O redirection before executing */
             if (handle_redirection(args) < 0)
-                exit(EXIT_FAILURE);
+                _exit(EXIT_FAILURE);
             if (execvp(args[0], args) == -1) {
                 perror("execvp");
             }
-            exit(EXIT_FAILURE);
+            _exit(127);
         } else if (pid < 0) {
             perror("fork");
+            result = 1;
         } else {
             if (!background) {
-                waitpid(pid, NULL, 0);
+                waitpid(pid, &status, 0);
+                result = status_code(status);
             } else {
                 printf("[Background pid %d]\n", pid);
             }
         }
     }
-    return 0;
+    return result;
 }
 
 /* sh_execute_logical() handles logical operators (&& and ||)
    by splitting the tokenized command into segments and executing them conditionally. */
 int sh_execute_logical(char **args) {
     int start = 0, ret = 0, i = 0;
+    char *prev = NULL;  // Operator before the current segment
     while (args[start] != NULL) {
         i = start;
         char *op = NULL;
@@ -310,16 +331,25 @@ int sh_execute_logical(char **args) {
             op = args[i];
             args[i] = NULL;  // Terminate the current segment
         }
-        ret = sh_execute_simple(&args[start]);
+        /* A short-circuit skips only this segment: the status is left as
+           it was, and the next operator decides on it, so that
+           "false && a || b" runs b */
+        int skip = 0;
+        if (prev != NULL)
+            skip = (strcmp(prev, "&&") == 0) ? ret != 0 : ret == 0;
+        if (!skip) {
+            /* Substitute "$?" now, so that it sees the segment before it */
+            char status_buf[16];
+            snprintf(status_buf, sizeof(status_buf), "%d", last_status);
+            for (int k = start; k < i; k++)
+                if (strcmp(args[k], "$?") == 0)
+                    args[k] = status_buf;
+            ret = sh_execute_simple(&args[start]);
+            last_status = ret;
+        }
         if (op == NULL)
             break;
-        if (strcmp(op, "&&") == 0) {
-            if (ret != 0)
-                break;
-        } else if (strcmp(op, "||") == 0) {
-            if (ret == 0)
-                break;
-        }
+        prev = op;
         start = i + 1;
     }
     return ret;
@@ -329,6 +359,19 @@ int sh_execute_logical(char **args) {
    This function reads input character-by-character in raw mode.
    It handles backspaces and intercepts TAB (for autocompletion) until a newline is entered. */
 char *sh_read_line(void) {
+    /* Not a terminal (a script or a pipe): read whole lines, no echo */
+    if (!isatty(STDIN_FILENO)) {
+        char *line = NULL;
+        size_t bufsize = 0;
+        ssize_t len = getline(&line, &bufsize, stdin);
+        if (len < 0) {
+            free(line);
+            return NULL;
+        }
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        return line;
+    }
     enableRawMode();
     int bufsize = BUFFER_SIZE;
     char *buffer = malloc(bufsize);
@@ -430,6 +473,15 @@ int autocomplete(char *buffer, int pos) {
     return pos;
 }
 
+/* --- Background reaping ---
+   Background commands are not waited for when they start, so collect any
+   that have exited since the last prompt; otherwise they stay zombies. */
+void reap_background(void) {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        printf("[Background pid %d done]\n", pid);
+}
+
 /* --- Main Shell Loop ---
    The shell prompt is printed, input is read (with history and autocompletion support),
    tokenized, and executed (with support for redirection, pipes, background execution,
@@ -438,11 +490,17 @@ void sh_loop(void) {
     char *line;
     char **args;
     int status;
+    int interactive = isatty(STDIN_FILENO);
 
     do {
-        printf("utsh$ ");
-        fflush(stdout);
+        reap_background();
+        if (interactive) {
+            printf("utsh$ ");
+            fflush(stdout);
+        }
         line = sh_read_line();
+        if (line == NULL)   /* End of a script */
+            break;
 
         /* Check for history invocation: if the command starts with "!" followed by a digit */
         if (line[0] == '!' && isdigit(line[1])) {
@@ -470,5 +528,5 @@ void sh_loop(void) {
 
 int main() {
     sh_loop();
-    return EXIT_SUCCESS;
+    return last_status;
 }
\ No newline at end of file
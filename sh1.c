@@ -22,6 +22,9 @@
 char *history[MAX_HISTORY];
 int history_count = 0;
 
+/* Exit status of the last command segment, substituted for "$?" */
+int last_status = 0;
+
 /* Termios structure for raw mode */
 struct termios orig_termios;
 
@@ -31,11 +34,13 @@ void disableRawMode();
 void add_to_history(char *command);
 char *get_history_command(int index);
 char **sh_split_line(char *line);
+int status_code(int status);
 int handle_redirection(char **args);
 int sh_execute_simple(char **args);
 int sh_execute_logical(char **args);
 char *sh_read_line(void);
 int autocomplete(char *buffer, int pos);
+void reap_background(void);
 void sh_loop(void);
 
 /* --- Terminal (raw mode) functions --- */
@@ -197,6 +202,16 @@ int handle_redirection(char **args) {
     return 0;
 }
 
+/* Turn a waitpid() status into a shell status: the exit code, or
+   128 plus the signal number for a command killed by a signal. */
+int status_code(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return 1;
+}
+
 /* --- Execution functions ---
    sh_execute_simple() executes a command or a pipeline of commands.
    This updated version supports multiple pipes.
@@ -212,6 +227,7 @@ int handle_redirection(char **args) {
 int sh_execute_simple(char **args) {
     if (args[0] == NULL)
         return 0;
+    int status = 0, result = 0;
 
     /* Check for background execution: if the last token is "&" */
     int background = 0;
@@ -236,18 +252,20 @@ int sh_execute_simple(char **args) {
         pid_t pid = fork();
         if (pid == 0) {
             if (handle_redirection(args) < 0)
-                exit(EXIT_FAILURE);
+                _exit(EXIT_FAILURE);
             if (execvp(args[0], args) == -1) {
                 perror("execvp");
             }
-            exit(EXIT_FAILURE);
+            _exit(127);
         } else if (pid < 0) {
             perror("fork");
+            return 1;
         } else {
-            if (!background)
-                waitpid(pid, NULL, 0);
-            else
-                printf("[Background pid %d]\n", pid);
+            if (!background) {
+                waitpid(pid, &status, 0);
+                return status_code(status);
+            }
+            printf("[Background pid %d]\n", pid);
         }
         return 0;
     }
@@ -284,21 +302,27 @@ int sh_execute_simple(char **args) {
 
     /* Fork one child for each command segment */
     pid_t pid;
+    pid_t *pids = malloc(num_commands * sizeof(pid_t));
+    if (!pids) {
+        fprintf(stderr, "Allocation error\n");
+        exit(EXIT_FAILURE);
+    }
     for (int i = 0; i < num_commands; i++) {
         pid = fork();
+        pids[i] = pid;
         if (pid == 0) {
             /* If not the first command, redirect standard input from the previous pipe */
             if (i != 0) {
                 if (dup2(pipefds[(i - 1) * 2], STDIN_FILENO) < 0) {
                     perror("dup2");
-                    exit(EXIT_FAILURE);
+                    _exit(EXIT_FAILURE);
                 }
             }
             /* If not the last command, redirect standard output to the current pipe write end */
             if (i != num_commands - 1) {
                 if (dup2(pipefds[i * 2 + 1], STDOUT_FILENO) < 0) {
                     perror("dup2");
-                    exit(EXIT_FAILURE);
+                    _exit(EXIT_FAILURE);
                 }
             }
             /* Close all pipe file descriptors in the child */
@@ -307,10 +331,10 @@ int sh_execute_simple(char **args) {
             }
             /* Handle I/O redirection for the current command segment */
             if (handle_redirection(cmds[i]) < 0)
-                exit(EXIT_FAILURE);
+                _exit(EXIT_FAILURE);
             if (execvp(cmds[i][0], cmds[i]) < 0) {
                 perror("execvp");
-                exit(EXIT_FAILURE);
+                _exit(127);
             }
         } else if (pid < 0) {
             perror("fork");
@@ -324,23 +348,28 @@ int sh_execute_simple(char **args) {
         close(pipefds[i]);
     }
 
-    /* Wait for all child processes to finish if not running in the background */
+    /* Wait for this pipeline's children only; a bare wait() could reap an
+       unrelated background job instead of a pipeline stage. */
     if (!background) {
+        /* A pipeline's status is that of its last command */
         for (int i = 0; i < num_commands; i++) {
-            wait(NULL);
+            waitpid(pids[i], &status, 0);
         }
+        result = status_code(status);
     } else {
         printf("[Background pipeline started]\n");
     }
 
+    free(pids);
     free(cmds);
-    return 0;
+    return result;
 }
 
 /* --- sh_execute_logical() handles logical operators (&& and ||)
    by splitting the tokenized command into segments and executing them conditionally. */
 int sh_execute_logical(char **args) {
     int start = 0, ret = 0, i = 0;
+    char *prev = NULL;  // Operator before the current segment
     while (args[start] != NULL) {
         i = start;
         char *op = NULL;
@@ -352,16 +381,25 @@ int sh_execute_logical(char **args) {
             op = args[i];
             args[i] = NULL;  // Terminate the current segment
         }
-        ret = sh_execute_simple(&args[start]);
+        /* A short-circuit skips only this segment: the status is left as
+           it was, and the next operator decides on it, so that
+           "false && a || b" runs b */
+        int skip = 0;
+        if (prev != NULL)
+            skip = (strcmp(prev, "&&") == 0) ? ret != 0 : ret == 0;
+        if (!skip) {
+            /* Substitute "$?" now, so that it sees the segment before it */
+            char status_buf[16];
+            snprintf(status_buf, sizeof(status_buf), "%d", last_status);
+            for (int k = start; k < i; k++)
+                if (strcmp(args[k], "$?") == 0)
+                    args[k] = status_buf;
+            ret = sh_execute_simple(&args[start]);
+            last_status = ret;
+        }
         if (op == NULL)
             break;
-        if (strcmp(op, "&&") == 0) {
-            if (ret != 0)
-                break;
-        } else if (strcmp(op, "||") == 0) {
-            if (ret == 0)
-                break;
-        }
+        prev = op;
         start = i + 1;
     }
     return ret;
@@ -372,6 +410,19 @@ int sh_execute_logical(char **args) {
    It handles backspaces and intercepts TAB (for autocompletion) until a newline is entered.
 */
 char *sh_read_line(void) {
+    /* Not a terminal (a script or a pipe): read whole lines, no echo */
+    if (!isatty(STDIN_FILENO)) {
+        char *line = NULL;
+        size_t bufsize = 0;
+        ssize_t len = getline(&line, &bufsize, stdin);
+        if (len < 0) {
+            free(line);
+            return NULL;
+        }
+        if (len > 0 && line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        return line;
+    }
     enableRawMode();
     int bufsize = BUFFER_SIZE;
     char *buffer = malloc(bufsize);
@@ -474,6 +525,15 @@ int autocomplete(char *buffer, int pos) {
     return pos;
 }
 
+/* --- Background reaping ---
+   Background commands are not waited for when they start, so collect any
+   that have exited since the last prompt; otherwise they stay zombies. */
+void reap_background(void) {
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        printf("[Background pid %d done]\n", pid);
+}
+
 /* --- Main Shell Loop ---
    The shell prompt is printed, input is read (with history and autocompletion support),
    tokenized, and executed (with support for redirection, pipes, background execution,
@@ -483,11 +543,17 @@ void sh_loop(void) {
     char *line;
     char **args;
     int status;
+    int interactive = isatty(STDIN_FILENO);
 
     do {
-        printf("utsh$ ");
-        fflush(stdout);
+        reap_background();
+        if (interactive) {
+            printf("utsh$ ");
+            fflush(stdout);
+        }
         line = sh_read_line();
+        if (line == NULL)   /* End of a script */
+            break;
 
         /* Check for history invocation: if the command starts with "!" followed by a digit */
         if (line[0] == '!' && isdigit(line[1])) {
@@ -515,5 +581,5 @@ void sh_loop(void) {
 
 int main() {
     sh_loop();
-    return EXIT_SUCCESS;
+    return last_status;
 }
\ No newline at end of file
@@ -1,14 +1,68 @@
 /*
  * sh.c - A simple Unix shell with:
  *   - Execution of external commands (via fork/execvp)
- *   - I/O redirection (< and >)
- *   - Pipelines (commands separated by |)
+ *   - I/O redirection (<, > and >>)
+ *   - Pipelines (commands separated by |); "a |> b" relays through the
+ *     shell with splice() and reports throughput and which side is slower
  *   - Multiple commands per line separated by ';'
+ *   - "&&" and "||" lists, short-circuited on real exit statuses ($? holds
+ *     the last one); lines are parsed into a tree before anything runs
+ *   - Quoting with '...', "..." and backslashes; "#" comments
  *   - Built‑in "cd" command
  *   - Background execution (if command ends with &)
+ *   - Job control: every pipeline runs in its own process group and is
+ *     tracked in a job table; the built‑ins "jobs", "fg", "bg" and "wait"
+ *     operate on it. Children are reaped through a signalfd, so finished
+ *     background jobs never linger as zombies.
+ *   - A single epoll event loop waits on the terminal, the signalfd and
+ *     timers, so background jobs are reported as soon as they finish,
+ *     even while a prompt is waiting for input.
+ *   - "set -o jobslots=N" bounds the number of running background jobs;
+ *     further "&" jobs wait in a FIFO queue until a slot frees up.
+ *   - "parallel [-j N] [-k] [--halt when,fail=N] cmd {}" runs a command
+ *     once per line of standard input with N workers, buffering each
+ *     job's output so that lines from different jobs never interleave.
+ *   - Command lookups are cached per name ("hash" lists or clears them).
+ *   - Stages are reaped with wait4(): ${PIPESTATUS[@]}, "set -o pipefail"
+ *     and "pipeinfo" (per-stage status, CPU time, RSS, context switches).
+ *   - "time [-p|-j] list" times a whole pipeline or && / || list, adding
+ *     up the rusage and /proc/<pid>/io counters of its processes.
+ *   - "pstat list" reports perf_event_open() counters per pipeline stage.
+ *   - "profile" reports latency percentiles for each phase of the shell's
+ *     own work; UTSH_PROFILE=folded dumps flamegraph stacks at exit.
+ *   - UTSH_TRACE=file records a binary event trace (spawn, exec, exit,
+ *     pipes, redirections, built-ins); utsh-trace.c converts it to JSON.
+ *   - UTSH_ZYGOTE=1 forks a spawn server at startup that starts external
+ *     commands for the shell (see zygote_serve()).
+ *   - "utsh -c string" runs a command string and "utsh file" (or a stdin
+ *     that is not a terminal) a script, without prompts, streaming its
+ *     lines as they are read; the last command of a -c string, a script
+ *     or a forked subshell is exec'd in place when nothing is left for
+ *     the shell to do (see exec_in_place()). UTSH_CACHE=dir caches the
+ *     parsed form of script files (see "Compiled scripts").
+ *   - Batch mode, "utsh -j N -f jobs.sh", runs the lines of a job file as
+ *     a dependency graph on N slots (see run_batch()).
+ *   - if/elif/else, while, until, for and case, compiled on first use into
+ *     bytecode run by a threaded interpreter (see vm_run()); ":", "true",
+ *     "false", "break" and "continue" are built in.
+ *   - Shell variables ($name, ${name}, name=value, "FOO=1 cmd", "export",
+ *     "unset") in a hash table; exec gets a cached environment that is
+ *     rebuilt only after an exported variable changes.
+ *   - $((expression)) arithmetic on 64-bit integers, compiled once per
+ *     expression (see "Arithmetic").
+ *   - $(commands) and `commands` substitution, read through a pipe by the
+ *     reactor and split on IFS (see "Command substitution").
+ *   - ( list ) subshells; those that only change variables, the cwd or
+ *     options, and $(...) of built-ins, run in the shell with the changes
+ *     journaled and undone (see "Subshell journal").
+ *   - Here-documents (<<, <<-) and here-strings (<<<), given to the command
+ *     through a pipe or a sealed memfd, never a file (see "Here-documents").
  *
  * Challenge features:
  *   - Command history (the built‑in "history" command prints all commands entered, excluding the "history" command itself)
+ *     with the start time, duration, status, peak RSS and cwd of each line
+ *     ("history -v", "--slowest", "--failed", "--stats"); UTSH_HISTFILE
+ *     keeps it across sessions.
  *   - Globbing: Wildcard expansion for arguments (using glob())
  *
  * Compile with:
@@ -18,39 +72,60 @@
  *      ./utsh
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <glob.h>
-
-#define MAX_TOKENS 128
+#include <fnmatch.h>
+#include <ctype.h>
+#include <signal.h>
+#include <stdint.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <linux/perf_event.h>
 
 /* ------------------------ */
 /* Global command history   */
 /* ------------------------ */
-static char **history = NULL;
+/* One line as it was entered, with what running it cost. The fields
+   are filled in once the line has finished; entries read back from an
+   old plain-text history file have them all unknown (-1). */
+typedef struct {
+    char *text;
+    time_t start;     /* Wall-clock time the line was entered */
+    double secs;      /* Elapsed seconds, -1 if unknown or still running */
+    int status;       /* $? after the line, -1 if unknown */
+    long maxrss;      /* Largest RSS of any process it started, KiB */
+    char *cwd;        /* Directory it was entered in */
+} history_entry_t;
+
+static history_entry_t *history = NULL;
 static int history_count = 0;
 static int history_capacity = 0;
+static int history_fd = -1;         /* UTSH_HISTFILE, opened for appending */
+static int history_current = -1;    /* Entry of the line being run, or -1 */
 
-void add_history(const char *line) {
-    // Duplicate the line and remove a trailing newline if present.
-    char *copy = strdup(line);
-    if (!copy) {
-        perror("strdup");
-        exit(EXIT_FAILURE);
-    }
-    size_t len = strlen(copy);
-    if (len > 0 && copy[len - 1] == '\n') {
-        copy[len - 1] = '\0';
-    }
+static history_entry_t *history_append(char *text, char *cwd) {
     if (history_capacity == 0) {
         history_capacity = 10;
-        history = malloc(history_capacity * sizeof(char *));
+        history = malloc(history_capacity * sizeof(history_entry_t));
         if (!history) {
             perror("malloc history");
             exit(EXIT_FAILURE);
@@ -58,19 +133,152 @@ void add_history(const char *line) {
     }
     if (history_count >= history_capacity) {
         history_capacity *= 2;
-        history = realloc(history, history_capacity * sizeof(char *));
+        history = realloc(history, history_capacity * sizeof(history_entry_t));
         if (!history) {
             perror("realloc history");
             exit(EXIT_FAILURE);
         }
     }
-    history[history_count++] = copy;
+    history_entry_t *e = &history[history_count++];
+    e->text = text;
+    e->cwd = cwd;
+    e->start = 0;
+    e->secs = -1;
+    e->status = -1;
+    e->maxrss = 0;
+    return e;
+}
+
+/* A compound command typed over several lines, as one line: each
+   newline becomes "; ", or just a space where a command is about to
+   start anyway (after "then", "do", "|", ";;" and so on). */
+static char *history_join(const char *text) {
+    static const char *const openers[] = { "then", "do", "else", "elif", "if", "while",
+                                           "until", "in", "time", "pstat" };
+    char *joined = malloc(2 * strlen(text) + 1);
+    if (!joined) {
+        perror("malloc history_join");
+        exit(EXIT_FAILURE);
+    }
+    size_t n = 0;
+    for (const char *c = text; *c; c++) {
+        if (*c != '\n') {
+            joined[n++] = *c;
+            continue;
+        }
+        while (n > 0 && isblank((unsigned char)joined[n - 1]))
+            n--;
+        size_t word = n;
+        while (word > 0 && !isspace((unsigned char)joined[word - 1]))
+            word--;
+        int space = n == 0 || strchr(";&|()", joined[n - 1]);
+        for (size_t i = 0; !space && i < sizeof(openers) / sizeof(openers[0]); i++)
+            space = n - word == strlen(openers[i]) && memcmp(joined + word, openers[i], n - word) == 0;
+        if (!space)
+            joined[n++] = ';';
+        if (n > 0)
+            joined[n++] = ' ';
+    }
+    joined[n] = '\0';
+    return joined;
+}
+
+void add_history(const char *line) {
+    // Copy the line as one line, without a trailing newline.
+    size_t len = strlen(line);
+    while (len > 0 && line[len - 1] == '\n')
+        len--;
+    char *trimmed = strndup(line, len);
+    if (!trimmed) {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    char *copy = history_join(trimmed);
+    free(trimmed);
+    history_entry_t *e = history_append(copy, getcwd(NULL, 0));
+    e->start = time(NULL);
+}
+
+/* Fill in how the entry's line went and append it to the history file
+   as one write(), so that several shells can share the file. The format
+   is one line per entry: start, seconds, status, max RSS (KiB) and cwd,
+   tab-separated, then the command text up to the end of the line. */
+static void history_finish(history_entry_t *e, double secs, int status) {
+    e->secs = secs;
+    e->status = status;
+    if (history_fd < 0)
+        return;
+    const char *cwd = e->cwd && !strpbrk(e->cwd, "\t\n") ? e->cwd : "-";
+    char *rec;
+    int len = asprintf(&rec, "%lld\t%.6f\t%d\t%ld\t%s\t%s\n", (long long)e->start,
+                       secs, status, e->maxrss, cwd, e->text);
+    if (len < 0) {
+        perror("asprintf history");
+        exit(EXIT_FAILURE);
+    }
+    if (write(history_fd, rec, len) != len)
+        perror("write history");
+    free(rec);
+}
+
+/* Load the entries of a history file (a line without the leading fields
+   is taken as a bare command) and keep it open for appending. */
+static void history_open(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f) {
+        char *line = NULL;
+        size_t bufsize = 0;
+        ssize_t len;
+        while ((len = getline(&line, &bufsize, f)) != -1) {
+            if (len > 0 && line[len - 1] == '\n')
+                line[--len] = '\0';
+            if (len == 0)
+                continue;
+            long long start;
+            double secs;
+            int status;
+            long maxrss;
+            int cwd_at = 0, cwd_end = 0;
+            history_entry_t *e;
+            if (sscanf(line, "%lld\t%lf\t%d\t%ld\t%n%*[^\t]%n", &start, &secs,
+                       &status, &maxrss, &cwd_at, &cwd_end) == 4 && cwd_end > cwd_at &&
+                line[cwd_end] == '\t') {
+                char *cwd = strndup(line + cwd_at, cwd_end - cwd_at);
+                char *text = strdup(line + cwd_end + 1);
+                if (!cwd || !text) {
+                    perror("strdup");
+                    exit(EXIT_FAILURE);
+                }
+                if (strcmp(cwd, "-") == 0) {
+                    free(cwd);
+                    cwd = NULL;
+                }
+                e = history_append(text, cwd);
+                e->start = (time_t)start;
+                e->secs = secs;
+                e->status = status;
+                e->maxrss = maxrss;
+            } else {
+                char *text = strdup(line);
+                if (!text) {
+                    perror("strdup");
+                    exit(EXIT_FAILURE);
+                }
+                history_append(text, NULL);
+            }
+        }
+        free(line);
+        fclose(f);
+    }
+    history_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history_fd < 0)
+        perror(path);
 }
 
 void print_history(void) {
     // Print history entries in the format: "1 pwd" (number, a space, then command)
     for (int i = 0; i < history_count; i++) {
-        printf("%d %s\n", i + 1, history[i]);
+        printf("%d %s\n", i + 1, history[i].text);
     }
 }
 
@@ -81,467 +289,7543 @@ typedef struct {
     char **args;      /* NULL-terminated array of arguments */
     char *infile;     /* Input redirection file (if any) */
     char *outfile;    /* Output redirection file (if any) */
+    int append;       /* Nonzero if outfile was given with >> */
+    int meter;        /* Nonzero if stdout feeds the next stage through |> */
     int background;   /* Nonzero if command is to run in the background */
+    struct ast *body; /* A compound command run by the child instead */
+    int here_fd;      /* Here-document to read as stdin, or -1 */
+    char **assigns;   /* "name=value" words before the command (or NULL) */
 } command_t;
 
+/* ------------------------ */
+/* Tokens and parse tree    */
+/* ------------------------ */
+typedef enum {
+    TOK_WORD,
+    TOK_SEMI,         /* ; */
+    TOK_DSEMI,        /* ;; ends a case clause */
+    TOK_NEWLINE,
+    TOK_AMP,          /* & */
+    TOK_AND_IF,       /* && */
+    TOK_OR_IF,        /* || */
+    TOK_PIPE,         /* | */
+    TOK_METER,        /* |> metered pipe */
+    TOK_LESS,         /* < */
+    TOK_GREAT,        /* > */
+    TOK_DGREAT,       /* >> */
+    TOK_DLESS,        /* << */
+    TOK_DLESSDASH,    /* <<- */
+    TOK_TLESS,        /* <<< */
+    TOK_HEREDOC,      /* The body of the here-document whose delimiter
+                         precedes it, the lines after the next newline */
+    TOK_LPAREN,       /* ( */
+    TOK_RPAREN,       /* ) */
+    TOK_END
+} token_type_t;
+
+/* Tokens are views into the line (which, for a script, is a view into
+   the mapped file): nothing is copied until expansion builds the
+   NUL-terminated strings that exec needs. */
+typedef struct {
+    token_type_t type;
+    int start, end;   /* Offsets of the token in the line; a TOK_WORD
+                         is the word as typed, quotes included */
+} token_t;
+
+typedef struct {
+    const char *s;    /* Into the source line; NULL if absent */
+    int len;
+} word_t;
+
+typedef enum {
+    AST_COMMAND,      /* words and redirections */
+    AST_PIPELINE,     /* stages joined by | */
+    AST_AND,          /* left && right */
+    AST_OR,           /* left || right */
+    AST_SEQ,          /* left ; right */
+    AST_BACKGROUND,   /* left & */
+    AST_TIME,         /* time [-p|-j] left */
+    AST_PSTAT,        /* pstat left */
+    AST_IF,           /* if left then right [elif/else next] fi */
+    AST_WHILE,        /* while left do right done */
+    AST_UNTIL,        /* until left do right done */
+    AST_FOR,          /* for words[0] in words[1..] do right done */
+    AST_CASE,         /* case words[0] in stages esac */
+    AST_CLAUSE,       /* CASE: words) right ;; */
+    AST_SUBSHELL      /* ( left ) */
+} ast_type_t;
+
+enum { TIME_HUMAN, TIME_POSIX, TIME_JSON };
+
+/* ast_t.here: what infile holds, if it is not a file name */
+#define HERE_DOC    1     /* <<WORD: the body, expanded */
+#define HERE_RAW    2     /* <<'WORD': the body as is */
+#define HERE_STRING 3     /* <<< word */
+#define HERE_STRIP  4     /* <<-: also drop leading tabs */
+
+typedef struct ast {
+    ast_type_t type;
+    unsigned id;          /* Unique for the life of the shell (see tracing) */
+    const char *src;      /* Source text, used as the job's command line */
+    int src_len;
+    char *text;           /* src as a string, made on first use (ast_text()) */
+    struct ast *left;     /* AND, OR, SEQ, BACKGROUND */
+    struct ast *right;    /* AND, OR, SEQ and the bodies of compound commands */
+    struct ast *next;     /* IF: the elif (another IF) or else part */
+    struct ast **stages;  /* PIPELINE */
+    int num_stages;
+    word_t *words;        /* COMMAND: raw words, expanded when run */
+    int num_words;
+    word_t infile;        /* COMMAND: raw redirection targets */
+    word_t outfile;
+    int here;             /* infile is a here-document or -string (HERE_*) */
+    int append;
+    int meter;            /* COMMAND: output goes through a metered pipe (|>) */
+    int format;           /* TIME: TIME_HUMAN, TIME_POSIX or TIME_JSON */
+    struct prog *code;    /* Compiled on first run (see execute_node()) */
+    int in_shell;         /* SUBSHELL: 1 if it runs as a virtual subshell,
+                             -1 if it forks, 0 until first run */
+} ast_t;
+
+/* ------------------------ */
+/* Job structures           */
+/* ------------------------ */
+/* One entry per pipeline stage. */
+typedef struct {
+    pid_t pid;
+    int status;       /* Raw wait status from the last state change */
+    int stopped;      /* Nonzero while the process is stopped */
+    int completed;    /* Nonzero once the process has been reaped */
+    struct rusage ru; /* Resources used, filled in when it is reaped */
+    struct timespec end;  /* When it was reaped */
+    unsigned long long io[4]; /* rchar, wchar, read_bytes, write_bytes; timed jobs only */
+    int sampled;          /* "jobs -v" has taken a first sample */
+    int cached;           /* stat_fd and io_fd stay open between samples */
+    int stat_fd, io_fd;   /* /proc/<pid>/stat and io, when cached */
+    uint64_t sample_ns;   /* Time of the previous sample */
+    unsigned long long sample_ticks, sample_rchar, sample_wchar;
+} process_t;
+
+/* A "|>" pipe: the shell relays the data from one stage to the next
+   with splice() and keeps count. */
+typedef struct meter {
+    int in, out;              /* Shell-side ends; -1 once finished */
+    int stage;                /* Feeds stage + 1 */
+    int waiting_output;       /* Data is pending but the next stage is not reading */
+    unsigned long long bytes;
+    unsigned long long last_bytes;  /* At the previous status line */
+    uint64_t start, end, since;     /* Nanoseconds; since = last state change */
+    uint64_t wait_in, wait_out;     /* Time spent waiting on either side */
+    struct meter *next;
+} meter_t;
+
+/* A job is one pipeline (possibly of a single command). The job owns
+   its parsed commands and is freed once it has completed and, for
+   background jobs, the user has been told about it. */
+typedef struct job {
+    int id;               /* Job number, as used by %n */
+    char *cmdline;        /* Command text shown by "jobs" */
+    pid_t pgid;           /* Process group shared by every stage */
+    int io[3];            /* stdin of the first stage, stdout of the last, stderr */
+    command_t **cmds;
+    int num_procs;
+    process_t *procs;
+    int background;
+    int queued;           /* Waiting for a job slot; not started yet */
+    struct timespec start;/* When the job was launched */
+    unsigned node;        /* Id of the parse-tree node it runs, for tracing */
+    int history_entry;    /* History entry of the line that started it, or -1 */
+    int *perf_fds;        /* Under "pstat": PSTAT_EVENTS counters per stage */
+    meter_t *meters;      /* Relays for the job's "|>" pipes */
+    int meter_timer;      /* timerfd of the status line, or -1 */
+    int timed;            /* Started under "time"; counted when it exits */
+    int in_place;         /* The last stage replaces the shell itself */
+    int notified;         /* Nonzero once a state change was reported */
+    struct termios tmodes;/* Terminal modes saved when the job stopped */
+    struct job *next;
+} job_t;
+
+/* Per-stage result of the last foreground pipeline, kept for
+   $PIPESTATUS and "pipeinfo". */
+typedef struct {
+    char *name;           /* Command name of the stage */
+    pid_t pid;            /* 0 for a built-in run by the shell itself */
+    int status;           /* Exit code, or 128 + signal */
+    struct rusage ru;
+    double real;          /* Seconds from launch until reaped */
+} stage_info_t;
+
+/* What a running "time" adds up: every process of the jobs it starts,
+   as reported by wait4() and /proc/<pid>/io. */
+typedef struct {
+    struct timespec start;
+    double user, sys;     /* CPU seconds of the children */
+    long maxrss;          /* Largest RSS of any child, in KiB */
+    long minflt, majflt, nvcsw, nivcsw;
+    unsigned long long io[4];
+    int procs;
+} time_acc_t;
+
+/* One row of "pstat" output: the counters of one pipeline stage. */
+#define PSTAT_EVENTS 6
+
+typedef struct {
+    char *name;
+    unsigned node;
+    int stage;
+    double value[PSTAT_EVENTS];   /* Scaled up if the counter was multiplexed */
+    int valid;                    /* Bit i set if event i was counted */
+} pstat_row_t;
+
+typedef struct {
+    pstat_row_t *rows;
+    int count;
+} pstat_acc_t;
+
 /* Function prototypes */
 char *read_line(void);
-char **split_line(char *line, const char *delim);
-char **expand_globs(char **args);
-command_t *parse_command(char *cmd_str);
+token_t *lex_line(const char *line, int len);
+void free_tokens(token_t *toks);
+void free_ast(ast_t *n);
+void free_prog(struct prog *prog);
+char *expand_word(word_t raw, char **pattern);
+command_t *expand_command(ast_t *n);
+char **expand_globs(char **args, char **patterns, int first);
 void free_command(command_t *cmd);
-int execute_command(command_t *cmd);
-int execute_pipeline(command_t **cmds, int num_cmds);
+int execute_node(ast_t *n);
+int execute_pipeline(command_t **cmds, int num_cmds, const char *cmdline);
+void init_shell(int allow_interactive);
+int run_line(char *line);
+int run_text(const char *line, int len);
+void reap_children(void);
+void notify_jobs(void);
+int run_builtin(char **args);
+void print_prompt(void);
+const char *path_lookup(const char *name);
+void path_cache_clear(void);
+
+typedef struct builtin {
+    const char *name;
+    int (*func)(char **args);
+    int subshell;     /* May run in a virtual subshell (see "Subshell journal") */
+} builtin_t;
+static const builtin_t *find_builtin(const char *name);
 
 /* ------------------------ */
-/* Read a line from input   */
+/* Shell state              */
 /* ------------------------ */
-char *read_line(void) {
-    char *line = NULL;
-    size_t bufsize = 0;
-    if (getline(&line, &bufsize, stdin) == -1) {
-        if (feof(stdin)) {  // EOF encountered
-            free(line);
-            return NULL;
-        } else {
-            perror("getline");
-            free(line);
-            return NULL;
+static job_t *job_list = NULL;
+static int shell_interactive = 0;
+static pid_t shell_pgid;
+static struct termios shell_tmodes;
+static int signal_fd = -1;      /* signalfd for SIGCHLD, SIGWINCH and SIGINT */
+static int term_columns = 80;   /* Terminal width, refreshed on SIGWINCH */
+static int at_prompt = 0;       /* Nonzero while waiting for a command line */
+static int interrupted = 0;     /* Set when SIGINT reaches the shell itself */
+static int last_status = 0;     /* Exit status of the last pipeline, $? */
+static pid_t last_bg_pid = 0;   /* Last process started in the background, $! */
+static int zygote_fd = -1;      /* Socket to the spawn server, if UTSH_ZYGOTE */
+static int exec_tail = 0;       /* The node being run is the last thing this
+                                   shell will do (see exec_in_place()) */
+static FILE *subst_stdout = NULL;   /* The real stdout while a $(...) run in
+                                       the shell captures it */
+
+/* Options changed with "set -o" / "set +o" */
+static int opt_jobslots = 0;    /* Max running background jobs, 0 = unlimited */
+static int opt_pipefail = 0;    /* A pipeline fails if any stage fails */
+
+/* The last foreground pipeline, one entry per stage */
+static stage_info_t *last_stages = NULL;
+static int last_num_stages = 0;
+
+static time_acc_t *timing = NULL;   /* Set while "time" runs a list */
+static pstat_acc_t *pstat_acc = NULL; /* Set while "pstat" runs a list */
+
+/* ------------------------ */
+/* Self-profiling           */
+/* ------------------------ */
+/* "profile on" (or UTSH_PROFILE in the environment) times each phase of
+   running a line. Latencies go into log-linear histograms in the style
+   of HdrHistogram: 16 sub-buckets per power of two, so any value is
+   recorded within about 6% at a fixed cost of one array increment.
+   Nested phases also add their self time to a folded-stack table that
+   flamegraph.pl reads directly. When profiling is off each probe is a
+   single test of a global. */
+enum { PROF_READ, PROF_LINE, PROF_LEX, PROF_PARSE, PROF_EXPAND, PROF_GLOB,
+       PROF_SPAWN, PROF_WAIT, PROF_NPHASES };
+
+static const char *const prof_names[PROF_NPHASES] = {
+    "read", "run_line", "lex", "parse", "expand", "glob", "spawn", "wait"
+};
+
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (61 << HIST_SUB_BITS)
+#define PROF_MAX_DEPTH 8
+#define PROF_MAX_STACKS 64
+
+typedef struct {
+    uint64_t count, sum, min, max;      /* Nanoseconds */
+    uint32_t buckets[HIST_BUCKETS];
+} hist_t;
+
+typedef struct {
+    int phase;
+    uint64_t start;
+    uint64_t child;       /* Time spent in nested phases */
+} prof_frame_t;
+
+typedef struct {
+    unsigned char path[PROF_MAX_DEPTH];
+    int depth;
+    uint64_t self;        /* Nanoseconds not spent in a nested phase */
+} prof_stack_t;
+
+static int profiling = 0;
+static int profile_folded = 0;      /* UTSH_PROFILE=folded: dump stacks at exit */
+static hist_t prof_hist[PROF_NPHASES];
+static prof_frame_t prof_frames[PROF_MAX_DEPTH];
+static int prof_depth = 0;
+static prof_stack_t prof_stacks[PROF_MAX_STACKS];
+static int prof_num_stacks = 0;
+
+static uint64_t prof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS))
+        return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    int index = ((shift + 1) << HIST_SUB_BITS) + (int)((v >> shift) & ((1u << HIST_SUB_BITS) - 1));
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+/* Midpoint of the values that land in bucket index. */
+static uint64_t hist_value(int index) {
+    if (index < (1 << HIST_SUB_BITS))
+        return index;
+    int shift = (index >> HIST_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((index & ((1 << HIST_SUB_BITS) - 1)) | (1 << HIST_SUB_BITS)) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+static void hist_record(hist_t *h, uint64_t v) {
+    if (h->count == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+    h->count++;
+    h->sum += v;
+    h->buckets[hist_index(v)]++;
+}
+
+static uint64_t hist_percentile(const hist_t *h, double pct) {
+    uint64_t rank = (uint64_t)(pct / 100.0 * h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = hist_value(i);
+            return v < h->min ? h->min : v > h->max ? h->max : v;
         }
     }
-    return line;
+    return h->max;
+}
+
+static void prof_begin(int phase) {
+    if (!profiling)
+        return;
+    if (prof_depth < PROF_MAX_DEPTH) {
+        prof_frames[prof_depth].phase = phase;
+        prof_frames[prof_depth].child = 0;
+        prof_frames[prof_depth].start = prof_now();
+    }
+    prof_depth++;
+}
+
+static void prof_end(void) {
+    if (!profiling || prof_depth == 0)
+        return;
+    if (--prof_depth >= PROF_MAX_DEPTH)
+        return;
+    prof_frame_t *f = &prof_frames[prof_depth];
+    uint64_t elapsed = prof_now() - f->start;
+    hist_record(&prof_hist[f->phase], elapsed);
+    if (prof_depth > 0)
+        prof_frames[prof_depth - 1].child += elapsed;
+
+    /* Charge the self time to this exact stack of phases */
+    int depth = prof_depth + 1;
+    prof_stack_t *s = NULL;
+    for (int i = 0; i < prof_num_stacks && !s; i++) {
+        if (prof_stacks[i].depth != depth)
+            continue;
+        int k = 0;
+        while (k < depth && prof_stacks[i].path[k] == prof_frames[k].phase)
+            k++;
+        if (k == depth)
+            s = &prof_stacks[i];
+    }
+    if (!s && prof_num_stacks < PROF_MAX_STACKS) {
+        s = &prof_stacks[prof_num_stacks++];
+        s->depth = depth;
+        for (int k = 0; k < depth; k++)
+            s->path[k] = prof_frames[k].phase;
+    }
+    if (s)
+        s->self += elapsed - f->child;
+}
+
+static void profile_reset(void) {
+    memset(prof_hist, 0, sizeof(prof_hist));
+    prof_num_stacks = 0;
+    prof_depth = 0;
+}
+
+/* One line per distinct stack, "utsh;run_line;expand;glob <usec>". */
+static void profile_print_folded(FILE *out) {
+    for (int i = 0; i < prof_num_stacks; i++) {
+        fputs("utsh", out);
+        for (int k = 0; k < prof_stacks[i].depth; k++)
+            fprintf(out, ";%s", prof_names[prof_stacks[i].path[k]]);
+        fprintf(out, " %llu\n", (unsigned long long)(prof_stacks[i].self / 1000));
+    }
+}
+
+static void profile_print(void) {
+    printf("%-9s %8s %10s %10s %10s %10s %10s %10s\n", "PHASE", "COUNT",
+           "MEAN(us)", "P50", "P90", "P99", "P99.9", "MAX");
+    for (int i = 0; i < PROF_NPHASES; i++) {
+        const hist_t *h = &prof_hist[i];
+        if (h->count == 0)
+            continue;
+        printf("%-9s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", prof_names[i],
+               (unsigned long long)h->count, h->sum / 1e3 / h->count,
+               hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+               hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+}
+
+/* Called on the way out of main(). */
+static void profile_finish(void) {
+    if (profile_folded)
+        profile_print_folded(stderr);
 }
 
 /* ------------------------ */
-/* Split a string by delim  */
+/* Event trace              */
 /* ------------------------ */
-char **split_line(char *line, const char *delim) {
-    int bufsize = MAX_TOKENS;
-    int position = 0;
-    char **tokens = malloc(bufsize * sizeof(char *));
-    if (!tokens) {
-        fprintf(stderr, "Allocation error in split_line\n");
-        exit(EXIT_FAILURE);
-    }
-    char *token = strtok(line, delim);
-    while (token != NULL) {
-        tokens[position++] = token;
-        if (position >= bufsize) {
-            bufsize += MAX_TOKENS;
-            tokens = realloc(tokens, bufsize * sizeof(char *));
-            if (!tokens) {
-                fprintf(stderr, "Allocation error in split_line\n");
-                exit(EXIT_FAILURE);
-            }
-        }
-        token = strtok(NULL, delim);
+/* With UTSH_TRACE=file every spawn, exec, exit, pipe, redirection and
+   built-in call is appended to file as a fixed-size binary record; the
+   utsh-trace tool turns it into Chrome trace JSON. Each process buffers
+   its own events (a child starts with an empty buffer), so recording
+   needs no locking, only a store into the buffer; the buffer is written
+   out with one O_APPEND write() when it fills, before exec, at exit and
+   whenever the shell waits for input. Keep the layout in step with
+   utsh-trace.c. */
+#define TRACE_MAGIC "UTSHTRC1"
+#define TRACE_BUF 256
+
+enum { TR_SPAWN = 1, TR_EXEC, TR_EXIT, TR_PIPE, TR_REDIR, TR_BUILTIN_BEGIN, TR_BUILTIN_END };
+
+typedef struct {
+    uint64_t ts;          /* CLOCK_MONOTONIC, nanoseconds */
+    int32_t pid;          /* Process the event is about */
+    uint32_t node;        /* Parse-tree node (pipeline) being run */
+    uint16_t type;
+    uint16_t stage;       /* Pipeline stage */
+    int32_t arg;          /* Exit status, or a file descriptor */
+    int32_t arg2;         /* Second file descriptor */
+    char name[20];        /* Command name or file, truncated */
+} trace_event_t;
+
+static int trace_fd = -1;
+static trace_event_t trace_buf[TRACE_BUF];
+static int trace_count = 0;
+static unsigned trace_node = 0;     /* Node the shell is running now */
+static int trace_stage = 0;         /* In a child: its pipeline stage */
+
+static void trace_flush(void) {
+    if (trace_fd < 0 || trace_count == 0)
+        return;
+    ssize_t len = (ssize_t)(trace_count * sizeof(trace_event_t));
+    if (write(trace_fd, trace_buf, len) != len)
+        perror("utsh: trace");
+    trace_count = 0;
+}
+
+static void trace_event(int type, pid_t pid, unsigned node, int stage,
+                        int arg, int arg2, const char *name) {
+    if (trace_fd < 0)
+        return;
+    trace_event_t *e = &trace_buf[trace_count];
+    e->ts = prof_now();
+    e->pid = pid;
+    e->node = node;
+    e->type = type;
+    e->stage = stage;
+    e->arg = arg;
+    e->arg2 = arg2;
+    memset(e->name, 0, sizeof(e->name));
+    if (name)
+        strncpy(e->name, name, sizeof(e->name) - 1);
+    if (++trace_count == TRACE_BUF)
+        trace_flush();
+}
+
+/* In a new child: the parent's buffered events are not ours to write. */
+static void trace_forget(void) {
+    trace_count = 0;
+}
+
+static void trace_open(const char *path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        perror(path);
+        return;
     }
-    tokens[position] = NULL;
-    return tokens;
+    /* Header: magic, record size, and the time the shell started */
+    char header[24] = TRACE_MAGIC;
+    uint32_t size = sizeof(trace_event_t);
+    uint64_t start = prof_now();
+    memcpy(header + 8, &size, sizeof(size));
+    memcpy(header + 16, &start, sizeof(start));
+    if (write(trace_fd, header, sizeof(header)) != (ssize_t)sizeof(header))
+        perror(path);
+    atexit(trace_flush);
 }
 
 /* ------------------------ */
-/* Globbing expansion       */
+/* Event loop               */
 /* ------------------------ */
-/* For each argument (except index 0, the command name),
-   if a wildcard character (*, ? or [) is found, use glob()
-   to expand it into matching filenames. */
-char **expand_globs(char **args) {
-    int new_capacity = 16;
-    int new_count = 0;
-    char **new_args = malloc(new_capacity * sizeof(char *));
-    if (!new_args) {
-        perror("malloc expand_globs");
+/* All waiting in the shell goes through one epoll instance: the terminal
+   while a prompt is up, the signalfd for child exits and other signals,
+   timerfds, and any descriptor a built-in wants to watch (pipes,
+   eventfds). Callbacks only ever run from reactor_run_once(). */
+typedef void (*event_cb)(int fd, uint32_t events, void *data);
+
+typedef struct watch {
+    int fd;
+    event_cb cb;
+    void *data;
+    int is_timer;      /* Consume the expiry count before calling cb */
+    int removed;       /* Deleted while dispatching; freed afterwards */
+    struct watch *next;
+} watch_t;
+
+static int epoll_fd = -1;
+static watch_t *watch_list = NULL;
+static int reactor_depth = 0;   /* Nesting of reactor_run_once() calls */
+
+void reactor_init(void) {
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
         exit(EXIT_FAILURE);
     }
-    for (int i = 0; args[i] != NULL; i++) {
-        if (i == 0) {
-            /* Do not expand the command name */
-            new_args[new_count++] = strdup(args[i]);
+}
+
+/* Watch fd for the given epoll events; cb runs from the event loop. */
+int reactor_add(int fd, uint32_t events, event_cb cb, void *data) {
+    watch_t *w = calloc(1, sizeof(watch_t));
+    if (!w) {
+        perror("calloc watch");
+        exit(EXIT_FAILURE);
+    }
+    w->fd = fd;
+    w->cb = cb;
+    w->data = data;
+    struct epoll_event ev = { .events = events, .data.ptr = w };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        free(w);
+        return -1;
+    }
+    w->next = watch_list;
+    watch_list = w;
+    return 0;
+}
+
+static void reactor_sweep(void) {
+    watch_t **pp = &watch_list;
+    while (*pp) {
+        watch_t *w = *pp;
+        if (w->removed) {
+            *pp = w->next;
+            free(w);
         } else {
-            if (strpbrk(args[i], "*?[") != NULL) {
-                glob_t g;
-                int flags = 0;
-                int ret = glob(args[i], flags, NULL, &g);
-                if (ret != 0) {
-                    /* If glob fails or no match, use the original argument */
-                    new_args[new_count++] = strdup(args[i]);
-                } else {
-                    for (size_t j = 0; j < g.gl_pathc; j++) {
-                        if (new_count >= new_capacity - 1) {
-                            new_capacity *= 2;
-                            new_args = realloc(new_args, new_capacity * sizeof(char *));
-                            if (!new_args) {
-                                perror("realloc expand_globs");
-                                exit(EXIT_FAILURE);
-                            }
-                        }
-                        new_args[new_count++] = strdup(g.gl_pathv[j]);
-                    }
-                }
-                globfree(&g);
-            } else {
-                new_args[new_count++] = strdup(args[i]);
-            }
+            pp = &w->next;
         }
     }
-    new_args[new_count] = NULL;
-    return new_args;
 }
 
-/* ------------------------ */
-/* Parse a command string   */
-/* ------------------------ */
-command_t *parse_command(char *cmd_str) {
-    command_t *cmd = malloc(sizeof(command_t));
-    if (!cmd) {
-        perror("malloc parse_command");
-        exit(EXIT_FAILURE);
+/* Stop watching fd. The caller still owns (and closes) the descriptor. */
+void reactor_del(int fd) {
+    for (watch_t *w = watch_list; w; w = w->next) {
+        if (w->fd == fd && !w->removed) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            w->removed = 1;
+            break;
+        }
     }
-    cmd->infile = NULL;
-    cmd->outfile = NULL;
-    cmd->background = 0;
-    
-    /* Duplicate the command string because strtok will modify it */
-    char *cmd_copy = strdup(cmd_str);
-    if (!cmd_copy) {
-        perror("strdup");
-        free(cmd);
-        return NULL;
+    if (reactor_depth == 0)
+        reactor_sweep();
+}
+
+/* Arm a timerfd that fires after first_ms and then every interval_ms
+   (0 for a one-shot timer). Returns the timerfd, to be passed to
+   reactor_del() and closed by the caller. */
+int reactor_add_timer(long first_ms, long interval_ms, event_cb cb, void *data) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("timerfd_create");
+        return -1;
     }
-    
-    char **tokens = split_line(cmd_copy, " \t\r\n");
-    if (!tokens) {
-        free(cmd_copy);
-        free(cmd);
-        return NULL;
+    struct itimerspec its = {
+        .it_interval = { interval_ms / 1000, (interval_ms % 1000) * 1000000 },
+        .it_value = { first_ms / 1000, (first_ms % 1000) * 1000000 },
+    };
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        its.it_value.tv_nsec = 1;
+    if (timerfd_settime(fd, 0, &its, NULL) < 0 || reactor_add(fd, EPOLLIN, cb, data) < 0) {
+        perror("timerfd_settime");
+        close(fd);
+        return -1;
     }
-    
-    char **args = malloc(MAX_TOKENS * sizeof(char *));
-    if (!args) {
-        perror("malloc args");
-        free(tokens);
-        free(cmd_copy);
-        free(cmd);
-        return NULL;
+    watch_list->is_timer = 1;
+    return fd;
+}
+
+/* Wait up to timeout_ms (-1 for ever) and dispatch whatever is ready.
+   Returns the number of events handled, or -1 on error. */
+int reactor_run_once(int timeout_ms) {
+    struct epoll_event events[32];
+    int n = epoll_wait(epoll_fd, events, 32, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR)
+            return 0;
+        perror("epoll_wait");
+        return -1;
     }
-    int arg_index = 0;
-    for (int i = 0; tokens[i] != NULL; i++) {
-        if (strcmp(tokens[i], "<") == 0) {
-            i++;
-            if (tokens[i] == NULL) {
-                fprintf(stderr, "Expected filename after '<'\n");
-                break;
-            }
-            cmd->infile = strdup(tokens[i]);
-            if (!cmd->infile) perror("strdup infile");
-        } else if (strcmp(tokens[i], ">") == 0) {
-            i++;
-            if (tokens[i] == NULL) {
-                fprintf(stderr, "Expected filename after '>'\n");
-                break;
-            }
-            cmd->outfile = strdup(tokens[i]);
-            if (!cmd->outfile) perror("strdup outfile");
-        } else if (strcmp(tokens[i], "&") == 0) {
-            cmd->background = 1;
-        } else {
-            args[arg_index++] = strdup(tokens[i]);
+    reactor_depth++;
+    for (int i = 0; i < n; i++) {
+        watch_t *w = events[i].data.ptr;
+        if (w->removed)
+            continue;
+        if (w->is_timer) {
+            uint64_t expirations;
+            if (read(w->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+                continue;
         }
+        w->cb(w->fd, events[i].events, w->data);
     }
-    args[arg_index] = NULL;
-    cmd->args = args;
-    
-    /* Perform globbing expansion on the arguments */
-    char **old_args = cmd->args;
-    cmd->args = expand_globs(cmd->args);
-    /* Free the original argument strings and array */
-    for (int i = 0; old_args[i] != NULL; i++) {
-        free(old_args[i]);
+    reactor_depth--;
+    if (reactor_depth == 0)
+        reactor_sweep();
+    return n;
+}
+
+static int stdin_ready = 0;
+
+static void on_stdin(int fd, uint32_t events, void *data) {
+    (void)fd; (void)events; (void)data;
+    stdin_ready = 1;
+}
+
+/* Run the event loop until a line can be read from the terminal. Returns
+   0 if SIGINT arrived first, in which case pending input is discarded. */
+static int wait_for_input(void) {
+    trace_flush();
+    stdin_ready = 0;
+    interrupted = 0;
+    at_prompt = 1;
+    if (reactor_add(STDIN_FILENO, EPOLLIN, on_stdin, NULL) < 0) {
+        at_prompt = 0;
+        return 1;
     }
-    free(old_args);
-    
-    free(tokens);
-    free(cmd_copy);
-    return cmd;
+    while (!stdin_ready && !interrupted)
+        if (reactor_run_once(-1) < 0)
+            break;
+    reactor_del(STDIN_FILENO);
+    at_prompt = 0;
+    if (interrupted) {
+        tcflush(STDIN_FILENO, TCIFLUSH);
+        printf("\n");
+        return 0;
+    }
+    return 1;
 }
 
 /* ------------------------ */
-/* Free a command_t         */
+/* Read a line from input   */
 /* ------------------------ */
-void free_command(command_t *cmd) {
-    if (!cmd)
-        return;
-    if (cmd->args) {
-        for (int i = 0; cmd->args[i] != NULL; i++) {
-            free(cmd->args[i]);
+char *read_line(void) {
+    char *line = NULL;
+    size_t bufsize = 0;
+    /* On a terminal, wait in the event loop so that child exits are
+       handled while the user is typing. */
+    if (shell_interactive && !wait_for_input()) {
+        line = strdup("\n");
+        if (!line) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
         }
-        free(cmd->args);
+        return line;
     }
-    if (cmd->infile)
-        free(cmd->infile);
-    if (cmd->outfile)
-        free(cmd->outfile);
-    free(cmd);
+    if (getline(&line, &bufsize, stdin) == -1) {
+        if (feof(stdin)) {  // EOF encountered
+            free(line);
+            return NULL;
+        } else {
+            perror("getline");
+            free(line);
+            return NULL;
+        }
+    }
+    return line;
 }
 
 /* ------------------------ */
-/* Execute a single command */
+/* Growable buffers         */
 /* ------------------------ */
-int execute_command(command_t *cmd) {
-    pid_t pid, wpid;
-    int status;
-    
-    pid = fork();
-    if (pid == 0) {
-        /* Child process */
-        if (cmd->infile != NULL) {
-            int fd_in = open(cmd->infile, O_RDONLY);
-            if (fd_in < 0) {
-                perror("open infile");
-                exit(EXIT_FAILURE);
-            }
-            if (dup2(fd_in, STDIN_FILENO) < 0) {
-                perror("dup2 infile");
-                exit(EXIT_FAILURE);
-            }
-            close(fd_in);
-        }
-        if (cmd->outfile != NULL) {
-            int fd_out = open(cmd->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (fd_out < 0) {
-                perror("open outfile");
-                exit(EXIT_FAILURE);
-            }
-            if (dup2(fd_out, STDOUT_FILENO) < 0) {
-                perror("dup2 outfile");
-                exit(EXIT_FAILURE);
-            }
-            close(fd_out);
-        }
-        if (execvp(cmd->args[0], cmd->args) == -1) {
-            perror("execvp");
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} outbuf_t;
+
+/* Make room for len more bytes and a NUL, doubling the buffer. */
+static void outbuf_reserve(outbuf_t *b, size_t len) {
+    if (b->len + len + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 64;
+        while (cap < b->len + len + 1)
+            cap *= 2;
+        b->data = realloc(b->data, cap);
+        if (!b->data) {
+            perror("realloc outbuf");
+            exit(EXIT_FAILURE);
         }
+        b->cap = cap;
+    }
+}
+
+static void outbuf_append(outbuf_t *b, const char *data, size_t len) {
+    outbuf_reserve(b, len);
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    b->data[b->len] = '\0';
+}
+
+static void outbuf_putc(outbuf_t *b, char c) {
+    outbuf_append(b, &c, 1);
+}
+
+/* Hand over the buffer as a NUL-terminated string (never NULL). */
+static char *outbuf_finish(outbuf_t *b) {
+    if (b->data == NULL)
+        outbuf_append(b, "", 0);
+    char *s = b->data;
+    b->data = NULL;
+    b->len = b->cap = 0;
+    return s;
+}
+
+/* ------------------------ */
+/* Script input             */
+/* ------------------------ */
+/* A script ("utsh file", or stdin when it is not a terminal) runs line
+   by line as it is read, so the shell starts before the script has been
+   read in full and a pipe into it never has to be closed first.
+
+   A regular file is mapped whole, and lines, tokens and parse trees are
+   views into the mapping: bytes are only copied when expansion builds
+   the strings handed to exec. The kernel reads ahead (MADV_SEQUENTIAL),
+   and the pages of lines already run are dropped every SCRIPT_RELEASE
+   bytes (MADV_DONTNEED), so RSS is bounded by the working set rather
+   than by the size of the file. When the file is the shell's stdin its
+   offset is shared with the commands the script starts: script_sync()
+   moves it to the first line not yet run before anything is spawned,
+   and reading resumes wherever they leave it, so a command that reads
+   stdin gets the rest of the script, as in other shells.
+
+   Anything else (a pipe) is read in 64 KiB chunks into a buffer, as
+   dash does. */
+#define SCRIPT_CHUNK 65536
+#define SCRIPT_RELEASE (8 << 20)
+
+typedef struct {
+    int fd;
+    const char *map;    /* Regular file: all of it; NULL otherwise */
+    size_t size;
+    size_t pos;         /* First byte not yet run */
+    size_t released;    /* Pages below this offset have been dropped */
+    int shared;         /* Mapped stdin: keep its offset in step */
+    int synced;         /* Commands may have moved the offset since */
+    size_t unit;        /* Start of the lines being gathered (script_more()) */
+    outbuf_t buf;       /* Not mapped: read but not yet run */
+    size_t start;
+    int eof;
+} script_t;
+
+static script_t *script_input = NULL;   /* The script being run, if any */
+
+static void script_open(script_t *s, int fd) {
+    struct stat st;
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+        return;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    s->map = map;
+    s->size = st.st_size;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    s->pos = off > 0 ? (size_t)off : 0;
+    s->shared = fd == STDIN_FILENO;
+}
+
+static void script_close(script_t *s) {
+    if (s->map)
+        munmap((void *)s->map, s->size);
+    free(s->buf.data);
+}
+
+static void script_sync(void) {
+    script_t *s = script_input;
+    if (!s || !s->shared)
+        return;
+    lseek(s->fd, s->pos, SEEK_SET);
+    s->synced = 1;
+}
+
+static void script_fill(script_t *s) {
+    char chunk[SCRIPT_CHUNK];
+    /* Drop what has been run before reading more */
+    if (s->unit > 0) {
+        memmove(s->buf.data, s->buf.data + s->unit, s->buf.len - s->unit);
+        s->buf.len -= s->unit;
+        s->start -= s->unit;
+        s->unit = 0;
+    }
+    ssize_t n;
+    while ((n = read(s->fd, chunk, sizeof(chunk))) < 0 && errno == EINTR)
+        ;
+    if (n > 0)
+        outbuf_append(&s->buf, chunk, n);
+    else
+        s->eof = 1;
+}
+
+/* Point *line at the next line of the script (without its newline, not
+   NUL-terminated) and return its length, or -1 at EOF. The view is
+   valid until the next call. */
+static long script_next_line(script_t *s, const char **line) {
+    if (s->map) {
+        if (s->synced) {
+            off_t off = lseek(s->fd, 0, SEEK_CUR);
+            if (off >= 0)
+                s->pos = off;
+            s->synced = 0;
+        }
+        if (s->pos >= s->size)
+            return -1;
+        s->unit = s->pos;
+        *line = s->map + s->pos;
+        const char *nl = memchr(*line, '\n', s->size - s->pos);
+        size_t len = nl ? (size_t)(nl - *line) : s->size - s->pos;
+        if (s->pos - s->released >= SCRIPT_RELEASE) {
+            size_t upto = s->pos & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+            madvise((char *)s->map + s->released, upto - s->released, MADV_DONTNEED);
+            s->released = upto;
+        }
+        s->pos += nl ? len + 1 : len;
+        return len;
+    }
+    s->unit = s->start;
+    for (;;) {
+        char *start = s->buf.data + s->start;
+        size_t avail = s->buf.len - s->start;
+        char *nl = avail ? memchr(start, '\n', avail) : NULL;
+        if (nl || (s->eof && avail > 0)) {
+            size_t len = nl ? (size_t)(nl - start) : avail;
+            s->start += nl ? len + 1 : len;
+            *line = start;
+            return len;
+        }
+        if (s->eof)
+            return -1;
+        script_fill(s);
+    }
+}
+
+/* Grow the lines last returned (at *line) by the next one, for a
+   compound command that spans lines (see read_unit()). Returns the new
+   length, or -1 at EOF; *line may move. */
+static long script_more(void *ctx, const char **line, long len) {
+    script_t *s = ctx;
+    (void)len;
+    if (s->map) {
+        if (s->pos >= s->size)
+            return -1;
+        const char *nl = memchr(s->map + s->pos, '\n', s->size - s->pos);
+        size_t end = nl ? (size_t)(nl - s->map) : s->size;
+        s->pos = nl ? end + 1 : end;
+        return end - s->unit;
+    }
+    for (;;) {
+        size_t avail = s->buf.len - s->start;
+        char *nl = avail ? memchr(s->buf.data + s->start, '\n', avail) : NULL;
+        if (nl || (s->eof && avail > 0)) {
+            size_t end = nl ? (size_t)(nl - s->buf.data) : s->buf.len;
+            s->start = nl ? end + 1 : end;
+            *line = s->buf.data + s->unit;
+            return end - s->unit;
+        }
+        if (s->eof)
+            return -1;
+        script_fill(s);
+    }
+}
+
+/* Whether nothing but blank lines is left, without waiting for more
+   input; used to exec the last command in place. */
+static int script_at_end(script_t *s) {
+    const char *p = s->map ? s->map + s->pos : s->buf.data + s->start;
+    const char *end = s->map ? s->map + s->size : s->buf.data + s->buf.len;
+    for (; p < end; p++)
+        if (!isspace((unsigned char)*p))
+            return 0;
+    return s->map != NULL || s->eof;
+}
+
+/* ------------------------ */
+/* Lexer                    */
+/* ------------------------ */
+static int parse_quiet = 0;     /* Compiling a script (see "Compiled scripts"):
+                                   errors are reported when the line runs */
+
+/* The end of the "$(...)" at line[i], just past its closing parenthesis,
+   or -1 if it is not closed. Quoted parentheses do not count. */
+static int subst_end(const char *line, int i, int len) {
+    int depth = 0;
+    for (i++; i < len && line[i]; i++) {
+        if (line[i] == '(') {
+            depth++;
+        } else if (line[i] == ')') {
+            if (--depth == 0)
+                return i + 1;
+        } else if (line[i] == '\\' && i + 1 < len) {
+            i++;
+        } else if (line[i] == '\'' || line[i] == '"') {
+            char q = line[i];
+            for (i++; i < len && line[i] && line[i] != q; i++)
+                if (q == '"' && line[i] == '\\' && i + 1 < len)
+                    i++;
+            if (i >= len || !line[i])
+                return -1;
+        }
+    }
+    return -1;
+}
+
+/* The end of the `...` at line[i], just past the closing backquote, or
+   -1 if there is none. */
+static int backquote_end(const char *line, int i, int len) {
+    for (i++; i < len && line[i]; i++) {
+        if (line[i] == '\\' && i + 1 < len)
+            i++;
+        else if (line[i] == '`')
+            return i + 1;
+    }
+    return -1;
+}
+
+/* Read the body of a here-document, starting at line[*i]: the lines up
+   to one that is just the delimiter (quotes removed; tabs first, with
+   strip). The body, delimiter line excluded, goes in t, as a view like
+   any token; *i moves past the delimiter. Returns -1 if there is no
+   such line yet. */
+static int here_body(const char *line, int *i, int len, word_t delim, int strip, token_t *t) {
+    char d[delim.len + 1];
+    int dlen = 0;
+    for (int k = 0; k < delim.len; k++) {
+        if (delim.s[k] == '\\' && k + 1 < delim.len)
+            d[dlen++] = delim.s[++k];
+        else if (delim.s[k] != '\'' && delim.s[k] != '"')
+            d[dlen++] = delim.s[k];
+    }
+    for (int pos = *i; pos < len;) {
+        const char *nl = memchr(line + pos, '\n', len - pos);
+        int eol = nl ? nl - line : len, text = pos;
+        while (strip && text < eol && line[text] == '\t')
+            text++;
+        if (eol - text == dlen && memcmp(line + text, d, dlen) == 0) {
+            t->start = *i;
+            t->end = pos;
+            *i = nl ? eol + 1 : eol;
+            return 0;
+        }
+        pos = nl ? eol + 1 : len;
+    }
+    if (!parse_quiet)
+        fprintf(stderr, "utsh: here-document wants a line '%.*s'\n", dlen, d);
+    return -1;
+}
+
+/* Split a line of len bytes (it need not be NUL-terminated) into words
+   and operators. Words keep their quotes; they are removed during
+   expansion, which also needs to know what was quoted. The bodies of
+   here-documents are read at the newline after their "<<" and become
+   TOK_HEREDOC tokens right after the delimiters, out of text order.
+   Returns NULL (after printing an error) on an unterminated quote or
+   here-document. The array ends with a TOK_END token. */
+token_t *lex_line(const char *line, int len) {
+    int count = 0, cap = 16;
+    int bodies = 0;             /* Tokens before this have their bodies */
+    token_t *toks = malloc(cap * sizeof(token_t));
+    if (!toks) {
+        perror("malloc lex_line");
         exit(EXIT_FAILURE);
-    } else if (pid < 0) {
-        perror("fork");
+    }
+    int i = 0;
+    for (;;) {
+        while (i < len && (line[i] == ' ' || line[i] == '\t' || line[i] == '\r'))
+            i++;
+        if (i < len && line[i] == '#') {        /* Comment to end of line */
+            while (i < len && line[i] != '\n')
+                i++;
+            continue;
+        }
+        if (count + 2 >= cap) {
+            cap *= 2;
+            toks = realloc(toks, cap * sizeof(token_t));
+            if (!toks) {
+                perror("realloc lex_line");
+                exit(EXIT_FAILURE);
+            }
+        }
+        token_t *t = &toks[count];
+        t->start = i;
+        if (i >= len || line[i] == '\0') {
+            for (int k = bodies; k < count; k++) {
+                if (toks[k].type == TOK_HEREDOC) {
+                    /* Only reports it: no lines are left */
+                    word_t delim = { line + toks[k - 1].start, toks[k - 1].end - toks[k - 1].start };
+                    here_body(line, &i, i, delim, 0, &toks[k]);
+                    free(toks);
+                    return NULL;
+                }
+            }
+            t->type = TOK_END;
+            t->end = i;
+            return toks;
+        }
+        count++;
+
+        char c0 = line[i], c1 = i + 1 < len ? line[i + 1] : '\0';
+        if (c0 == '&' && c1 == '&') {
+            t->type = TOK_AND_IF;
+            i += 2;
+        } else if (c0 == '|' && c1 == '|') {
+            t->type = TOK_OR_IF;
+            i += 2;
+        } else if (c0 == '>' && c1 == '>') {
+            t->type = TOK_DGREAT;
+            i += 2;
+        } else if (c0 == '|' && c1 == '>') {
+            t->type = TOK_METER;
+            i += 2;
+        } else if (c0 == ';' && c1 == ';') {
+            t->type = TOK_DSEMI;
+            i += 2;
+        } else if (c0 == '<' && c1 == '<') {
+            char c2 = i + 2 < len ? line[i + 2] : '\0';
+            t->type = c2 == '<' ? TOK_TLESS : c2 == '-' ? TOK_DLESSDASH : TOK_DLESS;
+            i += 2 + (c2 == '<' || c2 == '-');
+        } else if (c0 == '\n') {
+            t->type = TOK_NEWLINE;
+            t->end = ++i;
+            for (; bodies < count; bodies++) {
+                token_t *h = &toks[bodies];
+                if (h->type != TOK_HEREDOC)
+                    continue;
+                word_t delim = { line + h[-1].start, h[-1].end - h[-1].start };
+                if (here_body(line, &i, len, delim, h[-2].type == TOK_DLESSDASH, h) < 0) {
+                    free(toks);
+                    return NULL;
+                }
+            }
+            continue;
+        } else if (strchr(";&|<>()", c0)) {
+            t->type = c0 == ';' ? TOK_SEMI : c0 == '&' ? TOK_AMP :
+                      c0 == '|' ? TOK_PIPE : c0 == '<' ? TOK_LESS :
+                      c0 == '>' ? TOK_GREAT : c0 == '(' ? TOK_LPAREN : TOK_RPAREN;
+            i++;
+        } else {
+            t->type = TOK_WORD;
+            while (i < len && line[i] && !strchr(" \t\r\n;&|<>()", line[i])) {
+                if (line[i] == '\\' && i + 1 < len && line[i + 1]) {
+                    i += 2;
+                } else if ((line[i] == '$' && i + 1 < len && line[i + 1] == '(') || line[i] == '`') {
+                    int sub = line[i] == '`';
+                    if ((i = sub ? backquote_end(line, i, len) : subst_end(line, i, len)) < 0) {
+                        if (!parse_quiet)
+                            fprintf(stderr, "utsh: unterminated %s\n", sub ? "`" : "$(");
+                        free(toks);
+                        return NULL;
+                    }
+                } else if (line[i] == '\'' || line[i] == '"') {
+                    char q = line[i++];
+                    while (i < len && line[i] && line[i] != q) {
+                        int e = -1;
+                        if (q == '"' && line[i] == '$' && i + 1 < len && line[i + 1] == '(')
+                            e = subst_end(line, i, len);
+                        else if (q == '"' && line[i] == '`')
+                            e = backquote_end(line, i, len);
+                        if (e > 0) {
+                            i = e;
+                            continue;
+                        }
+                        if (q == '"' && line[i] == '\\' && i + 1 < len && line[i + 1])
+                            i++;
+                        i++;
+                    }
+                    if (i >= len || !line[i]) {
+                        if (!parse_quiet)
+                            fprintf(stderr, "utsh: unterminated %s quote\n", q == '"' ? "double" : "single");
+                        free(toks);
+                        return NULL;
+                    }
+                    i++;
+                } else {
+                    i++;
+                }
+            }
+            if (count > 1 && (t[-1].type == TOK_DLESS || t[-1].type == TOK_DLESSDASH)) {
+                /* The body comes after the next newline */
+                t->end = i;
+                t++;
+                t->type = TOK_HEREDOC;
+                t->start = t->end = i;
+                count++;
+                continue;
+            }
+        }
+        t->end = i;
+    }
+}
+
+void free_tokens(token_t *toks) {
+    free(toks);
+}
+
+/* ------------------------ */
+/* Parser                   */
+/* ------------------------ */
+/* Recursive descent over the token array:
+ *
+ *   line     : list
+ *   list     : linebreak [and_or (('&' | ';' | NEWLINE) linebreak and_or)* ['&' | ';']]
+ *   and_or   : 'time' ['-p' | '-j'] [and_or]
+ *            | 'pstat' [and_or]
+ *            | pipeline (('&&' | '||') linebreak pipeline)*
+ *   pipeline : stage (('|' | '|>') linebreak stage)*
+ *   stage    : command | compound redirect*
+ *   command  : (WORD | redirect)+
+ *   redirect : ('<' | '>' | '>>' | '<<<') WORD
+ *            | ('<<' | '<<-') WORD HEREDOC
+ *   compound : 'if' list 'then' list ('elif' list 'then' list)* ['else' list] 'fi'
+ *            | ('while' | 'until') list 'do' list 'done'
+ *            | 'for' NAME linebreak ['in' WORD* (';' | NEWLINE)] linebreak
+ *              'do' list 'done'
+ *            | 'case' WORD linebreak 'in' linebreak
+ *              (['('] WORD ('|' WORD)* ')' list [';;'] linebreak)* 'esac'
+ *
+ * Reserved words are only recognized unquoted where a command can start
+ * (or, for "in", "do" and "esac", where the grammar expects them). */
+typedef struct {
+    token_t *toks;
+    int pos;
+    const char *line;
+    int error;
+    int depth;        /* Compound commands open at this point */
+} parser_t;
+
+static word_t token_word(parser_t *p, token_t *t) {
+    word_t w = { p->line + t->start, t->end - t->start };
+    return w;
+}
+
+static int word_is(word_t w, const char *s) {
+    return (size_t)w.len == strlen(s) && memcmp(w.s, s, w.len) == 0;
+}
+
+/* Whether the current token is the (unquoted) word s. */
+static int at_word(parser_t *p, const char *s) {
+    token_t *t = &p->toks[p->pos];
+    return t->type == TOK_WORD && word_is(token_word(p, t), s);
+}
+
+static void skip_newlines(parser_t *p) {
+    while (p->toks[p->pos].type == TOK_NEWLINE)
+        p->pos++;
+}
+
+/* Whether the current token ends a list: the end of the input, ";;", ")" or
+   a reserved word that closes or continues a compound command. */
+static int at_list_end(parser_t *p) {
+    static const char *const enders[] = { "then", "elif", "else", "fi", "do", "done", "esac" };
+    token_type_t type = p->toks[p->pos].type;
+    if (type == TOK_END || type == TOK_DSEMI || type == TOK_RPAREN)
+        return 1;
+    for (size_t i = 0; i < sizeof(enders) / sizeof(enders[0]); i++)
+        if (at_word(p, enders[i]))
+            return 1;
+    return 0;
+}
+
+static ast_t *new_ast(ast_type_t type) {
+    ast_t *n = calloc(1, sizeof(ast_t));
+    if (!n) {
+        perror("calloc ast");
+        exit(EXIT_FAILURE);
+    }
+    static unsigned next_id = 0;
+    n->type = type;
+    n->id = ++next_id;
+    return n;
+}
+
+static void add_word(ast_t *n, int *cap, word_t w) {
+    if (n->num_words + 1 >= *cap) {
+        *cap = *cap ? *cap * 2 : 8;
+        n->words = realloc(n->words, *cap * sizeof(word_t));
+        if (!n->words) {
+            perror("realloc add_word");
+            exit(EXIT_FAILURE);
+        }
+    }
+    n->words[n->num_words++] = w;
+}
+
+/* Remember the source text from token `first` up to the current one
+   (up to the delimiter, if it ends with a here-document). */
+static void set_ast_text(parser_t *p, ast_t *n, int first) {
+    int start = p->toks[first].start, last = p->pos - 1;
+    while (last > first && p->toks[last].type == TOK_HEREDOC)
+        last--;
+    n->src = p->line + start;
+    n->src_len = p->toks[last].end - start;
+}
+
+/* The node's source text as a string, for a job's command line. */
+static const char *ast_text(ast_t *n) {
+    if (!n->text) {
+        n->text = strndup(n->src, n->src_len);
+        if (!n->text) {
+            perror("strndup");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return n->text;
+}
+
+static void syntax_error(parser_t *p) {
+    if (p->error)
+        return;
+    p->error = 1;
+    if (parse_quiet)
+        return;
+    token_t *t = &p->toks[p->pos];
+    if (t->type == TOK_END && p->depth > 0)
+        fprintf(stderr, "utsh: syntax error: unexpected end of file\n");
+    else if (t->type == TOK_END)
+        fprintf(stderr, "utsh: syntax error near unexpected end of line\n");
+    else if (t->type == TOK_NEWLINE)
+        fprintf(stderr, "utsh: syntax error near unexpected newline\n");
+    else
+        fprintf(stderr, "utsh: syntax error near unexpected token '%.*s'\n",
+                t->end - t->start, p->line + t->start);
+}
+
+/* Consume the reserved word s, or report a syntax error. */
+static int expect_word(parser_t *p, const char *s) {
+    if (!at_word(p, s)) {
+        syntax_error(p);
+        return 0;
+    }
+    p->pos++;
+    return 1;
+}
+
+static ast_t *parse_list(parser_t *p);
+static ast_t *parse_and_or(parser_t *p);
+
+/* A list that may not be empty, as in "if list; then list; fi". */
+static ast_t *parse_body(parser_t *p) {
+    ast_t *n = parse_list(p);
+    if (!n && !p->error)
+        syntax_error(p);
+    return n;
+}
+
+/* If the current token is a redirection, store its target in n and
+   return 1. A here-document's target is its body; a quoted delimiter
+   means the body is not expanded. */
+static int parse_redirect(parser_t *p, ast_t *n) {
+    token_t *t = &p->toks[p->pos];
+    if (t->type != TOK_LESS && t->type != TOK_GREAT && t->type != TOK_DGREAT &&
+        t->type != TOK_DLESS && t->type != TOK_DLESSDASH && t->type != TOK_TLESS)
+        return 0;
+    token_t *target = &p->toks[p->pos + 1];
+    if (target->type != TOK_WORD) {
+        p->pos++;
+        syntax_error(p);
+        return 0;
+    }
+    if (t->type == TOK_DLESS || t->type == TOK_DLESSDASH) {
+        word_t delim = token_word(p, target);
+        int quoted = memchr(delim.s, '\'', delim.len) || memchr(delim.s, '"', delim.len) ||
+                     memchr(delim.s, '\\', delim.len);
+        n->infile = token_word(p, target + 1);
+        n->here = (quoted ? HERE_RAW : HERE_DOC) | (t->type == TOK_DLESSDASH ? HERE_STRIP : 0);
+        p->pos += 3;
+        return 1;
+    }
+    if (t->type == TOK_LESS || t->type == TOK_TLESS) {
+        n->infile = token_word(p, target);
+        n->here = t->type == TOK_TLESS ? HERE_STRING : 0;
     } else {
-        /* Parent process */
-        if (!cmd->background) {
-            do {
-                wpid = waitpid(pid, &status, WUNTRACED);
-                if (wpid == -1) {
-                    perror("waitpid");
+        n->outfile = token_word(p, target);
+        n->append = t->type == TOK_DGREAT;
+    }
+    p->pos += 2;
+    return 1;
+}
+
+static ast_t *parse_command(parser_t *p) {
+    ast_t *n = new_ast(AST_COMMAND);
+    int cap = 0;
+    int first = p->pos;
+    for (;;) {
+        token_t *t = &p->toks[p->pos];
+        if (t->type == TOK_WORD) {
+            add_word(n, &cap, token_word(p, t));
+            p->pos++;
+        } else if (!parse_redirect(p, n)) {
+            break;
+        }
+    }
+    if (!p->error && p->pos == first)
+        syntax_error(p);
+    if (p->error) {
+        free_ast(n);
+        return NULL;
+    }
+    return n;
+}
+
+/* After "if" or "elif": the condition, the "then" part and whatever
+   follows up to (not including) "fi". */
+static ast_t *parse_if_rest(parser_t *p) {
+    ast_t *n = new_ast(AST_IF);
+    if (!(n->left = parse_body(p)) || !expect_word(p, "then") || !(n->right = parse_body(p)))
+        goto fail;
+    if (at_word(p, "elif")) {
+        p->pos++;
+        if (!(n->next = parse_if_rest(p)))
+            goto fail;
+    } else if (at_word(p, "else")) {
+        p->pos++;
+        if (!(n->next = parse_body(p)))
+            goto fail;
+    }
+    return n;
+fail:
+    free_ast(n);
+    return NULL;
+}
+
+static ast_t *parse_compound(parser_t *p) {
+    int first = p->pos;
+    ast_t *n = NULL;
+    int cap = 0;
+    p->depth++;
+    if (p->toks[p->pos].type == TOK_LPAREN) {
+        n = new_ast(AST_SUBSHELL);
+        p->pos++;
+        if (!(n->left = parse_body(p)))
+            goto fail;
+        if (p->toks[p->pos].type != TOK_RPAREN) {
+            syntax_error(p);
+            goto fail;
+        }
+        p->pos++;
+    } else if (at_word(p, "if")) {
+        p->pos++;
+        if (!(n = parse_if_rest(p)) || !expect_word(p, "fi"))
+            goto fail;
+    } else if (at_word(p, "while") || at_word(p, "until")) {
+        n = new_ast(at_word(p, "while") ? AST_WHILE : AST_UNTIL);
+        p->pos++;
+        if (!(n->left = parse_body(p)) || !expect_word(p, "do") ||
+            !(n->right = parse_body(p)) || !expect_word(p, "done"))
+            goto fail;
+    } else if (at_word(p, "for")) {
+        n = new_ast(AST_FOR);
+        token_t *name = &p->toks[++p->pos];
+        word_t w = token_word(p, name);
+        int valid = name->type == TOK_WORD && (isalpha((unsigned char)w.s[0]) || w.s[0] == '_');
+        for (int i = 1; valid && i < w.len; i++)
+            valid = isalnum((unsigned char)w.s[i]) || w.s[i] == '_';
+        if (!valid) {
+            syntax_error(p);
+            goto fail;
+        }
+        add_word(n, &cap, w);
+        p->pos++;
+        skip_newlines(p);
+        if (at_word(p, "in")) {
+            for (p->pos++; p->toks[p->pos].type == TOK_WORD; p->pos++)
+                add_word(n, &cap, token_word(p, &p->toks[p->pos]));
+            if (p->toks[p->pos].type != TOK_SEMI && p->toks[p->pos].type != TOK_NEWLINE) {
+                syntax_error(p);
+                goto fail;
+            }
+            p->pos++;
+        } else if (p->toks[p->pos].type == TOK_SEMI) {
+            p->pos++;
+        }
+        skip_newlines(p);
+        if (!expect_word(p, "do") || !(n->right = parse_body(p)) || !expect_word(p, "done"))
+            goto fail;
+    } else {
+        n = new_ast(AST_CASE);
+        token_t *subject = &p->toks[++p->pos];
+        if (subject->type != TOK_WORD) {
+            syntax_error(p);
+            goto fail;
+        }
+        add_word(n, &cap, token_word(p, subject));
+        p->pos++;
+        skip_newlines(p);
+        if (!expect_word(p, "in"))
+            goto fail;
+        skip_newlines(p);
+        int stages_cap = 0;
+        while (!at_word(p, "esac")) {
+            ast_t *clause = new_ast(AST_CLAUSE);
+            int clause_cap = 0;
+            if (n->num_stages == stages_cap) {
+                stages_cap = stages_cap ? stages_cap * 2 : 4;
+                n->stages = realloc(n->stages, stages_cap * sizeof(ast_t *));
+                if (!n->stages) {
+                    perror("realloc parse_compound");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            n->stages[n->num_stages++] = clause;
+            if (p->toks[p->pos].type == TOK_LPAREN)
+                p->pos++;
+            for (;;) {
+                if (p->toks[p->pos].type != TOK_WORD) {
+                    syntax_error(p);
+                    goto fail;
+                }
+                add_word(clause, &clause_cap, token_word(p, &p->toks[p->pos++]));
+                if (p->toks[p->pos].type != TOK_PIPE)
                     break;
+                p->pos++;
+            }
+            if (p->toks[p->pos].type != TOK_RPAREN) {
+                syntax_error(p);
+                goto fail;
+            }
+            p->pos++;
+            clause->right = parse_list(p);
+            if (p->error)
+                goto fail;
+            if (p->toks[p->pos].type == TOK_DSEMI)
+                p->pos++;
+            else if (!at_word(p, "esac"))
+                syntax_error(p);
+            if (p->error)
+                goto fail;
+            skip_newlines(p);
+        }
+        p->pos++;
+    }
+    p->depth--;
+    set_ast_text(p, n, first);
+    return n;
+fail:
+    p->depth--;
+    free_ast(n);
+    return NULL;
+}
+
+/* A simple command, or a compound command and its redirections. */
+static ast_t *parse_stage(parser_t *p) {
+    if (!at_word(p, "if") && !at_word(p, "while") && !at_word(p, "until") &&
+        !at_word(p, "for") && !at_word(p, "case") && p->toks[p->pos].type != TOK_LPAREN)
+        return parse_command(p);
+    ast_t *n = parse_compound(p);
+    while (n && parse_redirect(p, n))
+        ;
+    if (p->error) {
+        free_ast(n);
+        return NULL;
+    }
+    return n;
+}
+
+/* A compound command on its own runs in the shell itself; with
+   redirections or in a pipeline it becomes a stage run by a child. */
+static ast_t *parse_pipeline(parser_t *p) {
+    int first = p->pos;
+    ast_t *stage = parse_stage(p);
+    if (!stage)
+        return NULL;
+    token_type_t next = p->toks[p->pos].type;
+    if (stage->type != AST_COMMAND && !stage->infile.s && !stage->outfile.s &&
+        next != TOK_PIPE && next != TOK_METER)
+        return stage;
+    ast_t *n = new_ast(AST_PIPELINE);
+    int cap = 2;
+    n->stages = malloc(cap * sizeof(ast_t *));
+    if (!n->stages) {
+        perror("malloc parse_pipeline");
+        exit(EXIT_FAILURE);
+    }
+    n->stages[n->num_stages++] = stage;
+    while (p->toks[p->pos].type == TOK_PIPE || p->toks[p->pos].type == TOK_METER) {
+        /* "|>" relays the previous stage's output through a meter */
+        stage->meter = p->toks[p->pos].type == TOK_METER;
+        p->pos++;
+        skip_newlines(p);
+        stage = parse_stage(p);
+        if (!stage) {
+            free_ast(n);
+            return NULL;
+        }
+        if (n->num_stages == cap) {
+            cap *= 2;
+            n->stages = realloc(n->stages, cap * sizeof(ast_t *));
+            if (!n->stages) {
+                perror("realloc parse_pipeline");
+                exit(EXIT_FAILURE);
+            }
+        }
+        n->stages[n->num_stages++] = stage;
+    }
+    set_ast_text(p, n, first);
+    return n;
+}
+
+static ast_t *parse_and_or(parser_t *p) {
+    int first = p->pos;
+    token_t *t = &p->toks[p->pos];
+    int is_time = t->type == TOK_WORD && word_is(token_word(p, t), "time");
+    if (is_time || (t->type == TOK_WORD && word_is(token_word(p, t), "pstat"))) {
+        ast_t *n = new_ast(is_time ? AST_TIME : AST_PSTAT);
+        for (p->pos++; n->type == AST_TIME && p->toks[p->pos].type == TOK_WORD; p->pos++) {
+            word_t opt = token_word(p, &p->toks[p->pos]);
+            if (word_is(opt, "-p"))
+                n->format = TIME_POSIX;
+            else if (word_is(opt, "-j"))
+                n->format = TIME_JSON;
+            else
+                break;
+        }
+        token_type_t next = p->toks[p->pos].type;
+        if (next != TOK_SEMI && next != TOK_AMP && next != TOK_NEWLINE && !at_list_end(p)) {
+            n->left = parse_and_or(p);
+            if (!n->left) {
+                free_ast(n);
+                return NULL;
+            }
+        }
+        set_ast_text(p, n, first);
+        return n;
+    }
+    ast_t *left = parse_pipeline(p);
+    while (left && (p->toks[p->pos].type == TOK_AND_IF || p->toks[p->pos].type == TOK_OR_IF)) {
+        ast_t *n = new_ast(p->toks[p->pos].type == TOK_AND_IF ? AST_AND : AST_OR);
+        p->pos++;
+        skip_newlines(p);
+        n->left = left;
+        n->right = parse_pipeline(p);
+        if (!n->right) {
+            free_ast(n);
+            return NULL;
+        }
+        set_ast_text(p, n, first);
+        left = n;
+    }
+    return left;
+}
+
+/* Parse and_or lists up to the end of the input or a reserved word that
+   ends the list. Returns NULL for an empty list or on a syntax error
+   (p->error tells which). */
+static ast_t *parse_list(parser_t *p) {
+    ast_t *result = NULL;
+    skip_newlines(p);
+    while (!at_list_end(p)) {
+        int first = p->pos;
+        ast_t *n = parse_and_or(p);
+        if (!n)
+            break;
+        token_type_t sep = p->toks[p->pos].type;
+        if (sep == TOK_AMP) {
+            p->pos++;
+            ast_t *bg = new_ast(AST_BACKGROUND);
+            bg->left = n;
+            set_ast_text(p, bg, first);
+            n = bg;
+        } else if (sep == TOK_SEMI || sep == TOK_NEWLINE) {
+            p->pos++;
+        } else if (!at_list_end(p)) {
+            syntax_error(p);
+            free_ast(n);
+            break;
+        }
+        skip_newlines(p);
+        if (result) {
+            ast_t *seq = new_ast(AST_SEQ);
+            seq->left = result;
+            seq->right = n;
+            result = seq;
+        } else {
+            result = n;
+        }
+    }
+    if (p->error) {
+        free_ast(result);
+        return NULL;
+    }
+    return result;
+}
+
+/* Parse a whole line (or a compound command spanning several lines).
+   Returns NULL for an empty line or on a syntax error (p->error tells
+   which). */
+static ast_t *parse_line(parser_t *p) {
+    ast_t *result = parse_list(p);
+    if (!p->error && p->toks[p->pos].type != TOK_END) {
+        syntax_error(p);
+        free_ast(result);
+        return NULL;
+    }
+    return result;
+}
+
+void free_ast(ast_t *n) {
+    if (!n)
+        return;
+    free_ast(n->left);
+    free_ast(n->right);
+    free_ast(n->next);
+    for (int i = 0; i < n->num_stages; i++)
+        free_ast(n->stages[i]);
+    free(n->stages);
+    free(n->words);
+    free(n->text);
+    free_prog(n->code);
+    free(n);
+}
+
+/* ------------------------ */
+/* Shell variables          */
+/* ------------------------ */
+/* Variables live in an open-addressing hash table (linear probing, at
+   most half full) of var_t pointers. A name is interned the first time
+   it is seen and its var_t is never freed, so "unset" only clears the
+   value and compiled code can hold on to the var_t itself (the variable
+   of a "for" loop is looked up once, when the loop is compiled). The
+   value is stored as "name=value", which is what exec wants: the
+   environment is an array of pointers to the exported entries, rebuilt
+   only when an exported variable has changed since the last exec. */
+#define VAR_SET    1
+#define VAR_EXPORT 2
+
+typedef struct {
+    uint64_t hash;
+    int flags;
+    unsigned journal;   /* Serial of the journal that has its old value */
+    size_t len;         /* Of the name */
+    char *entry;        /* "name=value" (NULL until first set) */
+    size_t cap;         /* Bytes allocated for entry */
+    char name[];
+} var_t;
+
+typedef struct {        /* A value saved by var_push() or a journal */
+    var_t *var;
+    char *entry;
+    size_t cap;
+    int flags;
+    unsigned journal;
+} var_saved_t;
+
+static void journal_var(var_t *v);
+
+static var_t **var_slots = NULL;
+static size_t var_mask = 0;         /* Number of slots - 1 */
+static size_t var_count = 0;
+static var_t *var_path = NULL;      /* PATH, whose changes clear the hash */
+static var_t *var_ifs = NULL;       /* IFS, the field separators */
+
+static char **env_cache = NULL;     /* NULL-terminated exported entries */
+static size_t env_cache_cap = 0;
+static unsigned long env_version = 1;       /* Bumped on exported changes */
+static unsigned long env_cache_version = 0;
+
+static uint64_t var_hash(const char *name, size_t len) {
+    uint64_t h = 14695981039346656037UL;    /* FNV-1a */
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static int var_name_valid(const char *name, size_t len) {
+    if (len == 0 || isdigit((unsigned char)name[0]))
+        return 0;
+    for (size_t i = 0; i < len; i++)
+        if (!isalnum((unsigned char)name[i]) && name[i] != '_')
+            return 0;
+    return 1;
+}
+
+static var_t *var_find(const char *name, size_t len) {
+    if (!var_slots)
+        return NULL;
+    uint64_t h = var_hash(name, len);
+    for (size_t i = h & var_mask; var_slots[i]; i = (i + 1) & var_mask) {
+        var_t *v = var_slots[i];
+        if (v->hash == h && v->len == len && memcmp(v->name, name, len) == 0)
+            return v;
+    }
+    return NULL;
+}
+
+static void var_grow(void) {
+    size_t slots = var_slots ? (var_mask + 1) * 2 : 64;
+    var_t **table = calloc(slots, sizeof(var_t *));
+    if (!table) {
+        perror("calloc vars");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; var_slots && i <= var_mask; i++) {
+        if (!var_slots[i])
+            continue;
+        size_t j = var_slots[i]->hash & (slots - 1);
+        while (table[j])
+            j = (j + 1) & (slots - 1);
+        table[j] = var_slots[i];
+    }
+    free(var_slots);
+    var_slots = table;
+    var_mask = slots - 1;
+}
+
+/* The variable called name, created (unset) if it does not exist yet. */
+static var_t *var_intern(const char *name, size_t len) {
+    var_t *v = var_find(name, len);
+    if (v)
+        return v;
+    if (!var_slots || (var_count + 1) * 2 > var_mask + 1)
+        var_grow();
+    v = calloc(1, sizeof(var_t) + len + 1);
+    if (!v) {
+        perror("calloc var");
+        exit(EXIT_FAILURE);
+    }
+    v->hash = var_hash(name, len);
+    v->len = len;
+    memcpy(v->name, name, len);
+    size_t i = v->hash & var_mask;
+    while (var_slots[i])
+        i = (i + 1) & var_mask;
+    var_slots[i] = v;
+    var_count++;
+    return v;
+}
+
+static const char *var_value(const var_t *v) {
+    return v && (v->flags & VAR_SET) ? v->entry + v->len + 1 : NULL;
+}
+
+static const char *var_get(const char *name, size_t len) {
+    return var_value(var_find(name, len));
+}
+
+/* Note a change to v: exported changes invalidate the environment. */
+static void var_changed(var_t *v) {
+    if (v->flags & VAR_EXPORT)
+        env_version++;
+    if (v == var_path)
+        path_cache_clear();
+}
+
+static void var_assign(var_t *v, const char *value, size_t len) {
+    const char *old = var_value(v);
+    if (old && strlen(old) == len && memcmp(old, value, len) == 0)
+        return;
+    journal_var(v);
+    if (v->len + len + 2 > v->cap) {
+        /* A loop variable keeps getting values of about the same size */
+        v->cap = v->len + len + 2 + (len + 16) / 2;
+        free(v->entry);
+        if (!(v->entry = malloc(v->cap))) {
+            perror("malloc var");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(v->entry, v->name, v->len);
+    v->entry[v->len] = '=';
+    memcpy(v->entry + v->len + 1, value, len);
+    v->entry[v->len + 1 + len] = '\0';
+    v->flags |= VAR_SET;
+    var_changed(v);
+}
+
+static void var_export(var_t *v) {
+    if (!(v->flags & VAR_EXPORT)) {
+        journal_var(v);
+        v->flags |= VAR_EXPORT;
+        if (v->flags & VAR_SET)
+            env_version++;
+    }
+}
+
+static void var_unset(var_t *v) {
+    if (v->flags)
+        journal_var(v);
+    if (v->flags & VAR_SET)
+        var_changed(v);
+    v->flags = 0;
+}
+
+/* The length of the name in a "name=value" word, 0 if it is not one. */
+static size_t assignment_name(const char *word) {
+    const char *eq = strchr(word, '=');
+    return eq && var_name_valid(word, eq - word) ? (size_t)(eq - word) : 0;
+}
+
+static void var_assign_words(char **assigns) {
+    for (int i = 0; assigns[i]; i++) {
+        size_t len = assignment_name(assigns[i]);
+        const char *value = assigns[i] + len + 1;
+        var_assign(var_intern(assigns[i], len), value, strlen(value));
+    }
+}
+
+/* Set and export the assignments in front of a command for as long as
+   the command needs them; var_pop() puts the old values back. */
+static var_saved_t *var_push(char **assigns) {
+    int n = 0;
+    while (assigns[n])
+        n++;
+    var_saved_t *saved = malloc((n + 1) * sizeof(var_saved_t));
+    if (!saved) {
+        perror("malloc var_push");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+        size_t len = assignment_name(assigns[i]);
+        var_t *v = var_intern(assigns[i], len);
+        journal_var(v);
+        saved[i] = (var_saved_t){ v, v->entry, v->cap, v->flags, v->journal };
+        v->entry = NULL;
+        v->cap = 0;
+        v->flags = VAR_EXPORT;
+        const char *value = assigns[i] + len + 1;
+        var_assign(v, value, strlen(value));
+    }
+    saved[n].var = NULL;
+    return saved;
+}
+
+static void var_pop(var_saved_t *saved) {
+    int n = 0;
+    while (saved[n].var)
+        n++;
+    while (n-- > 0) {
+        var_t *v = saved[n].var;
+        free(v->entry);
+        v->entry = saved[n].entry;
+        v->cap = saved[n].cap;
+        v->flags = saved[n].flags;
+        env_version++;      /* The pushed value was exported */
+        if (v == var_path)
+            path_cache_clear();
+    }
+    free(saved);
+}
+
+/* The environment for exec: the exported variables' entries. */
+static char **shell_environ(void) {
+    if (env_cache_version == env_version)
+        return env_cache;
+    size_t n = 0;
+    for (size_t i = 0; i <= var_mask; i++) {
+        var_t *v = var_slots[i];
+        if (v && (v->flags & (VAR_SET | VAR_EXPORT)) == (VAR_SET | VAR_EXPORT)) {
+            if (n + 1 >= env_cache_cap) {
+                env_cache_cap = env_cache_cap ? env_cache_cap * 2 : 64;
+                env_cache = realloc(env_cache, env_cache_cap * sizeof(char *));
+                if (!env_cache) {
+                    perror("realloc environ");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            env_cache[n++] = v->entry;
+        }
+    }
+    if (!env_cache && !(env_cache = malloc(sizeof(char *)))) {
+        perror("malloc environ");
+        exit(EXIT_FAILURE);
+    }
+    env_cache[n] = NULL;
+    env_cache_version = env_version;
+    return env_cache;
+}
+
+/* Take over the environment the shell was started with. */
+static void var_import(char **env) {
+    for (int i = 0; env[i]; i++) {
+        size_t len = assignment_name(env[i]);
+        if (!len)
+            continue;
+        var_t *v = var_intern(env[i], len);
+        var_assign(v, env[i] + len + 1, strlen(env[i] + len + 1));
+        var_export(v);
+    }
+    var_path = var_intern("PATH", 4);
+    var_ifs = var_intern("IFS", 3);
+}
+
+/* ------------------------ */
+/* Subshell journal         */
+/* ------------------------ */
+/* "( list )" and $(list) must not change the shell: nothing they set
+   may leak out. Forking a copy of the shell does that but costs a
+   process each time, so a list that only changes what the shell can
+   put back (variables, the working directory, "set -o" options) runs in
+   the shell itself as a virtual subshell, as in ksh93: the first change
+   to each of these is journaled with the old value, and the journal is
+   played back, newest first, when the list ends. A list that could do
+   anything else (exit, a background job, a command name that is only
+   known once expanded) gets a real fork. No built-in touches the
+   shell's own descriptors; $(...) swaps the stdout stream and puts it
+   back itself. Journals nest: each variable carries the serial of the
+   newest journal that holds its old value, so it is saved once per
+   subshell however often it changes. */
+typedef struct journal {
+    struct journal *outer;
+    unsigned serial;
+    int cwd;              /* The directory before the first cd, or -1 */
+    int jobslots, pipefail;
+    var_saved_t *vars;    /* Old values, oldest first */
+    int num_vars, cap_vars;
+} journal_t;
+
+static journal_t *journal = NULL;   /* Of the innermost virtual subshell */
+
+/* Save v's value before its first change in the current subshell. */
+static void journal_var(var_t *v) {
+    journal_t *jr = journal;
+    if (!jr || v->journal == jr->serial)
+        return;
+    if (jr->num_vars == jr->cap_vars) {
+        jr->cap_vars = jr->cap_vars ? jr->cap_vars * 2 : 8;
+        jr->vars = realloc(jr->vars, jr->cap_vars * sizeof(var_saved_t));
+        if (!jr->vars) {
+            perror("realloc journal");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char *entry = NULL;
+    if ((v->flags & VAR_SET) && !(entry = strdup(v->entry))) {
+        perror("strdup");
+        exit(EXIT_FAILURE);
+    }
+    jr->vars[jr->num_vars++] = (var_saved_t){ v, entry, entry ? strlen(entry) + 1 : 0,
+                                              v->flags, v->journal };
+    v->journal = jr->serial;
+}
+
+/* Keep hold of the working directory before cd changes it. Returns -1
+   if it cannot be kept, in which case the cd must not happen. */
+static int journal_cwd(void) {
+    if (!journal || journal->cwd >= 0)
+        return 0;
+    journal->cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (journal->cwd < 0) {
+        perror("cd: cannot save the working directory");
+        return -1;
+    }
+    return 0;
+}
+
+static void journal_begin(journal_t *jr) {
+    static unsigned serial = 0;
+    *jr = (journal_t){ journal, ++serial, -1, opt_jobslots, opt_pipefail, NULL, 0, 0 };
+    journal = jr;
+}
+
+/* Undo everything recorded in jr, which must be the innermost journal. */
+static void journal_end(journal_t *jr) {
+    journal = jr->outer;
+    while (jr->num_vars > 0) {
+        var_saved_t *saved = &jr->vars[--jr->num_vars];
+        var_t *v = saved->var;
+        if ((v->flags | saved->flags) & VAR_EXPORT)
+            env_version++;
+        free(v->entry);
+        v->entry = saved->entry;
+        v->cap = saved->cap;
+        v->flags = saved->flags;
+        v->journal = saved->journal;
+        if (v == var_path)
+            path_cache_clear();
+    }
+    free(jr->vars);
+    if (jr->cwd >= 0) {
+        if (fchdir(jr->cwd) < 0)
+            perror("utsh: cannot return to the working directory");
+        close(jr->cwd);
+    }
+    opt_jobslots = jr->jobslots;
+    opt_pipefail = jr->pipefail;
+}
+
+/* ------------------------ */
+/* Arithmetic               */
+/* ------------------------ */
+/* $((expression)) with the C operators on 64-bit integers that wrap
+   around on overflow. An expression is compiled once by a Pratt parser
+   into code for a small stack machine and kept in a cache keyed by its
+   text; an assignment such as "i=$((i+1))" also holds on to the code in
+   its plan (see plan_assign()), so a loop counter costs a hash lookup at
+   most and never a process. Variables are read and written through
+   their var_t; a value that is not a number is an error. */
+#define ARITH_DEPTH 64
+#define ARITH_CACHE_SIZE 256
+
+typedef enum {
+    AR_NUM, AR_VAR, AR_PARAM, AR_NEG, AR_NOT, AR_BNOT,
+    AR_MUL, AR_DIV, AR_MOD, AR_ADD, AR_SUB, AR_SHL, AR_SHR,
+    AR_LT, AR_LE, AR_GT, AR_GE, AR_EQ, AR_NE, AR_BAND, AR_BXOR, AR_BOR,
+    AR_AND,       /* Go to arg, leaving 0, if the top is 0; else pop it */
+    AR_OR,        /* Go to arg, leaving 1, if the top is not 0; else pop it */
+    AR_BOOL,      /* Replace the top by 0 or 1 */
+    AR_JZ,        /* Pop the top and go to arg if it was 0 */
+    AR_JUMP,
+    AR_POP,
+    AR_STORE,     /* Assign the top to var */
+    AR_INC,       /* Add arg to var and push the new value */
+    AR_POSTINC,   /* Add arg to var and push the old value */
+    AR_SUBST,     /* Push the output of the $(...) at arg (offset << 32 | length) */
+    AR_END
+} arith_op_t;
+
+typedef struct {
+    uint8_t op;
+    int64_t arg;          /* Number, jump target, increment or parameter */
+    var_t *var;
+} arith_insn_t;
+
+typedef struct arith {
+    struct arith *next;   /* In the cache bucket */
+    uint64_t hash;
+    size_t len;
+    char *text;           /* "(expression)", as written */
+    arith_insn_t *code;
+    int n, cap;
+    const char *error;    /* Syntax error, reported when it is evaluated */
+} arith_t;
+
+typedef struct {
+    arith_t *a;
+    const char *p, *end;
+    int depth;
+} arith_parser_t;
+
+static arith_t *arith_cache[ARITH_CACHE_SIZE];
+static int expand_failed = 0;   /* An expansion failed: do not run the command */
+static void command_subst(const char *text, size_t len, outbuf_t *out);
+static int subst_status = -1;   /* Of the command's last $(...), -1 if none */
+
+/* Binary operators, with their binding power (C precedence) */
+static const struct {
+    const char *op;
+    int prec;
+    uint8_t code;
+} arith_binary[] = {
+    { "||", 4, AR_OR },   { "&&", 5, AR_AND },  { "|", 6, AR_BOR },
+    { "^", 7, AR_BXOR },  { "&", 8, AR_BAND },  { "==", 9, AR_EQ },
+    { "!=", 9, AR_NE },   { "<", 10, AR_LT },   { "<=", 10, AR_LE },
+    { ">", 10, AR_GT },   { ">=", 10, AR_GE },  { "<<", 11, AR_SHL },
+    { ">>", 11, AR_SHR }, { "+", 12, AR_ADD },  { "-", 12, AR_SUB },
+    { "*", 13, AR_MUL },  { "/", 13, AR_DIV },  { "%", 13, AR_MOD },
+};
+
+#define ARITH_ASSIGN 2      /* Binding power of = and op= */
+#define ARITH_UNARY  14
+
+/* The operator at the parser's position (longest match), or NULL. */
+static const char *arith_peek(arith_parser_t *ap) {
+    static const char *const ops[] = {
+        "<<=", ">>=", "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", "++",
+        "--", "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=", "+", "-", "*",
+        "/", "%", "<", ">", "&", "^", "|", "!", "~", "?", ":", "=", ",",
+        "(", ")",
+    };
+    while (ap->p < ap->end && isspace((unsigned char)*ap->p))
+        ap->p++;
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        size_t len = strlen(ops[i]);
+        if ((size_t)(ap->end - ap->p) >= len && memcmp(ap->p, ops[i], len) == 0)
+            return ops[i];
+    }
+    return NULL;
+}
+
+static int arith_emit(arith_t *a, int op, int64_t arg, var_t *var) {
+    if (a->n == a->cap) {
+        a->cap = a->cap ? a->cap * 2 : 16;
+        a->code = realloc(a->code, a->cap * sizeof(arith_insn_t));
+        if (!a->code) {
+            perror("realloc arith");
+            exit(EXIT_FAILURE);
+        }
+    }
+    a->code[a->n] = (arith_insn_t){ op, arg, var };
+    return a->n++;
+}
+
+static void arith_fail(arith_parser_t *ap, const char *msg) {
+    if (!ap->a->error)
+        ap->a->error = msg;
+}
+
+/* A variable name at the parser's position, interned, or NULL. */
+static var_t *arith_name(arith_parser_t *ap) {
+    const char *name = ap->p;
+    while (ap->p < ap->end && (isalnum((unsigned char)*ap->p) || *ap->p == '_'))
+        ap->p++;
+    return ap->p > name ? var_intern(name, ap->p - name) : NULL;
+}
+
+static void arith_expr(arith_parser_t *ap, int prec);
+
+/* An operand: a number, a variable (perhaps assigned or incremented),
+   a parenthesised expression or a unary operator and its operand. */
+static void arith_operand(arith_parser_t *ap, int prec) {
+    const char *op = arith_peek(ap);
+    arith_t *a = ap->a;
+    if (ap->p == ap->end) {
+        arith_fail(ap, "operand expected");
+    } else if (op && strcmp(op, "(") == 0) {
+        ap->p++;
+        arith_expr(ap, 0);
+        op = arith_peek(ap);
+        if (op && strcmp(op, ")") == 0)
+            ap->p++;
+        else
+            arith_fail(ap, "missing )");
+    } else if (op && (strcmp(op, "++") == 0 || strcmp(op, "--") == 0)) {
+        ap->p += 2;
+        arith_peek(ap);
+        var_t *v = isalpha((unsigned char)*ap->p) || *ap->p == '_' ? arith_name(ap) : NULL;
+        if (!v)
+            arith_fail(ap, "++ or -- needs a variable");
+        arith_emit(a, AR_INC, op[0] == '+' ? 1 : -1, v);
+    } else if (op && strchr("-+!~", op[0]) && op[1] == '\0') {
+        ap->p++;
+        arith_expr(ap, ARITH_UNARY);
+        if (op[0] != '+')
+            arith_emit(a, op[0] == '-' ? AR_NEG : op[0] == '!' ? AR_NOT : AR_BNOT, 0, NULL);
+    } else if (isdigit((unsigned char)*ap->p)) {
+        char *end;
+        errno = 0;
+        unsigned long long v = strtoull(ap->p, &end, 0);
+        if (errno || (end < ap->end && (isalnum((unsigned char)*end) || *end == '_')))
+            arith_fail(ap, "invalid number");
+        ap->p = end;
+        arith_emit(a, AR_NUM, (int64_t)v, NULL);
+    } else if (*ap->p == '$' && ap->end - ap->p > 1 && ap->p[1] == '(') {
+        int close = subst_end(ap->p, 0, ap->end - ap->p);
+        if (close < 0) {
+            arith_fail(ap, "missing )");
+            return;
+        }
+        arith_emit(a, AR_SUBST, (int64_t)(ap->p + 2 - a->text) << 32 | (close - 3), NULL);
+        ap->p += close;
+    } else if (*ap->p == '$' && ap->end - ap->p > 1 && strchr("?!$", ap->p[1])) {
+        arith_emit(a, AR_PARAM, ap->p[1], NULL);
+        ap->p += 2;
+    } else if (*ap->p == '$') {
+        /* $name and ${name} read the variable, like name */
+        int brace = ++ap->p < ap->end && *ap->p == '{';
+        ap->p += brace;
+        var_t *v = isdigit((unsigned char)*ap->p) ? NULL : arith_name(ap);
+        if (!v || (brace && (ap->p == ap->end || *ap->p++ != '}')))
+            arith_fail(ap, "bad variable reference");
+        arith_emit(a, AR_VAR, 0, v);
+    } else if (isalpha((unsigned char)*ap->p) || *ap->p == '_') {
+        var_t *v = arith_name(ap);
+        op = arith_peek(ap);
+        if (op && (strcmp(op, "++") == 0 || strcmp(op, "--") == 0)) {
+            ap->p += 2;
+            arith_emit(a, AR_POSTINC, op[0] == '+' ? 1 : -1, v);
+        } else if (op && prec < ARITH_ASSIGN && op[strlen(op) - 1] == '=' &&
+                   strcmp(op, "==") != 0 && strcmp(op, "<=") != 0 &&
+                   strcmp(op, ">=") != 0 && strcmp(op, "!=") != 0) {
+            ap->p += strlen(op);
+            int code = -1;      /* Plain = */
+            for (size_t i = 0; op[1] && i < sizeof(arith_binary) / sizeof(arith_binary[0]); i++)
+                if (strlen(arith_binary[i].op) == strlen(op) - 1 &&
+                        memcmp(arith_binary[i].op, op, strlen(op) - 1) == 0)
+                    code = arith_binary[i].code;
+            if (code >= 0)
+                arith_emit(a, AR_VAR, 0, v);
+            arith_expr(ap, ARITH_ASSIGN - 1);
+            if (code >= 0)
+                arith_emit(a, code, 0, NULL);
+            arith_emit(a, AR_STORE, 0, v);
+        } else {
+            arith_emit(a, AR_VAR, 0, v);
+        }
+    } else {
+        arith_fail(ap, "operand expected");
+    }
+}
+
+/* An expression whose operators bind tighter than prec. */
+static void arith_expr(arith_parser_t *ap, int prec) {
+    arith_t *a = ap->a;
+    if (++ap->depth > ARITH_DEPTH) {
+        arith_fail(ap, "expression nested too deeply");
+        return;
+    }
+    arith_operand(ap, prec);
+    while (!a->error) {
+        const char *op = arith_peek(ap);
+        if (!op)
+            break;
+        size_t i;
+        for (i = 0; i < sizeof(arith_binary) / sizeof(arith_binary[0]); i++)
+            if (strcmp(arith_binary[i].op, op) == 0)
+                break;
+        if (i < sizeof(arith_binary) / sizeof(arith_binary[0]) && arith_binary[i].prec > prec) {
+            int code = arith_binary[i].code;
+            ap->p += strlen(op);
+            int jump = code == AR_AND || code == AR_OR ? arith_emit(a, code, 0, NULL) : -1;
+            arith_expr(ap, arith_binary[i].prec);
+            if (jump >= 0) {
+                arith_emit(a, AR_BOOL, 0, NULL);
+                a->code[jump].arg = a->n;
+            } else {
+                arith_emit(a, code, 0, NULL);
+            }
+        } else if (strcmp(op, "?") == 0 && prec < 3) {
+            ap->p++;
+            int jz = arith_emit(a, AR_JZ, 0, NULL);
+            arith_expr(ap, 0);
+            op = arith_peek(ap);
+            if (!op || strcmp(op, ":") != 0) {
+                arith_fail(ap, "missing : after ?");
+                break;
+            }
+            ap->p++;
+            int jump = arith_emit(a, AR_JUMP, 0, NULL);
+            a->code[jz].arg = a->n;
+            arith_expr(ap, 2);          /* Right-associative */
+            a->code[jump].arg = a->n;
+        } else if (strcmp(op, ",") == 0 && prec < 1) {
+            ap->p++;
+            arith_emit(a, AR_POP, 0, NULL);
+            arith_expr(ap, 1);
+        } else {
+            break;
+        }
+    }
+    ap->depth--;
+}
+
+/* The compiled form of the expression text (cached). */
+static arith_t *arith_lookup(const char *text, size_t len) {
+    uint64_t h = var_hash(text, len);
+    arith_t **bucket = &arith_cache[h % ARITH_CACHE_SIZE];
+    for (arith_t *a = *bucket; a; a = a->next)
+        if (a->hash == h && a->len == len && memcmp(a->text, text, len) == 0)
+            return a;
+    arith_t *a = calloc(1, sizeof(arith_t));
+    if (!a || !(a->text = strndup(text, len))) {
+        perror("calloc arith");
+        exit(EXIT_FAILURE);
+    }
+    a->hash = h;
+    a->len = len;
+    arith_parser_t ap = { a, a->text, a->text + len, 0 };
+    arith_expr(&ap, 0);
+    if (arith_peek(&ap), ap.p < ap.end)
+        arith_fail(&ap, "syntax error");
+    arith_emit(a, AR_END, 0, NULL);
+    a->next = *bucket;
+    *bucket = a;
+    return a;
+}
+
+/* The integer in s, which may be blank (0); -1 if it is not a number. */
+static int arith_number(const char *s, int64_t *out) {
+    const char *p;
+    char *end;
+    for (p = s; isspace((unsigned char)*p); p++)
+        ;
+    if (*p == '\0') {
+        *out = 0;
+        return 0;
+    }
+    int neg = *p == '-';
+    p += neg || *p == '+';
+    errno = 0;
+    uint64_t n = isdigit((unsigned char)*p) ? strtoull(p, &end, 0) : (errno = EINVAL, 0);
+    while (!errno && isspace((unsigned char)*end))
+        end++;
+    if (errno || *end)
+        return -1;
+    *out = (int64_t)(neg ? 0 - n : n);
+    return 0;
+}
+
+/* The numeric value of v; unset and empty count as 0. */
+static int arith_load(const arith_t *a, var_t *v, int64_t *out) {
+    const char *s = var_value(v);
+    if (arith_number(s ? s : "", out) < 0) {
+        fprintf(stderr, "utsh: $(%s): %s: not a number: %s\n", a->text, v->name, s);
+        return -1;
+    }
+    return 0;
+}
+
+static void arith_store(var_t *v, int64_t value) {
+    char num[24];
+    var_assign(v, num, snprintf(num, sizeof(num), "%lld", (long long)value));
+}
+
+/* Evaluate a; returns -1 (after reporting it) on error. */
+static int arith_eval(const arith_t *a, int64_t *result) {
+    if (a->error) {
+        fprintf(stderr, "utsh: $(%s): %s\n", a->text, a->error);
+        return -1;
+    }
+    int64_t stack[ARITH_DEPTH + 2], x = 0, y = 0;
+    int sp = -1;
+    for (const arith_insn_t *pc = a->code;; pc++) {
+        /* Binary operators pop y and replace x, the new top */
+        if (pc->op >= AR_MUL && pc->op <= AR_BOR) {
+            y = stack[sp--];
+            x = stack[sp];
+        }
+        switch (pc->op) {
+        case AR_NUM:  stack[++sp] = pc->arg; break;
+        case AR_VAR:
+            if (arith_load(a, pc->var, &stack[++sp]) < 0)
+                return -1;
+            break;
+        case AR_PARAM:
+            stack[++sp] = pc->arg == '?' ? last_status : pc->arg == '!' ? last_bg_pid : getpid();
+            break;
+        case AR_NEG:  stack[sp] = (int64_t)(0 - (uint64_t)stack[sp]); break;
+        case AR_NOT:  stack[sp] = !stack[sp]; break;
+        case AR_BNOT: stack[sp] = ~stack[sp]; break;
+        case AR_MUL:  stack[sp] = (int64_t)((uint64_t)x * (uint64_t)y); break;
+        case AR_DIV:
+        case AR_MOD:
+            if (y == 0) {
+                fprintf(stderr, "utsh: $(%s): division by zero\n", a->text);
+                return -1;
+            }
+            if (y == -1)        /* INT64_MIN / -1 wraps, like the rest */
+                stack[sp] = pc->op == AR_DIV ? (int64_t)(0 - (uint64_t)x) : 0;
+            else
+                stack[sp] = pc->op == AR_DIV ? x / y : x % y;
+            break;
+        case AR_ADD:  stack[sp] = (int64_t)((uint64_t)x + (uint64_t)y); break;
+        case AR_SUB:  stack[sp] = (int64_t)((uint64_t)x - (uint64_t)y); break;
+        case AR_SHL:  stack[sp] = (int64_t)((uint64_t)x << (y & 63)); break;
+        case AR_SHR:  stack[sp] = x >> (y & 63); break;
+        case AR_LT:   stack[sp] = x < y; break;
+        case AR_LE:   stack[sp] = x <= y; break;
+        case AR_GT:   stack[sp] = x > y; break;
+        case AR_GE:   stack[sp] = x >= y; break;
+        case AR_EQ:   stack[sp] = x == y; break;
+        case AR_NE:   stack[sp] = x != y; break;
+        case AR_BAND: stack[sp] = x & y; break;
+        case AR_BXOR: stack[sp] = x ^ y; break;
+        case AR_BOR:  stack[sp] = x | y; break;
+        case AR_AND:
+        case AR_OR:
+            if ((stack[sp] != 0) == (pc->op == AR_OR)) {
+                stack[sp] = pc->op == AR_OR;
+                pc = a->code + pc->arg - 1;
+            } else {
+                sp--;
+            }
+            break;
+        case AR_BOOL: stack[sp] = stack[sp] != 0; break;
+        case AR_JZ:
+            if (stack[sp--] == 0)
+                pc = a->code + pc->arg - 1;
+            break;
+        case AR_JUMP: pc = a->code + pc->arg - 1; break;
+        case AR_POP:  sp--; break;
+        case AR_STORE: arith_store(pc->var, stack[sp]); break;
+        case AR_INC:
+        case AR_POSTINC:
+            if (arith_load(a, pc->var, &x) < 0)
+                return -1;
+            y = (int64_t)((uint64_t)x + (uint64_t)pc->arg);
+            arith_store(pc->var, y);
+            stack[++sp] = pc->op == AR_INC ? y : x;
+            break;
+        case AR_SUBST: {
+            outbuf_t out = { 0 };
+            command_subst(a->text + (pc->arg >> 32), pc->arg & 0xffffffff, &out);
+            int bad = arith_number(out.data ? out.data : "", &stack[++sp]);
+            if (bad)
+                fprintf(stderr, "utsh: $(%s): not a number: %s\n", a->text, out.data ? out.data : "");
+            free(out.data);
+            if (bad)
+                return -1;
+            break;
+        }
+        case AR_END:
+            *result = stack[sp];
+            return 0;
+        }
+    }
+}
+
+/* ------------------------ */
+/* Word expansion           */
+/* ------------------------ */
+/* $PIPESTATUS is the status of the first stage of the last foreground
+   pipeline, ${PIPESTATUS[n]} that of stage n and ${PIPESTATUS[@]} all of
+   them, space-separated. Returns the length of the reference at s (0 if
+   there is none; the word ends at end) and appends its value to out. */
+static size_t pipestatus_ref(const char *s, const char *end, outbuf_t *out) {
+    int first = 0, last = 0;
+    size_t len;
+    size_t avail = end - s;
+    if (avail >= 11 && memcmp(s, "$PIPESTATUS", 11) == 0 &&
+            (avail == 11 || (!isalnum((unsigned char)s[11]) && s[11] != '_'))) {
+        len = 11;
+    } else if (avail >= 13 && memcmp(s, "${PIPESTATUS[", 13) == 0) {
+        const char *p = s + 13;
+        if (p < end && (*p == '@' || *p == '*')) {
+            last = last_num_stages - 1;
+            p++;
+        } else {
+            int neg = p < end && *p == '-';
+            const char *digits = p + neg;
+            long v = 0;
+            for (p = digits; p < end && isdigit((unsigned char)*p); p++)
+                v = v * 10 + (*p - '0');
+            if (p == digits)
+                return 0;
+            first = last = (int)(neg ? -v : v);
+        }
+        if (end - p < 2 || p[0] != ']' || p[1] != '}')
+            return 0;
+        len = p + 2 - s;
+    } else {
+        return 0;
+    }
+    for (int i = first, n = 0; i <= last; i++) {
+        if (i < 0 || i >= last_num_stages)
+            continue;
+        char num[16];
+        int w = snprintf(num, sizeof(num), n++ ? " %d" : "%d", last_stages[i].status);
+        outbuf_append(out, num, w);
+    }
+    return len;
+}
+
+/* $name or ${name}: returns the length of the reference at s (0 if there
+   is none) and points *value at the variable's value (NULL if unset). */
+static size_t var_ref(const char *s, const char *end, const char **value) {
+    const char *name = s + 1 + (s + 1 < end && s[1] == '{');
+    const char *p = name;
+    if (p < end && (isalpha((unsigned char)*p) || *p == '_'))
+        for (p++; p < end && (isalnum((unsigned char)*p) || *p == '_'); p++)
+            ;
+    if (p == name || (name > s + 1 && (p == end || *p++ != '}')))
+        return 0;
+    *value = var_get(name, p - name - (name > s + 1));
+    return p - s;
+}
+
+/* Where a word splits into fields: pairs of offsets into its text and
+   its pattern. */
+typedef struct {
+    size_t *at;
+    int count, cap;
+} cuts_t;
+
+/* Append a substituted value to the text and the pattern of a word.
+   Unquoted, the value's wildcards are live and, if cuts is not NULL, its
+   IFS characters split the word instead of being kept. */
+static void expand_value(outbuf_t *text, outbuf_t *pat, const char *v, size_t len,
+                         int quote, int *globbing, cuts_t *cuts) {
+    const char *ifs = var_value(var_ifs);
+    if (!ifs)
+        ifs = " \t\n";
+    for (const char *end = v + len; v < end; v++) {
+        if (!quote && cuts && *v && strchr(ifs, *v)) {
+            if (cuts->count + 2 > cuts->cap) {
+                cuts->cap = cuts->cap ? cuts->cap * 2 : 8;
+                cuts->at = realloc(cuts->at, cuts->cap * sizeof(size_t));
+                if (!cuts->at) {
+                    perror("realloc cuts");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            cuts->at[cuts->count++] = text->len;
+            cuts->at[cuts->count++] = pat->len;
+            continue;
+        }
+        outbuf_putc(text, *v);
+        if (quote && strchr("*?[\\", *v))
+            outbuf_putc(pat, '\\');
+        else if (!quote && strchr("*?[", *v))
+            *globbing = 1;
+        outbuf_putc(pat, *v);
+    }
+}
+
+/* Whether the "$(...)" at s, close bytes long, is $((arithmetic)). */
+static int is_arith(const char *s, int close) {
+    return close >= 5 && s[2] == '(' && s[close - 2] == ')';
+}
+
+/* Expand one raw word: remove quotes and backslashes and substitute
+   variables, $((arithmetic)), $(commands) and `commands` and the
+   special parameters $?, $! and $$. The result is the word's first
+   NUL-terminated copy. If the word has wildcards that were not quoted,
+   *pattern receives a glob() pattern in which the quoted characters are
+   backslash-escaped; otherwise it is set to NULL. Unquoted substitutions
+   are split on IFS into cuts when cuts is not NULL. The body of a
+   here-document is expanded with quote set to QUOTE_HERE: quotes are
+   plain characters there, and a backslash only quotes $, ` and \. */
+#define QUOTE_HERE 256
+
+static char *expand_fields(word_t raw, char **pattern, cuts_t *cuts, int quote) {
+    outbuf_t text = { 0 }, pat = { 0 };
+    int globbing = 0;           /* quote: 0, '\'', '"' or QUOTE_HERE */
+    const char *end = raw.s + raw.len;
+    for (const char *c = raw.s; c < end; c++) {
+        if (quote == 0 && (*c == '\'' || *c == '"')) {
+            quote = *c;
+            continue;
+        }
+        if (quote && *c == quote) {
+            quote = 0;
+            continue;
+        }
+        if (*c == '\\' && quote != '\'' && c + 1 < end &&
+                (quote == 0 || strchr(quote == QUOTE_HERE ? "$\\`" : "$\"\\`", c[1]))) {
+            c++;
+            outbuf_putc(&text, *c);
+            outbuf_putc(&pat, '\\');
+            outbuf_putc(&pat, *c);
+            continue;
+        }
+        outbuf_t ref = { 0 };
+        size_t used;
+        if (*c == '$' && quote != '\'' && (used = pipestatus_ref(c, end, &ref)) > 0) {
+            if (ref.data) {
+                expand_value(&text, &pat, ref.data, ref.len, quote, &globbing, cuts);
+                free(ref.data);
+            }
+            c += used - 1;
+            continue;
+        }
+        int close;
+        if (*c == '$' && quote != '\'' && end - c > 1 && c[1] == '(' &&
+                (close = subst_end(c, 0, end - c)) > 0) {
+            if (is_arith(c, close)) {
+                arith_t *a = arith_lookup(c + 2, close - 3);
+                int64_t value;
+                char num[24];
+                if (arith_eval(a, &value) < 0) {
+                    expand_failed = 1;
+                } else {
+                    int w = snprintf(num, sizeof(num), "%lld", (long long)value);
+                    outbuf_append(&text, num, w);
+                    outbuf_append(&pat, num, w);
+                }
+            } else {
+                command_subst(c + 2, close - 3, &ref);
+                expand_value(&text, &pat, ref.data ? ref.data : "", ref.len, quote, &globbing, cuts);
+                free(ref.data);
+            }
+            c += close - 1;
+            continue;
+        }
+        if (*c == '`' && quote != '\'' && (close = backquote_end(c, 0, end - c)) > 0) {
+            /* Inside, a backslash only quotes $, ` and \ (and " in "...") */
+            outbuf_t cmd = { 0 };
+            for (const char *b = c + 1; b < c + close - 1; b++) {
+                if (*b == '\\' && strchr(quote == '"' ? "$`\\\"" : "$`\\", b[1]))
+                    b++;
+                outbuf_putc(&cmd, *b);
+            }
+            command_subst(cmd.data ? cmd.data : "", cmd.len, &ref);
+            expand_value(&text, &pat, ref.data ? ref.data : "", ref.len, quote, &globbing, cuts);
+            free(ref.data);
+            free(cmd.data);
+            c += close - 1;
+            continue;
+        }
+        const char *value;
+        if (*c == '$' && quote != '\'' && (used = var_ref(c, end, &value)) > 0) {
+            if (value)
+                expand_value(&text, &pat, value, strlen(value), quote, &globbing, cuts);
+            c += used - 1;
+            continue;
+        }
+        if (*c == '$' && quote != '\'' && c + 1 < end && strchr("?!$", c[1])) {
+            char num[24];
+            long value = c[1] == '?' ? last_status : c[1] == '!' ? (long)last_bg_pid : (long)getpid();
+            snprintf(num, sizeof(num), "%ld", value);
+            outbuf_append(&text, num, strlen(num));
+            outbuf_append(&pat, num, strlen(num));
+            c++;
+            continue;
+        }
+        outbuf_putc(&text, *c);
+        if (quote && strchr("*?[\\", *c)) {
+            outbuf_putc(&pat, '\\');
+        } else if (!quote && strchr("*?[", *c)) {
+            globbing = 1;
+        }
+        outbuf_putc(&pat, *c);
+    }
+    if (globbing) {
+        *pattern = outbuf_finish(&pat);
+    } else {
+        *pattern = NULL;
+        free(pat.data);
+    }
+    return outbuf_finish(&text);
+}
+
+/* Expand one raw word into a single string, without field splitting. */
+char *expand_word(word_t raw, char **pattern) {
+    return expand_fields(raw, pattern, NULL, 0);
+}
+
+/* Append a field to the args and patterns being built. */
+static void add_field(char ***args, char ***patterns, int *n, int *cap,
+                      char *arg, char *pattern) {
+    if (*n + 2 > *cap) {
+        *cap *= 2;
+        *args = realloc(*args, *cap * sizeof(char *));
+        *patterns = realloc(*patterns, *cap * sizeof(char *));
+        if (!*args || !*patterns) {
+            perror("realloc expand_words");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*args)[*n] = arg;
+    (*patterns)[(*n)++] = pattern;
+}
+
+/* Expand count raw words into a NULL-terminated array, globbing those
+   from index `first` on. With split, unquoted substitutions are split
+   into fields on IFS, and fields left empty by them are dropped: `$(false)`
+   is no argument at all, `""` is still one. */
+static char **expand_words(const word_t *words, int count, int first, int split) {
+    int n = 0, cap = count + 2;
+    char **args = malloc(cap * sizeof(char *));
+    char **patterns = malloc(cap * sizeof(char *));
+    if (!args || !patterns) {
+        perror("malloc expand_words");
+        exit(EXIT_FAILURE);
+    }
+    cuts_t cuts = { 0 };
+    for (int i = 0; i < count; i++) {
+        char *pattern;
+        cuts.count = 0;
+        char *text = expand_fields(words[i], &pattern, split ? &cuts : NULL, 0);
+        if (i < first) {
+            free(pattern);
+            pattern = NULL;
+        }
+        if (cuts.count == 0) {
+            if (split && *text == '\0' && !memchr(words[i].s, '\'', words[i].len) &&
+                    !memchr(words[i].s, '"', words[i].len) &&
+                    !memchr(words[i].s, '\\', words[i].len)) {
+                free(text);
+                free(pattern);
+            } else {
+                add_field(&args, &patterns, &n, &cap, text, pattern);
+            }
+            continue;
+        }
+        /* Cut the text (and the pattern, if globbing) into fields */
+        size_t t = 0, p = 0, tlen = strlen(text), plen = pattern ? strlen(pattern) : 0;
+        for (int c = 0; c <= cuts.count; c += 2) {
+            size_t tend = c < cuts.count ? cuts.at[c] : tlen;
+            size_t pend = c < cuts.count ? cuts.at[c + 1] : plen;
+            if (tend > t)
+                add_field(&args, &patterns, &n, &cap, strndup(text + t, tend - t),
+                          pattern ? strndup(pattern + p, pend - p) : NULL);
+            t = tend;
+            p = pend;
+        }
+        free(text);
+        free(pattern);
+    }
+    free(cuts.at);
+    args[n] = patterns[n] = NULL;
+
+    /* Perform globbing expansion on the arguments */
+    prof_begin(PROF_GLOB);
+    char **result = expand_globs(args, patterns, 0);
+    prof_end();
+    for (int i = 0; i < n; i++) {
+        free(args[i]);
+        free(patterns[i]);
+    }
+    free(args);
+    free(patterns);
+    return result;
+}
+
+/* ------------------------ */
+/* Here-documents           */
+/* ------------------------ */
+/* A here-document's body is a view into the source like any word (see
+   lex_line()); each time its command runs, the body is expanded into a
+   buffer and handed to the command as stdin without touching a file
+   system. A body that fits in a page is written into a pipe, which
+   always holds that much, and the write end closed: two syscalls and
+   no blocking. Anything larger goes into a memfd that is then sealed
+   against writes and resizing, so the command can seek and mmap it and
+   still sees exactly the text the shell wrote. */
+#define HERE_PIPE_MAX 4096
+
+static int write_all(int fd, const char *data, size_t len);
+
+/* A descriptor reading len bytes of data from the start, or -1. */
+static int here_fd(const char *data, size_t len) {
+    int fds[2];
+    if (len <= HERE_PIPE_MAX) {
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            return -1;
+        }
+        if (write_all(fds[1], data, len) < 0) {
+            perror("write here-document");
+            close(fds[0]);
+            fds[0] = -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+    int fd = memfd_create("utsh-here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("memfd_create");
+        return -1;
+    }
+    if (write_all(fd, data, len) < 0 ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0 ||
+        lseek(fd, 0, SEEK_SET) < 0) {
+        perror("here-document");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* The here-document or here-string of n, expanded, as a descriptor to
+   read it from; -1 on failure. */
+static int here_document(ast_t *n) {
+    word_t body = n->infile;
+    outbuf_t stripped = { 0 }, text = { 0 };
+    char *pattern = NULL, *value = NULL;
+    if (n->here & HERE_STRIP) {
+        for (const char *c = body.s, *end = body.s + body.len; c < end; c++) {
+            if (*c == '\t' && (c == body.s || c[-1] == '\n'))
+                while (c < end && *c == '\t')
+                    c++;
+            if (c < end)
+                outbuf_putc(&stripped, *c);
+        }
+        body = (word_t){ stripped.data ? stripped.data : "", (int)stripped.len };
+    }
+    switch (n->here & ~HERE_STRIP) {
+    case HERE_RAW:
+        outbuf_append(&text, body.s, body.len);
+        break;
+    case HERE_DOC:
+        value = expand_fields(body, &pattern, NULL, QUOTE_HERE);
+        break;
+    default:
+        value = expand_word(body, &pattern);
+        break;
+    }
+    if (value) {
+        outbuf_append(&text, value, strlen(value));
+        if ((n->here & ~HERE_STRIP) == HERE_STRING)
+            outbuf_putc(&text, '\n');
+    }
+    int fd = expand_failed ? -1 : here_fd(text.data ? text.data : "", text.len);
+    free(value);
+    free(pattern);
+    free(text.data);
+    free(stripped.data);
+    return fd;
+}
+
+/* Whether a raw word is an assignment: a name, unquoted, then '='. */
+static int word_is_assignment(word_t w) {
+    int i = 0;
+    while (i < w.len && (isalnum((unsigned char)w.s[i]) || w.s[i] == '_'))
+        i++;
+    return i < w.len && w.s[i] == '=' && var_name_valid(w.s, i);
+}
+
+/* Build a runnable command from a parse-tree command node. Leading
+   assignments are expanded into assigns, without globbing. */
+command_t *expand_command(ast_t *n) {
+    prof_begin(PROF_EXPAND);
+    command_t *cmd = calloc(1, sizeof(command_t));
+    if (!cmd) {
+        perror("calloc expand_command");
+        exit(EXIT_FAILURE);
+    }
+    cmd->here_fd = -1;
+    if (n->type == AST_COMMAND) {
+        int a = 0;
+        while (a < n->num_words && word_is_assignment(n->words[a]))
+            a++;
+        if (a > 0)
+            cmd->assigns = expand_words(n->words, a, a, 0);
+        cmd->args = expand_words(n->words + a, n->num_words - a, 1, 1);
+    } else {
+        cmd->args = calloc(1, sizeof(char *));
+        if (!cmd->args) {
+            perror("calloc expand_command");
+            exit(EXIT_FAILURE);
+        }
+        cmd->body = n;
+    }
+
+    char *unused;
+    if (n->here)
+        expand_failed |= (cmd->here_fd = here_document(n)) < 0;
+    else if (n->infile.s)
+        cmd->infile = expand_word(n->infile, &unused), free(unused);
+    if (n->outfile.s)
+        cmd->outfile = expand_word(n->outfile, &unused), free(unused);
+    cmd->append = n->append;
+    cmd->meter = n->meter;
+    prof_end();
+    return cmd;
+}
+
+/* ------------------------ */
+/* Globbing expansion       */
+/* ------------------------ */
+/* For each argument (except index 0, the command name) that has a glob
+   pattern, use glob() to expand it into matching filenames. */
+char **expand_globs(char **args, char **patterns, int first) {
+    int new_capacity = 16;
+    int new_count = 0;
+    char **new_args = malloc(new_capacity * sizeof(char *));
+    if (!new_args) {
+        perror("malloc expand_globs");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; args[i] != NULL; i++) {
+        glob_t g;
+        size_t matches = 0;
+        /* Do not expand the command name (args before `first`) */
+        if (i >= first && patterns[i] != NULL && glob(patterns[i], 0, NULL, &g) == 0)
+            matches = g.gl_pathc;
+        /* If glob fails or no match, use the original argument */
+        size_t needed = matches ? matches : 1;
+        while (new_count + needed >= (size_t)new_capacity) {
+            new_capacity *= 2;
+            new_args = realloc(new_args, new_capacity * sizeof(char *));
+            if (!new_args) {
+                perror("realloc expand_globs");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (matches) {
+            for (size_t j = 0; j < g.gl_pathc; j++)
+                new_args[new_count++] = strdup(g.gl_pathv[j]);
+            globfree(&g);
+        } else {
+            if (i >= first && patterns[i] != NULL)
+                globfree(&g);
+            new_args[new_count++] = strdup(args[i]);
+        }
+    }
+    new_args[new_count] = NULL;
+    return new_args;
+}
+
+/* ------------------------ */
+/* Free a command_t         */
+/* ------------------------ */
+void free_command(command_t *cmd) {
+    if (!cmd)
+        return;
+    if (cmd->args) {
+        for (int i = 0; cmd->args[i] != NULL; i++) {
+            free(cmd->args[i]);
+        }
+        free(cmd->args);
+    }
+    if (cmd->assigns) {
+        for (int i = 0; cmd->assigns[i] != NULL; i++)
+            free(cmd->assigns[i]);
+        free(cmd->assigns);
+    }
+    if (cmd->infile)
+        free(cmd->infile);
+    if (cmd->outfile)
+        free(cmd->outfile);
+    if (cmd->here_fd >= 0)
+        close(cmd->here_fd);
+    free(cmd);
+}
+
+/* ------------------------ */
+/* Shell initialisation     */
+/* ------------------------ */
+static void update_term_columns(void) {
+    struct winsize ws;
+    if (ioctl(STDERR_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
+        term_columns = ws.ws_col;
+}
+
+static int jobs_need_notify(void);
+static void admit_queued_jobs(void);
+static void launch_job(job_t *j, int foreground);
+static void pstat_collect(job_t *j, int stage);
+static void meter_stop_all(job_t *j);
+static void sample_close(process_t *p);
+
+/* Drain the signalfd. Child exits are reaped straight away; at a prompt,
+   finished background jobs are reported without waiting for Enter. */
+static void on_signal(int fd, uint32_t events, void *data) {
+    (void)events; (void)data;
+    struct signalfd_siginfo si;
+    int child = 0;
+    while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGCHLD)
+            child = 1;
+        else if (si.ssi_signo == SIGWINCH)
+            update_term_columns();
+        else if (si.ssi_signo == SIGINT)
+            interrupted = 1;
+    }
+    if (child) {
+        reap_children();
+        if (at_prompt && jobs_need_notify()) {
+            printf("\n");
+            notify_jobs();
+            print_prompt();
+        }
+    }
+}
+
+/* Put the shell in its own process group in the foreground, and route
+   SIGCHLD, SIGWINCH and (interactively) SIGINT through a signalfd watched
+   by the event loop instead of asynchronous handlers. Job control signals
+   are ignored by the shell itself so that only the foreground job
+   receives them. */
+void init_shell(int allow_interactive) {
+    shell_interactive = allow_interactive && isatty(STDIN_FILENO);
+    var_import(environ);
+    reactor_init();
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGWINCH);
+    if (shell_interactive)
+        sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+        perror("sigprocmask");
+        exit(EXIT_FAILURE);
+    }
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    if (reactor_add(signal_fd, EPOLLIN, on_signal, NULL) < 0)
+        exit(EXIT_FAILURE);
+    update_term_columns();
+
+    if (!shell_interactive)
+        return;
+
+    /* Wait until we are in the foreground before taking the terminal. */
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp()))
+        kill(-shell_pgid, SIGTTIN);
+
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shell_pgid = getpid();
+    if (setpgid(shell_pgid, shell_pgid) < 0 && errno != EPERM) {
+        perror("setpgid");
+        exit(EXIT_FAILURE);
+    }
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+}
+
+/* Undo init_shell() in a freshly forked child before it execs. */
+static void reset_child_signals(void) {
+    sigset_t mask;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+}
+
+/* ------------------------ */
+/* Job table                */
+/* ------------------------ */
+static job_t *create_job(command_t **cmds, int num_cmds, const char *cmdline) {
+    job_t *j = calloc(1, sizeof(job_t));
+    if (!j) {
+        perror("calloc job");
+        exit(EXIT_FAILURE);
+    }
+    j->procs = calloc(num_cmds, sizeof(process_t));
+    j->cmdline = strdup(cmdline ? cmdline : "");
+    if (!j->procs || !j->cmdline) {
+        perror("calloc job");
+        exit(EXIT_FAILURE);
+    }
+    j->cmds = cmds;
+    j->num_procs = num_cmds;
+    j->timed = timing != NULL;
+    j->meter_timer = -1;
+    if (pstat_acc) {
+        j->perf_fds = malloc(num_cmds * PSTAT_EVENTS * sizeof(int));
+        if (!j->perf_fds) {
+            perror("malloc perf_fds");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < num_cmds * PSTAT_EVENTS; i++)
+            j->perf_fds[i] = -1;
+    }
+    j->node = trace_node;
+    j->history_entry = history_current;
+    j->io[0] = STDIN_FILENO;
+    j->io[1] = STDOUT_FILENO;
+    j->io[2] = STDERR_FILENO;
+
+    /* Job numbers grow past the highest one in use, like other shells. */
+    int max_id = 0;
+    job_t **tail = &job_list;
+    while (*tail) {
+        if ((*tail)->id > max_id)
+            max_id = (*tail)->id;
+        tail = &(*tail)->next;
+    }
+    j->id = max_id + 1;
+    *tail = j;
+    return j;
+}
+
+static void free_job(job_t *j) {
+    meter_stop_all(j);
+    if (j->perf_fds) {
+        for (int i = 0; i < j->num_procs * PSTAT_EVENTS; i++)
+            if (j->perf_fds[i] >= 0)
+                close(j->perf_fds[i]);
+        free(j->perf_fds);
+    }
+    for (int i = 0; i < j->num_procs; i++) {
+        free_command(j->cmds[i]);   /* NULL for a forked copy of the shell */
+        sample_close(&j->procs[i]);
+    }
+    free(j->cmds);
+    free(j->procs);
+    free(j->cmdline);
+    free(j);
+}
+
+static void remove_job(job_t *j) {
+    for (job_t **pp = &job_list; *pp; pp = &(*pp)->next) {
+        if (*pp == j) {
+            *pp = j->next;
+            free_job(j);
+            return;
+        }
+    }
+}
+
+static int job_is_stopped(job_t *j) {
+    if (j->queued)
+        return 0;
+    for (int i = 0; i < j->num_procs; i++)
+        if (!j->procs[i].completed && !j->procs[i].stopped)
+            return 0;
+    return 1;
+}
+
+static int job_is_completed(job_t *j) {
+    for (int i = 0; i < j->num_procs; i++)
+        if (!j->procs[i].completed)
+            return 0;
+    return 1;
+}
+
+/* Convert a raw wait status into a shell exit status. */
+static int wait_status_code(int status) {
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    if (WIFSTOPPED(status))
+        return 128 + WSTOPSIG(status);
+    return 0;
+}
+
+/* The status of a job is the status of its last stage or, with
+   "set -o pipefail", of the last stage that failed. */
+static int job_exit_status(job_t *j) {
+    if (opt_pipefail)
+        for (int i = j->num_procs - 1; i >= 0; i--)
+            if (wait_status_code(j->procs[i].status) != 0)
+                return wait_status_code(j->procs[i].status);
+    return wait_status_code(j->procs[j->num_procs - 1].status);
+}
+
+/* Send sig to every process of the job. Without job control the stages
+   share the shell's process group, so they are signalled one by one. */
+static int signal_job(job_t *j, int sig) {
+    if (shell_interactive && j->pgid > 0)
+        return kill(-j->pgid, sig);
+    int ret = 0;
+    for (int i = 0; i < j->num_procs; i++)
+        if (j->procs[i].pid > 0 && !j->procs[i].completed && kill(j->procs[i].pid, sig) < 0)
+            ret = -1;
+    return ret;
+}
+
+static job_t *find_job_by_id(int id) {
+    for (job_t *j = job_list; j; j = j->next)
+        if (j->id == id)
+            return j;
+    return NULL;
+}
+
+/* The current job ("%+") is the most recently created one. */
+static job_t *current_job(void) {
+    job_t *cur = NULL;
+    for (job_t *j = job_list; j; j = j->next)
+        if (!job_is_completed(j))
+            cur = j;
+    return cur;
+}
+
+/* Resolve "%n", "%%", "%+" or a plain pid to a job. */
+static job_t *find_job(const char *spec) {
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+        return current_job();
+    if (spec[0] == '%')
+        return find_job_by_id(atoi(spec + 1));
+    pid_t pid = atoi(spec);
+    if (pid <= 0)
+        return NULL;
+    for (job_t *j = job_list; j; j = j->next)
+        for (int i = 0; i < j->num_procs; i++)
+            if (j->procs[i].pid == pid)
+                return j;
+    return NULL;
+}
+
+static process_t *find_process(pid_t pid, job_t **job) {
+    for (job_t *j = job_list; j; j = j->next)
+        for (int i = 0; i < j->num_procs; i++)
+            if (j->procs[i].pid == pid) {
+                if (job)
+                    *job = j;
+                return &j->procs[i];
+            }
+    return NULL;
+}
+
+/* Read the I/O counters of an exited (not yet reaped) child. */
+static void read_process_io(process_t *p) {
+    static const char *const keys[4] = { "rchar:", "wchar:", "read_bytes:", "write_bytes:" };
+    char path[64], buf[512];
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)p->pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return;
+    buf[n] = '\0';
+    for (int k = 0; k < 4; k++) {
+        char *at = strstr(buf, keys[k]);
+        if (at)
+            p->io[k] = strtoull(at + strlen(keys[k]), NULL, 10);
+    }
+}
+
+static void time_add_process(time_acc_t *t, process_t *p) {
+    t->user += p->ru.ru_utime.tv_sec + p->ru.ru_utime.tv_usec / 1e6;
+    t->sys += p->ru.ru_stime.tv_sec + p->ru.ru_stime.tv_usec / 1e6;
+    if (p->ru.ru_maxrss > t->maxrss)
+        t->maxrss = p->ru.ru_maxrss;
+    t->minflt += p->ru.ru_minflt;
+    t->majflt += p->ru.ru_majflt;
+    t->nvcsw += p->ru.ru_nvcsw;
+    t->nivcsw += p->ru.ru_nivcsw;
+    for (int k = 0; k < 4; k++)
+        t->io[k] += p->io[k];
+    t->procs++;
+}
+
+/* Record a state change reported by wait4(); ru only means something
+   once the process has exited. */
+static void update_process(pid_t pid, int status, const struct rusage *ru) {
+    job_t *j;
+    process_t *p = find_process(pid, &j);
+    if (!p)
+        return;
+    p->status = status;
+    if (WIFSTOPPED(status)) {
+        p->stopped = 1;
+    } else if (WIFCONTINUED(status)) {
+        p->stopped = 0;
+    } else {
+        p->completed = 1;
+        sample_close(p);
+        p->ru = *ru;
+        clock_gettime(CLOCK_MONOTONIC, &p->end);
+        trace_event(TR_EXIT, pid, j->node, (int)(p - j->procs), wait_status_code(status), 0, NULL);
+        if (j->timed && timing)
+            time_add_process(timing, p);
+        if (j->history_entry >= 0 && p->ru.ru_maxrss > history[j->history_entry].maxrss)
+            history[j->history_entry].maxrss = p->ru.ru_maxrss;
+        if (j->perf_fds)
+            pstat_collect(j, (int)(p - j->procs));
+    }
+    j->notified = 0;
+}
+
+/* Reap every child that has changed state without blocking. Any child,
+   foreground or background, is recorded against the job that owns it, so
+   a pipeline wait can never lose an unrelated exit. */
+void reap_children(void) {
+    int status;
+    pid_t pid;
+    struct rusage ru;
+    for (;;) {
+        pid_t which = -1;
+        /* Under "time", peek at an exited child first: its /proc/<pid>/io
+           disappears once it is reaped. */
+        siginfo_t info;
+        info.si_pid = 0;
+        if (timing && waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid > 0) {
+            job_t *j;
+            process_t *p = find_process(info.si_pid, &j);
+            if (p && j->timed)
+                read_process_io(p);
+            which = info.si_pid;
+        }
+        pid = wait4(which, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru);
+        if (pid <= 0)
+            break;
+        update_process(pid, status, &ru);
+    }
+    admit_queued_jobs();
+}
+
+/* Run the event loop until every process in the job has exited or
+   stopped, or until SIGINT reaches the shell (only possible when the job
+   does not own the terminal, as in "wait"). */
+static void wait_for_job(job_t *j) {
+    prof_begin(PROF_WAIT);
+    reap_children();
+    while (!job_is_stopped(j) && !interrupted)
+        if (reactor_run_once(-1) < 0)
+            break;
+    prof_end();
+}
+
+static const char *job_state_name(job_t *j) {
+    if (j->queued)
+        return "Queued";
+    if (job_is_completed(j))
+        return "Done";
+    if (job_is_stopped(j))
+        return "Stopped";
+    return "Running";
+}
+
+static int jobs_need_notify(void) {
+    for (job_t *j = job_list; j; j = j->next) {
+        if (job_is_completed(j) ? j->background : (job_is_stopped(j) && !j->notified))
+            return 1;
+    }
+    return 0;
+}
+
+static void print_job(job_t *j) {
+    char mark = (j == current_job()) ? '+' : ' ';
+    printf("[%d]%c  %-24s%s\n", j->id, mark, job_state_name(j), j->cmdline);
+}
+
+/* Report finished or newly stopped background jobs, and drop finished
+   jobs from the table. Called before every prompt. */
+void notify_jobs(void) {
+    reap_children();
+    job_t *j = job_list;
+    while (j) {
+        job_t *next = j->next;
+        if (job_is_completed(j)) {
+            if (j->background && shell_interactive)
+                print_job(j);
+            remove_job(j);
+        } else if (job_is_stopped(j) && !j->notified) {
+            print_job(j);
+            j->notified = 1;
+        }
+        j = next;
+    }
+    fflush(stdout);
+}
+
+/* Remember the per-stage results of a foreground job (or, with j NULL,
+   of a built-in that the shell ran itself). */
+static void record_pipeline(job_t *j, const char *name, int status) {
+    /* The same built-in again (as in a loop): reuse the entry */
+    if (!j && last_num_stages == 1 && strcmp(last_stages[0].name, name) == 0) {
+        char *same = last_stages[0].name;
+        memset(&last_stages[0], 0, sizeof(stage_info_t));
+        last_stages[0].name = same;
+        last_stages[0].status = status;
+        return;
+    }
+    for (int i = 0; i < last_num_stages; i++)
+        free(last_stages[i].name);
+    free(last_stages);
+    last_num_stages = j ? j->num_procs : 1;
+    last_stages = calloc(last_num_stages, sizeof(stage_info_t));
+    if (!last_stages) {
+        perror("calloc last_stages");
+        exit(EXIT_FAILURE);
+    }
+    if (!j) {
+        last_stages[0].name = strdup(name);
+        last_stages[0].status = status;
+        return;
+    }
+    for (int i = 0; i < j->num_procs; i++) {
+        process_t *p = &j->procs[i];
+        stage_info_t *s = &last_stages[i];
+        command_t *cmd = j->cmds[i];
+        s->name = strdup(cmd && cmd->args[0] ? cmd->args[0] : j->cmdline);
+        s->pid = p->pid;
+        s->status = wait_status_code(p->status);
+        if (p->completed && p->pid > 0) {
+            s->ru = p->ru;
+            s->real = (p->end.tv_sec - j->start.tv_sec) +
+                      (p->end.tv_nsec - j->start.tv_nsec) / 1e9;
+        }
+    }
+}
+
+/* Say why a foreground job was killed, as other shells do. A stage
+   killed by SIGINT also stops the rest of the command line. */
+static void report_job_signal(job_t *j) {
+    for (int i = 0; i < j->num_procs; i++)
+        if (WIFSIGNALED(j->procs[i].status) && WTERMSIG(j->procs[i].status) == SIGINT)
+            interrupted = 1;
+    int raw = j->procs[j->num_procs - 1].status;
+    if (!WIFSIGNALED(raw) || WTERMSIG(raw) == SIGINT || WTERMSIG(raw) == SIGPIPE)
+        return;
+    fprintf(stderr, "%s%s\n", strsignal(WTERMSIG(raw)), WCOREDUMP(raw) ? " (core dumped)" : "");
+}
+
+/* Give the terminal to the job, optionally continue it, and wait for it.
+   Returns the job's exit status; the job is removed once it completes.
+   A Ctrl-C seen before this point was meant for an earlier job, and
+   must not end the wait for this one at once. */
+static int put_job_in_foreground(job_t *j, int cont) {
+    j->background = 0;
+    interrupted = 0;
+    if (shell_interactive) {
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+        if (cont)
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &j->tmodes);
+    }
+    if (cont) {
+        for (int i = 0; i < j->num_procs; i++)
+            j->procs[i].stopped = 0;
+        if (signal_job(j, SIGCONT) < 0)
+            perror("kill (SIGCONT)");
+    }
+
+    wait_for_job(j);
+    if (j->meter_timer >= 0) {
+        reactor_del(j->meter_timer);
+        close(j->meter_timer);
+        j->meter_timer = -1;
+        fprintf(stderr, "\r\033[K");
+    }
+
+    if (shell_interactive) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcgetattr(STDIN_FILENO, &j->tmodes);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+
+    int status = job_exit_status(j);
+    record_pipeline(j, NULL, status);
+    if (job_is_completed(j)) {
+        report_job_signal(j);
+        remove_job(j);
+    } else {
+        printf("\n");
+        print_job(j);
+        j->notified = 1;
+        j->background = 1;
+    }
+    return status;
+}
+
+static void put_job_in_background(job_t *j, int cont) {
+    j->background = 1;
+    if (cont) {
+        for (int i = 0; i < j->num_procs; i++)
+            j->procs[i].stopped = 0;
+        if (signal_job(j, SIGCONT) < 0)
+            perror("kill (SIGCONT)");
+    }
+}
+
+/* ------------------------ */
+/* Command path cache       */
+/* ------------------------ */
+/* Full paths of commands already found on PATH, so that repeated spawns
+   skip the directory scan. Looked up in the parent, before forking, so
+   the result is kept for the next spawn. */
+#define PATH_CACHE_SIZE 256
+
+typedef struct path_entry {
+    char *name;
+    char *path;
+    struct path_entry *next;
+} path_entry_t;
+
+static path_entry_t *path_cache[PATH_CACHE_SIZE];
+
+static unsigned long hash_string(const char *s) {
+    unsigned long h = 14695981039346656037UL;   /* FNV-1a */
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+void path_cache_clear(void) {
+    for (int i = 0; i < PATH_CACHE_SIZE; i++) {
+        path_entry_t *e = path_cache[i];
+        while (e) {
+            path_entry_t *next = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            e = next;
+        }
+        path_cache[i] = NULL;
+    }
+}
+
+/* Resolve a command name to an executable path. Names containing '/'
+   are returned unchanged; NULL means the command was not found. The
+   returned string belongs to the cache. */
+const char *path_lookup(const char *name) {
+    if (strchr(name, '/'))
+        return name;
+    unsigned long slot = hash_string(name) % PATH_CACHE_SIZE;
+    for (path_entry_t *e = path_cache[slot]; e; e = e->next)
+        if (strcmp(e->name, name) == 0)
+            return e->path;
+
+    const char *path_var = var_value(var_path);
+    if (!path_var)
+        path_var = "/usr/local/bin:/usr/bin:/bin";
+    size_t name_len = strlen(name);
+    const char *dir = path_var;
+    while (1) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+        char *candidate = malloc(dir_len + name_len + 3);
+        if (!candidate) {
+            perror("malloc path_lookup");
+            exit(EXIT_FAILURE);
+        }
+        if (dir_len == 0)
+            sprintf(candidate, "./%s", name);
+        else
+            sprintf(candidate, "%.*s/%s", (int)dir_len, dir, name);
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            path_entry_t *e = malloc(sizeof(path_entry_t));
+            if (!e || !(e->name = strdup(name))) {
+                perror("malloc path_lookup");
+                exit(EXIT_FAILURE);
+            }
+            e->path = candidate;
+            e->next = path_cache[slot];
+            path_cache[slot] = e;
+            return candidate;
+        }
+        free(candidate);
+        if (!end)
+            break;
+        dir = end + 1;
+    }
+    return NULL;
+}
+
+/* ------------------------ */
+/* Performance counters     */
+/* ------------------------ */
+/* "pstat list" counts every stage of the pipelines in list with
+   perf_event_open(). The counters are attached to a stage between fork
+   and exec (the child waits on a pipe until they are in place), start
+   counting at exec and are inherited by whatever the stage forks. A
+   stage that never execs (a built-in or a compound command) has them
+   started by the shell instead, just before it is let go.
+   Software events work everywhere, VMs without a PMU included; hardware
+   events are shown when the CPU exposes them. */
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} pstat_events[PSTAT_EVENTS] = {
+    { "task-clock",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { "ctx-sw",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "migrations",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { "faults",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { "cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+};
+
+static int perf_open(int event, pid_t pid) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = pstat_events[event].type;
+    attr.config = pstat_events[event].config;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && errno == EACCES) {
+        /* perf_event_paranoid may only allow user-space counting */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+/* In the parent after fork: attach the counters to the stage, then let
+   it go on to exec by closing the pipe it is blocked on. */
+static void pstat_attach(job_t *j, int stage, pid_t pid, int sync_fd, int execs) {
+    for (int k = 0; k < PSTAT_EVENTS; k++) {
+        int fd = perf_open(k, pid);
+        if (fd >= 0 && !execs)
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        j->perf_fds[stage * PSTAT_EVENTS + k] = fd;
+    }
+    close(sync_fd);
+}
+
+/* Once a stage has exited: read its counters into a row and close them. */
+static void pstat_collect(job_t *j, int stage) {
+    int *fds = &j->perf_fds[stage * PSTAT_EVENTS];
+    pstat_row_t *row = NULL;
+    if (pstat_acc) {
+        pstat_row_t *rows = realloc(pstat_acc->rows, (pstat_acc->count + 1) * sizeof(pstat_row_t));
+        if (!rows) {
+            perror("realloc pstat rows");
+            exit(EXIT_FAILURE);
+        }
+        pstat_acc->rows = rows;
+        row = &rows[pstat_acc->count++];
+        memset(row, 0, sizeof(*row));
+        command_t *cmd = j->cmds[stage];
+        row->name = strdup(cmd && cmd->args[0] ? cmd->args[0] : j->cmdline);
+        row->node = j->node;
+        row->stage = stage;
+    }
+    for (int k = 0; k < PSTAT_EVENTS; k++) {
+        uint64_t v[3];    /* value, time enabled, time running */
+        if (fds[k] < 0)
+            continue;
+        if (row && read(fds[k], v, sizeof(v)) == (ssize_t)sizeof(v) && v[2] > 0) {
+            row->value[k] = (double)v[0] * v[1] / v[2];
+            row->valid |= 1 << k;
+        }
+        close(fds[k]);
+        fds[k] = -1;
+    }
+}
+
+static int pstat_row_cmp(const void *a, const void *b) {
+    const pstat_row_t *x = a, *y = b;
+    if (x->node != y->node)
+        return x->node < y->node ? -1 : 1;
+    return x->stage - y->stage;
+}
+
+/* ------------------------ */
+/* Metered pipes            */
+/* ------------------------ */
+/* "a |> b" joins a and b through two pipes with the shell in between:
+   the event loop moves data from one to the other with splice(), so it
+   never passes through user space, and counts bytes and the time spent
+   waiting for a to write (a is the slow side) versus waiting for b to
+   read (b is the slow side). While a foreground job runs on a terminal
+   a status line is refreshed on stderr; each meter prints a summary
+   when its input ends. */
+static void format_bytes(char *buf, size_t size, double bytes) {
+    const char *units = "BKMGT";
+    int u = 0;
+    while (bytes >= 1024 && units[u + 1]) {
+        bytes /= 1024;
+        u++;
+    }
+    snprintf(buf, size, u ? "%.1f%c" : "%.0f%c", bytes, units[u]);
+}
+
+/* Charge the time since the last state change to the side we waited on. */
+static void meter_account(meter_t *m, uint64_t now) {
+    if (m->waiting_output)
+        m->wait_out += now - m->since;
+    else
+        m->wait_in += now - m->since;
+    m->since = now;
+}
+
+static void meter_finish(meter_t *m) {
+    if (m->in < 0)
+        return;
+    uint64_t now = prof_now();
+    meter_account(m, now);
+    m->end = now;
+    reactor_del(m->in);
+    reactor_del(m->out);
+    close(m->in);
+    close(m->out);
+    m->in = m->out = -1;
+
+    double secs = (m->end - m->start) / 1e9;
+    double waited = (double)(m->wait_in + m->wait_out);
+    char total[16], rate[16];
+    format_bytes(total, sizeof(total), (double)m->bytes);
+    format_bytes(rate, sizeof(rate), secs > 0 ? m->bytes / secs : 0);
+    int in_pct = waited > 0 ? (int)(100 * m->wait_in / waited + 0.5) : 0;
+    fprintf(stderr, "%s|> %d: %s in %.2fs (%s/s), waited for stage %d %d%%, for stage %d %d%%%s\n",
+            isatty(STDERR_FILENO) ? "\r\033[K" : "", m->stage, total, secs, rate,
+            m->stage, in_pct, m->stage + 1, waited > 0 ? 100 - in_pct : 0,
+            waited == 0 ? "" : in_pct >= 50 ? " (upstream is slower)" : " (downstream is slower)");
+}
+
+static void on_meter(int fd, uint32_t events, void *data);
+
+/* SIGPIPE keeps its default action, so the shell dies with its reader
+   like any other process. Where the shell itself writes into a pipe or
+   socket that may lose its reader (a relay, the spawn server), it holds
+   the signal blocked and takes the EPIPE instead; sigpipe_unblock()
+   drops the signal that such a write left pending. */
+static void sigpipe_block(sigset_t *old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+static void sigpipe_unblock(const sigset_t *old, int epipe) {
+    if (epipe) {
+        sigset_t set;
+        struct timespec now = { 0, 0 };
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        sigtimedwait(&set, NULL, &now);
+    }
+    sigprocmask(SIG_SETMASK, old, NULL);
+}
+
+/* Move as much as possible from in to out, then wait on whichever side
+   stopped us. Returns 1 if the next stage went away (EPIPE). */
+static int meter_move(meter_t *m) {
+    for (int rounds = 0; rounds < 16; rounds++) {
+        ssize_t n = splice(m->in, NULL, m->out, NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            m->bytes += n;
+            continue;
+        }
+        if (n == 0 || errno == EPIPE) {
+            /* Input ended, or the next stage went away */
+            meter_finish(m);
+            return n < 0;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN) {
+            perror("splice");
+            meter_finish(m);
+            return 0;
+        }
+        /* EAGAIN: either nothing to read or no room to write */
+        int pending = 0;
+        ioctl(m->in, FIONREAD, &pending);
+        int waiting_output = pending > 0;
+        if (waiting_output != m->waiting_output) {
+            meter_account(m, prof_now());
+            m->waiting_output = waiting_output;
+            if (waiting_output) {
+                reactor_del(m->in);
+                reactor_add(m->out, EPOLLOUT, on_meter, m);
+            } else {
+                reactor_del(m->out);
+                reactor_add(m->in, EPOLLIN, on_meter, m);
+            }
+        }
+        return 0;
+    }
+    /* Still flowing: come back on the next turn of the event loop */
+    return 0;
+}
+
+static void meter_pump(meter_t *m) {
+    sigset_t old;
+    sigpipe_block(&old);
+    sigpipe_unblock(&old, meter_move(m));
+}
+
+static void on_meter(int fd, uint32_t events, void *data) {
+    (void)fd; (void)events;
+    meter_pump(data);
+}
+
+/* Set up the relay after stage: it writes into *stage_out and the next
+   stage reads from *next_in. Returns -1 if the pipes cannot be made. */
+static int meter_start(job_t *j, int stage, int *stage_out, int *next_in) {
+    int a[2], b[2];
+    if (pipe2(a, O_CLOEXEC) < 0)
+        return -1;
+    if (pipe2(b, O_CLOEXEC) < 0) {
+        close(a[0]);
+        close(a[1]);
+        return -1;
+    }
+    meter_t *m = calloc(1, sizeof(meter_t));
+    if (!m) {
+        perror("calloc meter");
+        exit(EXIT_FAILURE);
+    }
+    m->in = a[0];
+    m->out = b[1];
+    m->stage = stage;
+    m->start = m->since = prof_now();
+    fcntl(m->in, F_SETFL, O_NONBLOCK);
+    fcntl(m->out, F_SETFL, O_NONBLOCK);
+    reactor_add(m->in, EPOLLIN, on_meter, m);
+    meter_t **tail = &j->meters;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = m;
+    *stage_out = a[1];
+    *next_in = b[0];
+    return 0;
+}
+
+/* Status line for a foreground job, refreshed by a timer. */
+static void on_meter_tick(int fd, uint32_t events, void *data) {
+    (void)fd; (void)events;
+    job_t *j = data;
+    char line[512];
+    size_t len = 0;
+    int active = 0;
+    for (meter_t *m = j->meters; m && len < sizeof(line) - 64; m = m->next) {
+        if (m->in < 0)
+            continue;
+        active = 1;
+        uint64_t now = prof_now();
+        meter_account(m, now);
+        double waited = (double)(m->wait_in + m->wait_out);
+        char total[16], rate[16];
+        format_bytes(total, sizeof(total), (double)m->bytes);
+        format_bytes(rate, sizeof(rate), (m->bytes - m->last_bytes) * 2.0);
+        m->last_bytes = m->bytes;
+        len += snprintf(line + len, sizeof(line) - len, "[|> %d: %s %s/s in %d%% out %d%%] ",
+                        m->stage, total, rate,
+                        waited > 0 ? (int)(100 * m->wait_in / waited) : 0,
+                        waited > 0 ? (int)(100 * m->wait_out / waited) : 0);
+    }
+    if (active)
+        fprintf(stderr, "\r\033[K%s", line);
+}
+
+/* Called once the job's processes are gone (or the job is dropped). */
+static void meter_stop_all(job_t *j) {
+    if (j->meter_timer >= 0) {
+        reactor_del(j->meter_timer);
+        close(j->meter_timer);
+        j->meter_timer = -1;
+    }
+    while (j->meters) {
+        meter_t *m = j->meters;
+        j->meters = m->next;
+        meter_finish(m);
+        free(m);
+    }
+}
+
+/* ------------------------ */
+/* Launch one process       */
+/* ------------------------ */
+/* A built-in running in a forked child behaves like a subshell: no job
+   control, no inherited jobs, and an event loop of its own (the epoll
+   instance would otherwise be shared with the parent). */
+static void become_subshell(void) {
+    shell_interactive = 0;
+    script_input = NULL;
+    /* Children of the server would become the parent shell's children */
+    if (zygote_fd >= 0) {
+        close(zygote_fd);
+        zygote_fd = -1;
+    }
+    /* The parent relays its "|>" pipes; holding them would block EOF */
+    for (job_t *j = job_list; j; j = j->next)
+        for (meter_t *m = j->meters; m; m = m->next)
+            if (m->in >= 0) {
+                close(m->in);
+                close(m->out);
+            }
+    job_list = NULL;
+    /* Output of a $(...) captured in the parent goes to fd 1 here */
+    if (subst_stdout) {
+        stdout = subst_stdout;
+        subst_stdout = NULL;
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    close(epoll_fd);
+    watch_list = NULL;
+    reactor_init();
+    reactor_add(signal_fd, EPOLLIN, on_signal, NULL);
+}
+
+/* Runs in the child: join the job's process group, wire up the pipeline
+   ends and any redirections, then exec path (as looked up by the parent;
+   NULL if the command was not found). Never returns. */
+static void launch_process(command_t *cmd, const char *path, pid_t pgid,
+                           int in_fd, int out_fd, int err_fd, int foreground) {
+    if (shell_interactive) {
+        pid_t pid = getpid();
+        if (pgid == 0)
+            pgid = pid;
+        setpgid(pid, pgid);
+        if (foreground)
+            tcsetpgrp(STDIN_FILENO, pgid);
+    }
+
+    if (in_fd != STDIN_FILENO) {
+        if (dup2(in_fd, STDIN_FILENO) < 0) {
+            perror("dup2 in_fd");
+            exit(EXIT_FAILURE);
+        }
+        close(in_fd);
+    }
+    if (out_fd != STDOUT_FILENO) {
+        if (dup2(out_fd, STDOUT_FILENO) < 0) {
+            perror("dup2 out_fd");
+            exit(EXIT_FAILURE);
+        }
+        close(out_fd);
+    }
+    if (err_fd != STDERR_FILENO) {
+        if (dup2(err_fd, STDERR_FILENO) < 0) {
+            perror("dup2 err_fd");
+            exit(EXIT_FAILURE);
+        }
+        close(err_fd);
+    }
+    if (cmd->infile != NULL) {
+        int fd_in = open(cmd->infile, O_RDONLY);
+        trace_event(TR_REDIR, getpid(), trace_node, trace_stage, STDIN_FILENO, fd_in, cmd->infile);
+        if (fd_in < 0) {
+            perror("open infile");
+            exit(EXIT_FAILURE);
+        }
+        if (dup2(fd_in, STDIN_FILENO) < 0) {
+            perror("dup2 infile");
+            exit(EXIT_FAILURE);
+        }
+        close(fd_in);
+    }
+    if (cmd->outfile != NULL) {
+        int fd_out = open(cmd->outfile, O_WRONLY | O_CREAT | (cmd->append ? O_APPEND : O_TRUNC), 0644);
+        trace_event(TR_REDIR, getpid(), trace_node, trace_stage, STDOUT_FILENO, fd_out, cmd->outfile);
+        if (fd_out < 0) {
+            perror("open outfile");
+            exit(EXIT_FAILURE);
+        }
+        if (dup2(fd_out, STDOUT_FILENO) < 0) {
+            perror("dup2 outfile");
+            exit(EXIT_FAILURE);
+        }
+        close(fd_out);
+    }
+    if (cmd->body) {
+        become_subshell();
+        exec_tail = 1;
+        /* A child is a subshell already */
+        int status = execute_node(cmd->body->type == AST_SUBSHELL ? cmd->body->left : cmd->body);
+        notify_jobs();
+        fflush(stdout);
+        exit(status);
+    }
+    if (cmd->args[0] == NULL)
+        exit(EXIT_SUCCESS);
+
+    /* A built-in inside a pipeline runs in the child like any command */
+    if (find_builtin(cmd->args[0])) {
+        become_subshell();
+        int status = run_builtin(cmd->args);
+        fflush(stdout);
+        exit(status);
+    }
+    reset_child_signals();
+    if (path == NULL) {
+        fprintf(stderr, "%s: command not found\n", cmd->args[0]);
+        exit(127);
+    }
+    trace_event(TR_EXEC, getpid(), trace_node, trace_stage, 0, 0, cmd->args[0]);
+    trace_flush();
+    execve(path, cmd->args, shell_environ());
+    /* The cached path may have gone stale; fall back to a fresh search */
+    if (errno == ENOENT && path != cmd->args[0]) {
+        environ = shell_environ();
+        execvp(cmd->args[0], cmd->args);
+    }
+    perror(cmd->args[0]);
+    exit(errno == ENOENT ? 127 : 126);
+}
+
+/* ------------------------ */
+/* Spawn server             */
+/* ------------------------ */
+/* With UTSH_ZYGOTE set, a copy of the shell is forked right after
+   startup, while its heap is still small, and external commands are
+   spawned by that copy instead of by fork() in the shell. Each request
+   goes over a socketpair: a header carrying the stage's stdin, stdout,
+   stderr and the shell's current directory as SCM_RIGHTS, then the path,
+   redirections, argv and environment as NUL-terminated strings. The
+   server clones with CLONE_PARENT, so the child belongs to the shell
+   exactly as if the shell had forked it (SIGCHLD, wait4, setpgid), and
+   the child runs the same launch_process() as the fork path. Only the
+   pid comes back. Spawn latency then no longer grows with the shell's
+   history, caches and job table. Stages that need the shell's state
+   (built-ins, "pstat", tracing) still fork. */
+typedef struct {
+    uint32_t len;         /* Bytes of strings that follow */
+    int32_t argc, envc;
+    pid_t pgid;
+    int32_t foreground, append, has_infile, has_outfile;
+} zygote_req_t;
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Pointers to the count strings stored back to back at *p. */
+static char **zygote_strings(char **p, int count) {
+    char **v = malloc((count + 1) * sizeof(char *));
+    if (!v) {
+        perror("malloc zygote");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        v[i] = *p;
+        *p += strlen(*p) + 1;
+    }
+    v[count] = NULL;
+    return v;
+}
+
+/* The server: spawn one child per request until the shell goes away. */
+static void zygote_serve(int sock) {
+    for (;;) {
+        zygote_req_t req;
+        int fds[4];
+        char control[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = { &req, sizeof(req) };
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        ssize_t n;
+        while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL)) < 0 && errno == EINTR)
+            ;
+        if (n != sizeof(req))
+            exit(0);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        if (!c || c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(sizeof(fds)))
+            exit(1);
+        memcpy(fds, CMSG_DATA(c), sizeof(fds));
+        char *data = malloc(req.len);
+        if (!data || read_full(sock, data, req.len) < 0)
+            exit(1);
+
+        /* Direct syscall: glibc's clone() wants a new stack, and fork()
+           cannot ask for CLONE_PARENT. */
+        pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+        if (pid == 0) {
+            char *p = data;
+            char *path = p;
+            p += strlen(p) + 1;
+            command_t cmd = { 0 };
+            cmd.append = req.append;
+            if (req.has_infile) {
+                cmd.infile = p;
+                p += strlen(p) + 1;
+            }
+            if (req.has_outfile) {
+                cmd.outfile = p;
+                p += strlen(p) + 1;
+            }
+            cmd.args = zygote_strings(&p, req.argc);
+            env_cache = zygote_strings(&p, req.envc);
+            env_cache_version = env_version;
+            close(sock);
+            if (fchdir(fds[3]) < 0) {
+                perror("fchdir");
+                exit(EXIT_FAILURE);
+            }
+            close(fds[3]);
+            launch_process(&cmd, path, req.pgid, fds[0], fds[1], fds[2], req.foreground);
+        }
+        if (pid < 0)
+            pid = -errno;
+        for (int i = 0; i < 4; i++)
+            close(fds[i]);
+        free(data);
+        if (write(sock, &pid, sizeof(pid)) != sizeof(pid))
+            exit(0);
+    }
+}
+
+static void zygote_start(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        close(signal_fd);
+        close(epoll_fd);
+        signal_fd = epoll_fd = -1;
+        zygote_serve(sv[1]);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+}
+
+/* Ask the server to start cmd with the given descriptors. Returns the
+   child's pid, or -1 (after giving up on the server) if it cannot. */
+static pid_t zygote_spawn(command_t *cmd, const char *path, pid_t pgid,
+                          int in_fd, int out_fd, int err_fd, int foreground) {
+    zygote_req_t req = { 0 };
+    outbuf_t buf = { 0 };
+    outbuf_append(&buf, path, strlen(path) + 1);
+    if (cmd->infile)
+        outbuf_append(&buf, cmd->infile, strlen(cmd->infile) + 1);
+    if (cmd->outfile)
+        outbuf_append(&buf, cmd->outfile, strlen(cmd->outfile) + 1);
+    for (req.argc = 0; cmd->args[req.argc]; req.argc++)
+        outbuf_append(&buf, cmd->args[req.argc], strlen(cmd->args[req.argc]) + 1);
+    char **envp = shell_environ();
+    for (req.envc = 0; envp[req.envc]; req.envc++)
+        outbuf_append(&buf, envp[req.envc], strlen(envp[req.envc]) + 1);
+    req.len = buf.len;
+    req.pgid = pgid;
+    req.foreground = foreground;
+    req.append = cmd->append;
+    req.has_infile = cmd->infile != NULL;
+    req.has_outfile = cmd->outfile != NULL;
+
+    int fds[4] = { in_fd, out_fd, err_fd, open(".", O_PATH | O_DIRECTORY | O_CLOEXEC) };
+    pid_t pid = -1;
+    if (fds[3] >= 0) {
+        char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+        struct iovec iov = { &req, sizeof(req) };
+        struct msghdr msg = { 0 };
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(c), fds, sizeof(fds));
+        sigset_t old;
+        sigpipe_block(&old);
+        int failed = sendmsg(zygote_fd, &msg, 0) != sizeof(req) ||
+                     write_all(zygote_fd, buf.data, buf.len) < 0 ||
+                     read_full(zygote_fd, &pid, sizeof(pid)) < 0;
+        sigpipe_unblock(&old, failed && errno == EPIPE);
+        if (failed) {
+            fprintf(stderr, "utsh: spawn server gone, forking instead\n");
+            close(zygote_fd);
+            zygote_fd = -1;
+            pid = -1;
+        } else if (pid < 0) {
+            errno = -pid;
+            perror("zygote clone");
+            pid = -1;
+        }
+        close(fds[3]);
+    }
+    free(buf.data);
+    return pid;
+}
+
+/* ------------------------ */
+/* Execute a pipeline       */
+/* ------------------------ */
+/* Fork every stage of the job, connected by pipes. */
+static void launch_job(job_t *j, int foreground) {
+    int i;
+    int in_fd = j->io[0];  // Initially, input comes from STDIN
+    int fd[2];
+    pid_t pid;
+    int num_cmds = j->num_procs;
+
+    prof_begin(PROF_SPAWN);
+    script_sync();
+    j->queued = 0;
+    clock_gettime(CLOCK_MONOTONIC, &j->start);
+    fflush(stdout);     /* Do not let children inherit pending output */
+    for (i = 0; i < num_cmds; i++) {
+        int out_fd = j->io[1];
+        const char *path = NULL;
+        if (j->cmds[i]->args[0] && !find_builtin(j->cmds[i]->args[0]))
+            path = path_lookup(j->cmds[i]->args[0]);
+        if (i < num_cmds - 1 && j->cmds[i]->meter) {
+            if (meter_start(j, i, &fd[1], &fd[0]) < 0) {
+                perror("pipe");
+                break;
+            }
+            out_fd = fd[1];
+        } else if (i < num_cmds - 1) {
+            if (pipe(fd) < 0) {
+                perror("pipe");
+                break;
+            }
+            out_fd = fd[1];
+            trace_event(TR_PIPE, getpid(), j->node, i, fd[0], fd[1], NULL);
+        }
+        /* A here-document replaces whatever the stage would read */
+        int stage_in = j->cmds[i]->here_fd >= 0 ? j->cmds[i]->here_fd : in_fd;
+        /* The stage's assignments are in the environment while it starts */
+        var_saved_t *saved = j->cmds[i]->assigns ? var_push(j->cmds[i]->assigns) : NULL;
+        shell_environ();
+        if (i == num_cmds - 1 && j->in_place) {
+            /* Nothing is left to wait for: become the last stage */
+            launch_process(j->cmds[i], path, j->pgid, stage_in, out_fd, j->io[2], foreground);
+        }
+        int sync[2] = { -1, -1 };   /* Holds the stage back while pstat attaches */
+        if (j->perf_fds && pipe2(sync, O_CLOEXEC) < 0)
+            sync[0] = sync[1] = -1;
+        pid = -1;
+        if (zygote_fd >= 0 && path && !j->perf_fds && trace_fd < 0)
+            pid = zygote_spawn(j->cmds[i], path, j->pgid, stage_in, out_fd, j->io[2], foreground);
+        if (pid < 0)
+            pid = fork();
+        if (saved && pid != 0)
+            var_pop(saved);
+        if (pid < 0) {
+            perror("fork");
+            if (i < num_cmds - 1) {
+                close(fd[0]);
+                close(fd[1]);
+            }
+            if (sync[0] >= 0) {
+                close(sync[0]);
+                close(sync[1]);
+            }
+            break;
+        } else if (pid == 0) {
+            /* Child process */
+            if (sync[0] >= 0) {
+                char c;
+                close(sync[1]);
+                while (read(sync[0], &c, 1) < 0 && errno == EINTR)
+                    ;
+                close(sync[0]);
+            }
+            trace_forget();
+            trace_node = j->node;
+            trace_stage = i;
+            if (i < num_cmds - 1)
+                close(fd[0]);
+            if (stage_in != in_fd && in_fd != j->io[0])
+                close(in_fd);
+            launch_process(j->cmds[i], path, j->pgid, stage_in, out_fd, j->io[2], foreground);
+        }
+        /* Parent process */
+        j->procs[i].pid = pid;
+        if (sync[0] >= 0) {
+            close(sync[0]);
+            pstat_attach(j, i, pid, sync[1], path != NULL);
+        }
+        trace_event(TR_SPAWN, pid, j->node, i, 0, 0, j->cmds[i]->args[0]);
+        if (shell_interactive) {
+            if (j->pgid == 0)
+                j->pgid = pid;
+            setpgid(pid, j->pgid);
+        }
+        if (in_fd != j->io[0])
+            close(in_fd);
+        if (i < num_cmds - 1) {
+            close(fd[1]);
+            in_fd = fd[0];
+        }
+    }
+    if (in_fd != j->io[0])
+        close(in_fd);
+    if (!shell_interactive)
+        j->pgid = j->procs[0].pid;
+
+    /* Stages that never started count as failed. */
+    for (; i < num_cmds; i++) {
+        j->procs[i].completed = 1;
+        j->procs[i].status = 127 << 8;
+    }
+    if (j->meters && foreground && isatty(STDERR_FILENO))
+        j->meter_timer = reactor_add_timer(500, 500, on_meter_tick, j);
+    prof_end();
+}
+
+/* Number of background jobs currently occupying a job slot. */
+static int running_background_jobs(void) {
+    int n = 0;
+    for (job_t *j = job_list; j; j = j->next)
+        if (j->background && !j->queued && !job_is_stopped(j))
+            n++;
+    return n;
+}
+
+/* Start queued background jobs, oldest first, while slots are free. */
+static void admit_queued_jobs(void) {
+    int running = running_background_jobs();
+    for (job_t *j = job_list; j; j = j->next) {
+        if (opt_jobslots > 0 && running >= opt_jobslots)
+            break;
+        if (j->queued) {
+            launch_job(j, 0);
+            running++;
+        }
+    }
+}
+
+/* A foreground pipeline that is the shell's last action (exec_tail) can
+   exec its last stage in place of the shell instead of forking it and
+   waiting: the exit status is the same, and one process less is created.
+   Not when anything would still need the shell afterwards: other jobs,
+   a "|>" relay, pipefail, or "time", "pstat", profiling and tracing. */
+static int exec_in_place(command_t **cmds, int num_cmds) {
+    if (!exec_tail || job_list || (num_cmds > 1 && opt_pipefail))
+        return 0;
+    if (timing || pstat_acc || profiling || trace_fd >= 0)
+        return 0;
+    for (int i = 0; i < num_cmds; i++)
+        if (cmds[i]->meter)
+            return 0;
+    return 1;
+}
+
+/* Takes ownership of cmds (the array and every command in it). The whole
+   pipeline becomes one job; it runs in the background if its last
+   command ended with '&'. */
+int execute_pipeline(command_t **cmds, int num_cmds, const char *cmdline) {
+    int foreground = !cmds[num_cmds - 1]->background;
+
+    /* Pick up exits of earlier jobs before adding a new one. */
+    reap_children();
+    int in_place = foreground && exec_in_place(cmds, num_cmds);
+    job_t *j = create_job(cmds, num_cmds, cmdline);
+
+    if (foreground) {
+        j->in_place = in_place;
+        launch_job(j, 1);
+        return put_job_in_foreground(j, 0);
+    }
+
+    int full = opt_jobslots > 0 && running_background_jobs() >= opt_jobslots;
+    j->background = 1;
+    if (full) {
+        j->queued = 1;
+        if (shell_interactive)
+            printf("[%d] queued\n", j->id);
+        return 0;
+    }
+    launch_job(j, 0);
+    last_bg_pid = j->procs[num_cmds - 1].pid;
+    if (shell_interactive) {
+        printf("[%d] %d\n", j->id, last_bg_pid);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+/* ------------------------ */
+/* Execute a parse tree     */
+/* ------------------------ */
+/* Fork a non-interactive copy of the shell that runs body(arg) and exits
+   with its status. The copy is tracked as a one-process job so that it
+   can be waited for (or put in the background) like any other. */
+static job_t *fork_subshell_job(const char *cmdline, int (*body)(void *), void *arg) {
+    command_t **cmds = malloc(sizeof(command_t *));
+    if (!cmds) {
+        perror("malloc fork_subshell_job");
+        exit(EXIT_FAILURE);
+    }
+    cmds[0] = NULL;
+    job_t *j = create_job(cmds, 1, cmdline);
+    clock_gettime(CLOCK_MONOTONIC, &j->start);
+    script_sync();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        trace_forget();
+        if (shell_interactive)
+            setpgid(0, 0);
+        become_subshell();
+        exec_tail = 1;
+        int status = body(arg);
+        notify_jobs();
+        fflush(stdout);
+        exit(status);
+    }
+    if (pid < 0) {
+        perror("fork");
+        j->procs[0].completed = 1;
+        j->procs[0].status = 1 << 8;
+        return j;
+    }
+    j->procs[0].pid = pid;
+    j->pgid = pid;
+    if (shell_interactive)
+        setpgid(pid, pid);
+    trace_event(TR_SPAWN, pid, j->node, 0, 0, 0, "subshell");
+    return j;
+}
+
+static int run_subshell_body(void *arg) {
+    return execute_node(arg);
+}
+
+/* Expand every stage of a pipeline node and run it. Built-ins without
+   redirections run in the shell itself when in the foreground, since
+   "cd" or "fg" would be useless in a child. */
+static int execute_pipeline_node(ast_t *n, int background, const char *cmdline) {
+    trace_node = n->id;
+    command_t **cmds = malloc(n->num_stages * sizeof(command_t *));
+    if (!cmds) {
+        perror("malloc execute_pipeline_node");
+        exit(EXIT_FAILURE);
+    }
+    expand_failed = 0;
+    subst_status = -1;
+    for (int i = 0; i < n->num_stages; i++) {
+        cmds[i] = expand_command(n->stages[i]);
+        cmds[i]->background = background;
+    }
+    command_t *cmd = cmds[0];
+
+    if (expand_failed) {
+        for (int i = 0; i < n->num_stages; i++)
+            free_command(cmds[i]);
+        free(cmds);
+        return 1;
+    }
+    /* Bare assignments set shell variables */
+    if (n->num_stages == 1 && cmd->args[0] == NULL && !cmd->body && !background && cmd->assigns)
+        var_assign_words(cmd->assigns);
+    if (n->num_stages == 1 && cmd->args[0] == NULL && !cmd->body && !cmd->infile && !cmd->outfile) {
+        free_command(cmd);
+        free(cmds);
+        return subst_status >= 0 ? subst_status : 0;
+    }
+    if (n->num_stages == 1 && !background && cmd->args[0] != NULL
+            && cmd->infile == NULL && cmd->outfile == NULL && find_builtin(cmd->args[0])) {
+        var_saved_t *saved = cmd->assigns ? var_push(cmd->assigns) : NULL;
+        int status = run_builtin(cmd->args);
+        if (saved)
+            var_pop(saved);
+        record_pipeline(NULL, cmd->args[0], status);
+        free_command(cmd);
+        free(cmds);
+        return status;
+    }
+    return execute_pipeline(cmds, n->num_stages, cmdline);
+}
+
+static void print_seconds(const char *label, double secs) {
+    int minutes = (int)(secs / 60);
+    fprintf(stderr, "%s\t%dm%.3fs\n", label, minutes, secs - minutes * 60);
+}
+
+/* time [-p|-j] list: run the list, then report on stderr its wall time
+   and what its processes used (plus the shell's own CPU time, for
+   built-ins). -p prints the POSIX format, -j one line of JSON. */
+static int execute_timed(ast_t *n) {
+    time_acc_t acc = { 0 };
+    time_acc_t *outer = timing;
+    struct rusage self0, self1;
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &acc.start);
+    getrusage(RUSAGE_SELF, &self0);
+    timing = &acc;
+    int status = n->left ? execute_node(n->left) : 0;
+    timing = outer;
+    getrusage(RUSAGE_SELF, &self1);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double real = (end.tv_sec - acc.start.tv_sec) + (end.tv_nsec - acc.start.tv_nsec) / 1e9;
+    double user = acc.user + (self1.ru_utime.tv_sec - self0.ru_utime.tv_sec)
+                  + (self1.ru_utime.tv_usec - self0.ru_utime.tv_usec) / 1e6;
+    double sys = acc.sys + (self1.ru_stime.tv_sec - self0.ru_stime.tv_sec)
+                 + (self1.ru_stime.tv_usec - self0.ru_stime.tv_usec) / 1e6;
+
+    if (n->format == TIME_JSON) {
+        fprintf(stderr, "{\"real\":%.6f,\"user\":%.6f,\"sys\":%.6f,\"maxrss_kb\":%ld,"
+                "\"minflt\":%ld,\"majflt\":%ld,\"nvcsw\":%ld,\"nivcsw\":%ld,"
+                "\"rchar\":%llu,\"wchar\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu,"
+                "\"procs\":%d,\"status\":%d}\n",
+                real, user, sys, acc.maxrss, acc.minflt, acc.majflt, acc.nvcsw, acc.nivcsw,
+                acc.io[0], acc.io[1], acc.io[2], acc.io[3], acc.procs, status);
+    } else if (n->format == TIME_POSIX) {
+        fprintf(stderr, "real %.2f\nuser %.2f\nsys %.2f\n", real, user, sys);
+    } else {
+        fprintf(stderr, "\n");
+        print_seconds("real", real);
+        print_seconds("user", user);
+        print_seconds("sys", sys);
+        fprintf(stderr, "maxrss\t%ldK over %d process%s\n", acc.maxrss, acc.procs,
+                acc.procs == 1 ? "" : "es");
+        fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", acc.nvcsw, acc.nivcsw);
+        fprintf(stderr, "faults\t%ld minor, %ld major\n", acc.minflt, acc.majflt);
+        fprintf(stderr, "io\t%llu bytes read (%llu from storage), %llu written (%llu to storage)\n",
+                acc.io[0], acc.io[2], acc.io[1], acc.io[3]);
+    }
+    return last_status = status;
+}
+
+/* pstat list: run the list with performance counters on every stage,
+   then print them per stage on stderr. */
+static int execute_pstat(ast_t *n) {
+    pstat_acc_t acc = { NULL, 0 };
+    pstat_acc_t *outer = pstat_acc;
+    pstat_acc = &acc;
+    int status = n->left ? execute_node(n->left) : 0;
+    pstat_acc = outer;
+
+    qsort(acc.rows, acc.count, sizeof(pstat_row_t), pstat_row_cmp);
+    fprintf(stderr, "\n Performance counters for '%s':\n\n", n->left ? ast_text(n->left) : "");
+    fprintf(stderr, "%-5s %-14s %14s", "STAGE", "COMMAND", "task-clock");
+    for (int k = 1; k < PSTAT_EVENTS; k++)
+        fprintf(stderr, " %13s", pstat_events[k].name);
+    fprintf(stderr, " %6s\n", "IPC");
+    for (int i = 0; i < acc.count; i++) {
+        pstat_row_t *r = &acc.rows[i];
+        fprintf(stderr, "%-5d %-14.14s ", r->stage, r->name);
+        if (r->valid & 1)
+            fprintf(stderr, "%11.3f ms", r->value[0] / 1e6);
+        else
+            fprintf(stderr, "%14s", "-");
+        for (int k = 1; k < PSTAT_EVENTS; k++) {
+            if (r->valid & (1 << k))
+                fprintf(stderr, " %13.0f", r->value[k]);
+            else
+                fprintf(stderr, " %13s", "-");
+        }
+        if ((r->valid & (3 << 4)) == (3 << 4) && r->value[4] > 0)
+            fprintf(stderr, " %6.2f\n", r->value[5] / r->value[4]);
+        else
+            fprintf(stderr, " %6s\n", "-");
+        free(r->name);
+    }
+    free(acc.rows);
+    return last_status = status;
+}
+
+/* ------------------------ */
+/* Compile to bytecode      */
+/* ------------------------ */
+/* A parse tree is compiled, the first time it runs, into a flat program
+   for the interpreter below: && / || and the compound commands become
+   conditional jumps on the last status, and loops become backward jumps
+   around their body. Pipelines stay parse-tree nodes run by
+   execute_pipeline_node(), except that a lone built-in whose words need
+   no expansion (":" or "cd /tmp") is expanded here once, so that running
+   it in a loop costs no allocation at all. "time", "pstat", "&" and
+   "( )" keep their own code, which runs their list as a separate
+   program.
+
+   Loops, and case (for its subject), push a frame at run time; "break n"
+   and "continue n" with a literal n are jumps that first drop the frames
+   of the inner constructs they leave. */
+typedef enum {
+    OP_RUN,       /* Run the pipeline node ptr */
+    OP_BUILTIN,   /* Run the expanded built-in ptr (a plan_t) */
+    OP_ASSIGN,    /* Make the assignments ptr (an assign_plan_t) */
+    OP_NODE,      /* Run the time, pstat, background or subshell node ptr */
+    OP_JUMP,      /* Go to arg */
+    OP_JZ,        /* Go to arg if the status is 0 */
+    OP_JNZ,       /* Go to arg if the status is not 0 */
+    OP_TRUE,      /* Set the status to 0 */
+    OP_LOOP,      /* Push a loop frame */
+    OP_FOR,       /* Push a loop frame with the expanded words of node ptr */
+    OP_NEXT,      /* Set the variable ptr to the next word, or go to arg */
+    OP_SAVE,      /* Keep the status of the loop body in the frame */
+    OP_LEAVE,     /* Pop a loop frame; its saved status is the loop's */
+    OP_CASE,      /* Push a frame with the expanded subject of node ptr */
+    OP_MATCH,     /* Go to arg unless the clause ptr matches the subject */
+    OP_ESAC,      /* Pop the case frame */
+    OP_BREAK,     /* Pop `pop` frames, set the status to 0 and go to arg */
+    OP_END
+} opcode_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t tail;         /* RUN: nothing follows, may exec in place */
+    uint16_t pop;         /* BREAK: frames to drop */
+    int arg;              /* Jump target */
+    void *ptr;
+} insn_t;
+
+/* A built-in and its arguments, expanded at compile time */
+typedef struct {
+    const builtin_t *builtin;
+    unsigned node;        /* The pipeline's node id, for tracing */
+    int argc;
+    char *argv[];
+} plan_t;
+
+/* A command made only of assignments, "i=$((i+1))" */
+typedef struct {
+    var_t *var;
+    word_t value;         /* Expanded when it runs, */
+    arith_t *arith;       /* unless it is just $((...)) */
+} assign_t;
+
+typedef struct {
+    int count;
+    assign_t assigns[];
+} assign_plan_t;
+
+typedef struct prog {
+    insn_t *code;
+    int len, cap;
+    int max_frames;       /* Deepest nesting of frames */
+} prog_t;
+
+typedef struct loop_ctx {
+    struct loop_ctx *outer;
+    int cont;             /* Where "continue" goes */
+    int frame;            /* Index of the loop's frame */
+    int *breaks;          /* BREAK instructions waiting for the exit */
+    int num_breaks;
+} loop_ctx_t;
+
+typedef struct {
+    prog_t *prog;
+    loop_ctx_t *loop;     /* Innermost loop being compiled */
+    int frames;           /* Frames pushed at this point */
+} compiler_t;
+
+static int emit(compiler_t *c, opcode_t op, int arg, void *ptr) {
+    prog_t *prog = c->prog;
+    if (prog->len == prog->cap) {
+        prog->cap = prog->cap ? prog->cap * 2 : 16;
+        prog->code = realloc(prog->code, prog->cap * sizeof(insn_t));
+        if (!prog->code) {
+            perror("realloc emit");
+            exit(EXIT_FAILURE);
+        }
+    }
+    insn_t *insn = &prog->code[prog->len];
+    memset(insn, 0, sizeof(*insn));
+    insn->op = op;
+    insn->arg = arg;
+    insn->ptr = ptr;
+    return prog->len++;
+}
+
+/* Point the jump at index `at` to the next instruction. */
+static void patch(compiler_t *c, int at) {
+    c->prog->code[at].arg = c->prog->len;
+}
+
+static void push_frame(compiler_t *c) {
+    if (++c->frames > c->prog->max_frames)
+        c->prog->max_frames = c->frames;
+}
+
+/* Whether a word expands to itself: no quotes, substitutions or wildcards. */
+static int word_is_literal(word_t w) {
+    for (int i = 0; i < w.len; i++)
+        if (strchr("'\"\\$*?[`", w.s[i]))
+            return 0;
+    return 1;
+}
+
+/* The plan for a one-stage pipeline that is a built-in with literal
+   words and no redirections, or NULL. */
+static plan_t *plan_builtin(ast_t *n) {
+    ast_t *cmd = n->stages[0];
+    if (n->num_stages != 1 || cmd->type != AST_COMMAND || cmd->num_words == 0 || cmd->infile.s || cmd->outfile.s || cmd->meter)
+        return NULL;
+    for (int i = 0; i < cmd->num_words; i++)
+        if (!word_is_literal(cmd->words[i]))
+            return NULL;
+    char name[32];
+    if (cmd->words[0].len >= (int)sizeof(name))
+        return NULL;
+    memcpy(name, cmd->words[0].s, cmd->words[0].len);
+    name[cmd->words[0].len] = '\0';
+    const builtin_t *b = find_builtin(name);
+    if (!b)
+        return NULL;
+    plan_t *plan = malloc(sizeof(plan_t) + (cmd->num_words + 1) * sizeof(char *));
+    if (!plan) {
+        perror("malloc plan_builtin");
+        exit(EXIT_FAILURE);
+    }
+    plan->builtin = b;
+    plan->node = n->id;
+    plan->argc = cmd->num_words;
+    for (int i = 0; i < cmd->num_words; i++) {
+        plan->argv[i] = strndup(cmd->words[i].s, cmd->words[i].len);
+        if (!plan->argv[i]) {
+            perror("strndup");
+            exit(EXIT_FAILURE);
+        }
+    }
+    plan->argv[cmd->num_words] = NULL;
+    return plan;
+}
+
+/* "break [n]" or "continue [n]" inside a loop, with a literal n: emit
+   the jump and return 1. */
+static int compile_break(compiler_t *c, plan_t *plan) {
+    int is_break = strcmp(plan->argv[0], "break") == 0;
+    if (!c->loop || (!is_break && strcmp(plan->argv[0], "continue") != 0) || plan->argc > 2)
+        return 0;
+    long levels = 1;
+    if (plan->argc == 2) {
+        char *end;
+        levels = strtol(plan->argv[1], &end, 10);
+        if (*end || levels < 1)
+            return 0;
+    }
+    loop_ctx_t *loop = c->loop;
+    while (--levels > 0 && loop->outer)
+        loop = loop->outer;
+    int at = emit(c, OP_BREAK, loop->cont, NULL);
+    c->prog->code[at].pop = c->frames - 1 - loop->frame;
+    if (is_break) {
+        loop->breaks = realloc(loop->breaks, (loop->num_breaks + 1) * sizeof(int));
+        if (!loop->breaks) {
+            perror("realloc compile_break");
+            exit(EXIT_FAILURE);
+        }
+        loop->breaks[loop->num_breaks++] = at;
+    }
+    return 1;
+}
+
+/* The plan for a one-stage pipeline of assignments only, or NULL. */
+static assign_plan_t *plan_assign(ast_t *n) {
+    ast_t *cmd = n->stages[0];
+    if (n->num_stages != 1 || cmd->type != AST_COMMAND || cmd->num_words <= 0 || cmd->infile.s || cmd->outfile.s || cmd->meter)
+        return NULL;
+    for (int i = 0; i < cmd->num_words; i++)
+        if (!word_is_assignment(cmd->words[i]))
+            return NULL;
+    assign_plan_t *plan = malloc(sizeof(assign_plan_t) + cmd->num_words * sizeof(assign_t));
+    if (!plan) {
+        perror("malloc plan_assign");
+        exit(EXIT_FAILURE);
+    }
+    plan->count = cmd->num_words;
+    for (int i = 0; i < cmd->num_words; i++) {
+        word_t w = cmd->words[i];
+        int eq = (const char *)memchr(w.s, '=', w.len) - w.s;
+        assign_t *as = &plan->assigns[i];
+        as->var = var_intern(w.s, eq);
+        as->value = (word_t){ w.s + eq + 1, w.len - eq - 1 };
+        as->arith = NULL;
+        if (as->value.len > 3 && memcmp(as->value.s, "$((", 3) == 0 &&
+                subst_end(as->value.s, 0, as->value.len) == as->value.len &&
+                is_arith(as->value.s, as->value.len))
+            as->arith = arith_lookup(as->value.s + 2, as->value.len - 3);
+    }
+    return plan;
+}
+
+static int run_assign(assign_plan_t *plan) {
+    expand_failed = 0;
+    subst_status = -1;
+    for (int i = 0; i < plan->count; i++) {
+        assign_t *as = &plan->assigns[i];
+        if (as->arith) {
+            int64_t value;
+            if (arith_eval(as->arith, &value) < 0)
+                return 1;
+            arith_store(as->var, value);
+        } else {
+            char *pattern;
+            char *value = expand_word(as->value, &pattern);
+            free(pattern);
+            if (!expand_failed)
+                var_assign(as->var, value, strlen(value));
+            free(value);
+            if (expand_failed)
+                return 1;
+        }
+    }
+    return subst_status >= 0 ? subst_status : 0;
+}
+
+static void free_plan(plan_t *plan) {
+    for (int i = 0; i < plan->argc; i++)
+        free(plan->argv[i]);
+    free(plan);
+}
+
+static void compile_node(compiler_t *c, ast_t *n);
+
+/* The body of a loop whose frame has been pushed and whose continue
+   point is `cont`, then the jump back and the exit. */
+static void compile_loop_body(compiler_t *c, ast_t *body, int cont, int exit_jump) {
+    loop_ctx_t loop = { c->loop, cont, c->frames - 1, NULL, 0 };
+    c->loop = &loop;
+    compile_node(c, body);
+    c->loop = loop.outer;
+    emit(c, OP_SAVE, 0, NULL);
+    emit(c, OP_JUMP, cont, NULL);
+    patch(c, exit_jump);
+    for (int i = 0; i < loop.num_breaks; i++)
+        patch(c, loop.breaks[i]);
+    free(loop.breaks);
+    emit(c, OP_LEAVE, 0, NULL);
+    c->frames--;
+}
+
+static void compile_node(compiler_t *c, ast_t *n) {
+    int jump, end;
+    switch (n->type) {
+    case AST_PIPELINE: {
+        plan_t *plan = plan_builtin(n);
+        assign_plan_t *assign = plan ? NULL : plan_assign(n);
+        if (plan && compile_break(c, plan))
+            free_plan(plan);
+        else if (plan)
+            emit(c, OP_BUILTIN, 0, plan);
+        else if (assign)
+            emit(c, OP_ASSIGN, 0, assign);
+        else
+            emit(c, OP_RUN, 0, n);
+        break;
+    }
+    case AST_AND:
+    case AST_OR:
+        compile_node(c, n->left);
+        jump = emit(c, n->type == AST_AND ? OP_JNZ : OP_JZ, 0, NULL);
+        compile_node(c, n->right);
+        patch(c, jump);
+        break;
+    case AST_SEQ:
+        compile_node(c, n->left);
+        compile_node(c, n->right);
+        break;
+    case AST_IF:
+        compile_node(c, n->left);
+        jump = emit(c, OP_JNZ, 0, NULL);
+        compile_node(c, n->right);
+        end = emit(c, OP_JUMP, 0, NULL);
+        patch(c, jump);
+        if (n->next)
+            compile_node(c, n->next);
+        else
+            emit(c, OP_TRUE, 0, NULL);      /* No branch taken */
+        patch(c, end);
+        break;
+    case AST_WHILE:
+    case AST_UNTIL: {
+        emit(c, OP_LOOP, 0, NULL);
+        push_frame(c);
+        int cont = c->prog->len;
+        compile_node(c, n->left);
+        jump = emit(c, n->type == AST_WHILE ? OP_JNZ : OP_JZ, 0, NULL);
+        compile_loop_body(c, n->right, cont, jump);
+        break;
+    }
+    case AST_FOR: {
+        emit(c, OP_FOR, 0, n);
+        push_frame(c);
+        var_t *var = var_intern(n->words[0].s, n->words[0].len);
+        int cont = emit(c, OP_NEXT, 0, var);
+        compile_loop_body(c, n->right, cont, cont);
+        break;
+    }
+    case AST_CASE: {
+        emit(c, OP_CASE, 0, n);
+        push_frame(c);
+        int *ends = malloc((n->num_stages + 1) * sizeof(int));
+        if (!ends) {
+            perror("malloc compile_node");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n->num_stages; i++) {
+            int match = emit(c, OP_MATCH, 0, n->stages[i]);
+            if (n->stages[i]->right)
+                compile_node(c, n->stages[i]->right);
+            else
+                emit(c, OP_TRUE, 0, NULL);
+            ends[i] = emit(c, OP_JUMP, 0, NULL);
+            patch(c, match);
+        }
+        emit(c, OP_TRUE, 0, NULL);          /* No clause matched */
+        for (int i = 0; i < n->num_stages; i++)
+            patch(c, ends[i]);
+        free(ends);
+        emit(c, OP_ESAC, 0, NULL);
+        c->frames--;
+        break;
+    }
+    default:
+        emit(c, OP_NODE, 0, n);
+        break;
+    }
+}
+
+static prog_t *compile_tree(ast_t *n) {
+    prog_t *prog = calloc(1, sizeof(prog_t));
+    if (!prog) {
+        perror("calloc compile_tree");
+        exit(EXIT_FAILURE);
+    }
+    compiler_t c = { prog, NULL, 0 };
+    compile_node(&c, n);
+    emit(&c, OP_END, 0, NULL);
+    /* A pipeline can replace the shell only if nothing runs after it */
+    for (int i = 0; i < prog->len; i++) {
+        if (prog->code[i].op != OP_RUN)
+            continue;
+        int next = i + 1;
+        while (prog->code[next].op == OP_JUMP)
+            next = prog->code[next].arg;
+        prog->code[i].tail = prog->code[next].op == OP_END;
+    }
+    return prog;
+}
+
+void free_prog(prog_t *prog) {
+    if (!prog)
+        return;
+    for (int i = 0; i < prog->len; i++)
+        if (prog->code[i].op == OP_BUILTIN)
+            free_plan(prog->code[i].ptr);
+        else if (prog->code[i].op == OP_ASSIGN)
+            free(prog->code[i].ptr);
+    free(prog->code);
+    free(prog);
+}
+
+/* ------------------------ */
+/* Bytecode interpreter     */
+/* ------------------------ */
+/* A threaded interpreter: every instruction ends by jumping straight to
+   the code for the next one through a table of label addresses (GCC's
+   computed goto), rather than going back around a switch, so each
+   dispatch is one indirect branch that the CPU predicts per opcode. */
+typedef struct {
+    int status;           /* Loop: status of the last body run */
+    char **words;         /* FOR: the expanded words; CASE: the subject */
+    int index;            /* FOR: next word */
+} frame_t;
+
+static void drop_frame(frame_t *f) {
+    if (!f->words)
+        return;
+    for (int i = 0; f->words[i]; i++)
+        free(f->words[i]);
+    free(f->words);
+}
+
+/* Whether the clause has a pattern matching the subject. */
+static int clause_matches(ast_t *clause, const char *subject) {
+    for (int i = 0; i < clause->num_words; i++) {
+        char *pattern;
+        char *text = expand_word(clause->words[i], &pattern);
+        int match = pattern ? fnmatch(pattern, subject, 0) == 0 : strcmp(text, subject) == 0;
+        free(text);
+        free(pattern);
+        if (match)
+            return 1;
+    }
+    return 0;
+}
+
+/* A loop that only runs built-ins never waits in the event loop, so it
+   looks for signals (SIGINT to stop it) and finished children itself,
+   every VM_POLL iterations. */
+#define VM_POLL 1024
+
+static int vm_poll(void) {
+    reactor_run_once(0);
+    if (interrupted && shell_interactive)
+        printf("\n");       /* After the ^C the terminal echoed */
+    return interrupted;
+}
+
+/* Whether the list n can run as a virtual subshell: every command that
+   would run in the shell itself is a built-in whose effects are
+   journaled, or an external command (which does not change the shell).
+   A command name that is known only once expanded could be "exit", and
+   a background job would outlive the subshell, so they need a fork. To
+   capture the output of $(...), every command must also be such a
+   built-in writing to stdout: no external commands, pipelines or
+   redirections. */
+static int subshell_in_shell(ast_t *n, int capture) {
+    if (!n)
+        return 1;
+    switch (n->type) {
+    case AST_BACKGROUND:
+        return 0;
+    case AST_SUBSHELL:
+        if (!capture)
+            return 1;       /* It decides for itself */
+        break;
+    case AST_PIPELINE:
+        /* Stages with redirections or pipes run in children */
+        if (n->num_stages > 1 || n->stages[0]->type != AST_COMMAND ||
+                n->stages[0]->infile.s || n->stages[0]->outfile.s)
+            return !capture;
+        break;
+    case AST_COMMAND: {
+        int a = 0;
+        while (a < n->num_words && word_is_assignment(n->words[a]))
+            a++;
+        if (a == n->num_words)
+            return 1;
+        word_t w = n->words[a];
+        char name[32];
+        if (!word_is_literal(w) || w.len >= (int)sizeof(name))
+            return 0;
+        memcpy(name, w.s, w.len);
+        name[w.len] = '\0';
+        const builtin_t *b = find_builtin(name);
+        return b ? b->subshell : !capture;
+    }
+    default:
+        break;
+    }
+    for (int i = 0; i < n->num_stages; i++)
+        if (!subshell_in_shell(n->stages[i], capture))
+            return 0;
+    return subshell_in_shell(n->left, capture) && subshell_in_shell(n->right, capture) &&
+           subshell_in_shell(n->next, capture);
+}
+
+/* ( list ): run the list in the shell with its changes journaled and
+   undone afterwards if it can be, or else in a forked copy. */
+static int execute_subshell(ast_t *n) {
+    if (!n->in_shell)
+        n->in_shell = subshell_in_shell(n->left, 0) ? 1 : -1;
+    int status;
+    if (n->in_shell > 0) {
+        journal_t jr;
+        journal_begin(&jr);
+        status = execute_node(n->left);
+        journal_end(&jr);
+    } else {
+        reap_children();
+        trace_node = n->id;
+        job_t *j = fork_subshell_job(ast_text(n), run_subshell_body, n->left);
+        status = put_job_in_foreground(j, 0);
+    }
+    return last_status = status;
+}
+
+static int execute_background(ast_t *n) {
+    if (n->left->type == AST_PIPELINE) {
+        execute_pipeline_node(n->left, 1, ast_text(n));
+    } else {
+        /* Anything else goes to the background as a subshell */
+        ast_t *body = n->left->type == AST_SUBSHELL ? n->left->left : n->left;
+        reap_children();
+        trace_node = n->id;
+        job_t *j = fork_subshell_job(ast_text(n), run_subshell_body, body);
+        j->background = 1;
+        if (shell_interactive)
+            printf("[%d] %d\n", j->id, j->procs[0].pid);
+        last_bg_pid = j->procs[0].pid;
+    }
+    return last_status = 0;
+}
+
+static int run_plan(plan_t *plan) {
+    char *argv[plan->argc + 1];     /* Built-ins may permute their argv */
+    memcpy(argv, plan->argv, sizeof(argv));
+    trace_event(TR_BUILTIN_BEGIN, trace_fd >= 0 ? getpid() : 0, trace_node, trace_stage, 0, 0, argv[0]);
+    int status = plan->builtin->func(argv);
+    trace_event(TR_BUILTIN_END, trace_fd >= 0 ? getpid() : 0, trace_node, trace_stage, status, 0, argv[0]);
+    record_pipeline(NULL, plan->argv[0], status);
+    return status;
+}
+
+static int vm_run(prog_t *prog) {
+    static void *const dispatch[] = {
+        [OP_RUN] = &&op_run, [OP_BUILTIN] = &&op_builtin, [OP_ASSIGN] = &&op_assign,
+        [OP_NODE] = &&op_node,
+        [OP_JUMP] = &&op_jump, [OP_JZ] = &&op_jz, [OP_JNZ] = &&op_jnz,
+        [OP_TRUE] = &&op_true, [OP_LOOP] = &&op_loop, [OP_FOR] = &&op_for,
+        [OP_NEXT] = &&op_next, [OP_SAVE] = &&op_save, [OP_LEAVE] = &&op_leave,
+        [OP_CASE] = &&op_case, [OP_MATCH] = &&op_match, [OP_ESAC] = &&op_esac,
+        [OP_BREAK] = &&op_break, [OP_END] = &&op_end,
+    };
+#define DISPATCH() goto *dispatch[pc->op]
+#define NEXT() do { pc++; DISPATCH(); } while (0)
+#define JUMP(to) do { pc = code + (to); DISPATCH(); } while (0)
+    static unsigned polls = 0;
+    int tail = exec_tail;
+    exec_tail = 0;
+    int status = last_status;
+    frame_t local[8];
+    frame_t *frames = prog->max_frames <= 8 ? local : malloc(prog->max_frames * sizeof(frame_t));
+    if (!frames) {
+        perror("malloc vm_run");
+        exit(EXIT_FAILURE);
+    }
+    frame_t *top = frames - 1;
+    const insn_t *code = prog->code, *pc = code;
+    DISPATCH();
+
+op_run: {
+        ast_t *n = pc->ptr;
+        exec_tail = tail && pc->tail;
+        status = last_status = execute_pipeline_node(n, 0, ast_text(n));
+        exec_tail = 0;
+        if (interrupted)
+            goto op_end;
+        NEXT();
+    }
+op_builtin:
+    trace_node = ((plan_t *)pc->ptr)->node;
+    status = last_status = run_plan(pc->ptr);
+    if (interrupted)
+        goto op_end;
+    NEXT();
+op_assign:
+    status = last_status = run_assign(pc->ptr);
+    NEXT();
+op_node: {
+        ast_t *n = pc->ptr;
+        status = n->type == AST_TIME ? execute_timed(n) :
+                 n->type == AST_PSTAT ? execute_pstat(n) :
+                 n->type == AST_SUBSHELL ? execute_subshell(n) : execute_background(n);
+        if (interrupted)
+            goto op_end;
+        NEXT();
+    }
+op_jump:
+    JUMP(pc->arg);
+op_jz:
+    if (status == 0)
+        JUMP(pc->arg);
+    NEXT();
+op_jnz:
+    if (status != 0)
+        JUMP(pc->arg);
+    NEXT();
+op_true:
+    status = last_status = 0;
+    NEXT();
+op_loop:
+    top++;
+    top->status = 0;
+    top->words = NULL;
+    NEXT();
+op_for: {
+        ast_t *n = pc->ptr;
+        top++;
+        top->status = 0;
+        top->words = expand_words(n->words + 1, n->num_words - 1, 0, 1);
+        top->index = 0;
+        NEXT();
+    }
+op_next:
+    if (!top->words[top->index])
+        JUMP(pc->arg);
+    var_assign(pc->ptr, top->words[top->index], strlen(top->words[top->index]));
+    top->index++;
+    NEXT();
+op_save:
+    top->status = status;
+    if (++polls % VM_POLL == 0 && vm_poll())
+        goto op_end;
+    NEXT();
+op_leave:
+    status = last_status = top->status;
+    drop_frame(top--);
+    NEXT();
+op_case: {
+        ast_t *n = pc->ptr;
+        char *unused;
+        top++;
+        top->words = calloc(2, sizeof(char *));
+        if (!top->words) {
+            perror("calloc vm_run");
+            exit(EXIT_FAILURE);
+        }
+        top->words[0] = expand_word(n->words[0], &unused);
+        free(unused);
+        NEXT();
+    }
+op_match:
+    if (!clause_matches(pc->ptr, top->words[0]))
+        JUMP(pc->arg);
+    NEXT();
+op_esac:
+    drop_frame(top--);
+    NEXT();
+op_break:
+    for (int i = 0; i < pc->pop; i++)
+        drop_frame(top--);
+    top->status = status = last_status = 0;
+    if (++polls % VM_POLL == 0 && vm_poll())
+        goto op_end;
+    JUMP(pc->arg);
+op_end:
+    while (top >= frames)
+        drop_frame(top--);
+    if (frames != local)
+        free(frames);
+    return status;
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+}
+
+/* Run a parse tree and return its exit status, compiling it first if
+   it has not run before. "a && b" runs b only if a succeeded and
+   "a || b" only if it failed; $? is updated after every pipeline so
+   that later words see it. */
+int execute_node(ast_t *n) {
+    if (!n->code)
+        n->code = compile_tree(n);
+    return vm_run(n->code);
+}
+
+/* ------------------------ */
+/* Command substitution     */
+/* ------------------------ */
+/* $(commands) and `commands` capture the standard output of commands
+   through a pipe, read by the event loop into a buffer that doubles as
+   it fills (no temporary files); the trailing newlines are then cut off
+   in place. Like arithmetic, the text is parsed once and its tree kept
+   in a cache keyed by the text. A pipeline is started by launch_job()
+   with the pipe as the job's stdout, anything else in a forked copy of
+   the shell, so both go through the usual job machinery (spawn server,
+   job control, tracing). Commands that are all built-ins ("echo $x",
+   "cd /tmp; echo *") run in the shell itself as a virtual subshell (see
+   "Subshell journal") with stdout writing straight into the buffer: no
+   pipe and no fork. */
+#define SUBST_CACHE_SIZE 256
+
+typedef struct subst {
+    struct subst *next;   /* In the cache bucket */
+    uint64_t hash;
+    size_t len;
+    char *text;
+    ast_t *tree;          /* NULL if there are no commands */
+    int in_shell;         /* Built-ins only: runs as a virtual subshell */
+} subst_t;
+
+typedef struct {
+    outbuf_t *out;
+    int fd;               /* Read end of the pipe, -1 at EOF */
+    int write_fd;
+    ast_t *tree;
+} subst_run_t;
+
+static subst_t *subst_cache[SUBST_CACHE_SIZE];
+
+/* The parsed form of text (cached), or NULL after a syntax error. */
+static subst_t *subst_parse(const char *text, size_t len) {
+    uint64_t h = var_hash(text, len);
+    subst_t **bucket = &subst_cache[h % SUBST_CACHE_SIZE];
+    for (subst_t *s = *bucket; s; s = s->next)
+        if (s->hash == h && s->len == len && memcmp(s->text, text, len) == 0)
+            return s;
+    subst_t *s = calloc(1, sizeof(subst_t));
+    if (!s || !(s->text = strndup(text, len))) {
+        perror("calloc subst");
+        exit(EXIT_FAILURE);
+    }
+    token_t *toks = lex_line(s->text, len);
+    parser_t p = { toks, 0, s->text, 0, 0 };
+    if (toks) {
+        s->tree = parse_line(&p);
+        free_tokens(toks);
+    }
+    if (!toks || p.error) {
+        free_ast(s->tree);
+        free(s->text);
+        free(s);
+        return NULL;
+    }
+    s->hash = h;
+    s->len = len;
+    s->in_shell = subshell_in_shell(s->tree, 1);
+    s->next = *bucket;
+    *bucket = s;
+    return s;
+}
+
+static void on_subst_output(int fd, uint32_t events, void *data) {
+    (void)events;
+    subst_run_t *r = data;
+    outbuf_reserve(r->out, 4096);
+    ssize_t n = read(fd, r->out->data + r->out->len, r->out->cap - r->out->len - 1);
+    if (n > 0) {
+        r->out->len += n;
+        return;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    reactor_del(fd);
+    close(fd);
+    r->fd = -1;
+}
+
+static ssize_t subst_write(void *cookie, const char *data, size_t len) {
+    outbuf_append(cookie, data, len);
+    return len;
+}
+
+static int subst_body(void *arg) {
+    subst_run_t *r = arg;
+    close(r->fd);
+    if (dup2(r->write_fd, STDOUT_FILENO) < 0) {
+        perror("dup2");
+        return 1;
+    }
+    close(r->write_fd);
+    return execute_node(r->tree);
+}
+
+/* Wait for the job j whose output comes from the pipe fd, collecting it;
+   then read on until every writer (background ones too) is gone. */
+static int subst_wait(job_t *j, int fd, outbuf_t *out) {
+    subst_run_t r = { out, fd, -1, NULL };
+    reactor_add(fd, EPOLLIN, on_subst_output, &r);
+    int status = put_job_in_foreground(j, 0);
+    while (r.fd >= 0 && !interrupted)
+        if (reactor_run_once(-1) < 0)
+            break;
+    if (r.fd >= 0) {
+        reactor_del(r.fd);
+        close(r.fd);
+    }
+    return status;
+}
+
+/* Run the commands in text and append their output, less its trailing
+   newlines, to out. The status is left in subst_status. */
+static void command_subst(const char *text, size_t len, outbuf_t *out) {
+    subst_t *s = subst_parse(text, len);
+    if (!s || !s->tree) {
+        expand_failed |= !s;
+        subst_status = s ? 0 : 2;
+        return;
+    }
+    ast_t *n = s->tree;
+    int failed = expand_failed;
+    int fds[2];
+    FILE *saved = stdout, *outer = subst_stdout, *capture = NULL;
+    expand_failed = 0;
+    reap_children();
+    if (s->in_shell && fflush(stdout) == 0 &&
+            (capture = fopencookie(out, "w", (cookie_io_functions_t){ .write = subst_write }))) {
+        unsigned node = trace_node;
+        journal_t jr;
+        subst_stdout = outer ? outer : saved;
+        stdout = capture;
+        journal_begin(&jr);
+        subst_status = execute_node(n);
+        journal_end(&jr);
+        fclose(capture);
+        stdout = saved;
+        subst_stdout = outer;
+        trace_node = node;
+        expand_failed = 0;      /* Failures inside were reported by the commands */
+    } else if (n->type == AST_PIPELINE) {
+        command_t **cmds = malloc(n->num_stages * sizeof(command_t *));
+        if (!cmds) {
+            perror("malloc command_subst");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n->num_stages; i++)
+            cmds[i] = expand_command(n->stages[i]);
+        if (expand_failed) {
+            subst_status = 1;
+        } else if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe");
+            subst_status = 1;
+        } else {
+            job_t *j = create_job(cmds, n->num_stages, s->text);
+            j->io[1] = fds[1];
+            launch_job(j, 1);
+            close(fds[1]);
+            subst_status = subst_wait(j, fds[0], out);
+            cmds = NULL;        /* The job owns them */
+        }
+        for (int i = 0; cmds && i < n->num_stages; i++)
+            free_command(cmds[i]);
+        free(cmds);
+    } else if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        subst_status = 1;
+    } else {
+        subst_run_t r = { out, fds[0], fds[1], n };
+        job_t *j = fork_subshell_job(s->text, subst_body, &r);
+        close(fds[1]);
+        subst_status = subst_wait(j, fds[0], out);
+    }
+    expand_failed |= failed || interrupted;
+    while (out->len > 0 && out->data[out->len - 1] == '\n')
+        out->len--;
+    if (out->data)
+        out->data[out->len] = '\0';
+}
+
+/* ------------------------ */
+/* Run one input line       */
+/* ------------------------ */
+/* How many compound commands the text opens and does not close, going
+   by the reserved words where a command can start. Readers use it to
+   gather the lines of a compound command before parsing them; the parser
+   has the last word. */
+#define UNIT_OPEN (1 << 30)     /* A quote or $( is still open */
+
+/* What unit_depth() carries from one line to the next: a "(" or ")"
+   in a case pattern opens or closes nothing. */
+typedef struct {
+    int case_in;          /* After "case": its "in" starts the patterns */
+    int pattern;          /* In a case pattern, up to its ")" */
+} unit_state_t;
+
+static int unit_depth(const char *text, long len, unit_state_t *st) {
+    int quiet = parse_quiet;
+    parse_quiet = 1;
+    token_t *toks = lex_line(text, len);
+    parse_quiet = quiet;
+    if (!toks)
+        return UNIT_OPEN;
+    int depth = 0, cmd = 1, after_time = 0;
+    for (token_t *t = toks; t->type != TOK_END; t++) {
+        if (t->type != TOK_WORD) {
+            if (t->type == TOK_RPAREN && st->pattern)
+                st->pattern = 0;
+            else if (t->type == TOK_LPAREN && cmd && !st->pattern)
+                depth++;
+            else if (t->type == TOK_RPAREN)
+                depth--;
+            else if (t->type == TOK_DSEMI)
+                st->pattern = 1;
+            cmd = t->type != TOK_LESS && t->type != TOK_GREAT && t->type != TOK_DGREAT &&
+                  t->type != TOK_DLESS && t->type != TOK_DLESSDASH && t->type != TOK_TLESS &&
+                  t->type != TOK_HEREDOC;
+            continue;
+        }
+        word_t w = { text + t->start, t->end - t->start };
+        if (st->case_in && word_is(w, "in")) {
+            st->case_in = 0;
+            st->pattern = 1;
+        }
+        if (st->pattern && word_is(w, "esac"))
+            st->pattern = 0;
+        if (!cmd || (after_time && w.s[0] == '-') || st->pattern)
+            continue;
+        if (word_is(w, "case"))
+            st->case_in = 1;
+        if (word_is(w, "if") || word_is(w, "while") || word_is(w, "until") ||
+            word_is(w, "for") || word_is(w, "case"))
+            depth++;
+        else if (word_is(w, "fi") || word_is(w, "done") || word_is(w, "esac"))
+            depth--;
+        after_time = word_is(w, "time") || word_is(w, "pstat");
+        cmd = after_time || word_is(w, "if") || word_is(w, "then") || word_is(w, "else") ||
+              word_is(w, "elif") || word_is(w, "do") || word_is(w, "while") || word_is(w, "until");
+    }
+    free_tokens(toks);
+    return depth;
+}
+
+/* Gets the next line for read_unit(): grows the text at *text (len
+   bytes) by a newline and that line, returning the new length, or -1
+   when there is no more input. *text may move. */
+typedef long (*more_lines_fn)(void *ctx, const char **text, long len);
+
+/* Extend the line at *text (len bytes) with the lines that follow it
+   while it is inside a compound command, and return the length of the
+   whole unit. */
+static long read_unit(const char **text, long len, more_lines_fn more, void *ctx) {
+    long from = 0;      /* Lines from here on are not counted yet */
+    int depth = 0;
+    unit_state_t st = { 0, 0 };
+    for (;;) {
+        int d = unit_depth(*text + from, len - from, &st);
+        if (d != UNIT_OPEN) {
+            depth += d;
+            from = len + 1;
+            if (depth <= 0)
+                break;
+        }
+        long grown = more(ctx, text, len);
+        if (grown < 0)
+            break;
+        len = grown;
+    }
+    return len;
+}
+
+/* more_lines_fn for text that is all in memory, up to ctx. */
+static long more_in_memory(void *ctx, const char **text, long len) {
+    const char *end = ctx, *next = *text + len;
+    if (next >= end)
+        return -1;
+    const char *nl = memchr(next + 1, '\n', end - next - 1);
+    return (nl ? nl : end) - *text;
+}
+
+/* Parse and execute a whole input line. Returns the exit status of the
+   last pipeline run, or 2 on a syntax error. */
+int run_line(char *line) {
+    return run_text(line, strlen(line));
+}
+
+/* Run len bytes of source, which need not be NUL-terminated (a line of
+   a mapped script); the parse tree points into it while it runs. */
+int run_text(const char *line, int len) {
+    prof_begin(PROF_LINE);
+    prof_begin(PROF_LEX);
+    token_t *toks = lex_line(line, len);
+    prof_end();
+    if (!toks) {
+        prof_end();
+        return last_status = 2;
+    }
+
+    prof_begin(PROF_PARSE);
+    parser_t p = { toks, 0, line, 0, 0 };
+    ast_t *tree = parse_line(&p);
+    free_tokens(toks);
+    prof_end();
+
+    int status = p.error ? (last_status = 2) : last_status;
+    if (tree) {
+        interrupted = 0;
+        status = execute_node(tree);
+        free_ast(tree);
+    }
+    prof_end();
+    return status;
+}
+
+/* ------------------------ */
+/* Compiled scripts         */
+/* ------------------------ */
+/* With UTSH_CACHE=dir, a script file is compiled once into
+   dir/<key>.utshc, where the key hashes the shell's build stamp and the
+   script's content; later runs of the same script by the same shell map
+   the image and run it without lexing or parsing anything.
+
+   The image is a header and then, for each line with something to run,
+   the line's parse tree in preorder (a compound command spanning several
+   lines counts as one line). Every field is a varint:
+
+     node : op [src] (by type:)
+            COMMAND   count word* [infile] [outfile]
+            PIPELINE  count node*
+            FOR       count word*
+            CASE      count word* count node*
+            CLAUSE    count word*
+            then [left] [right] [next], each a node
+     word : offset length
+
+   with the bracketed parts there when op has the matching flag. Offsets
+   are into the script, which is mapped anyway to hash it, and each is
+   stored as the (zigzag) distance from the previous one, so most take a
+   byte: the image holds no strings, is smaller than the script, and
+   words stay views into the file, as they are with run_text(). A line
+   that does not parse is stored as its text (op UTSHC_TEXT) and goes
+   through run_text() when it is reached, so the error is reported where
+   it would be otherwise. */
+#define UTSHC_MAGIC "utshc\0\0\4"
+#define UTSHC_TEXT 0xf          /* op & 0xf is an ast_type_t, or this */
+#define UTSHC_APPEND (1u << 4)
+#define UTSHC_METER (1u << 5)
+#define UTSHC_LEFT (1u << 6)
+#define UTSHC_RIGHT (1u << 7)
+#define UTSHC_SRC (1u << 8)
+#define UTSHC_IN (1u << 9)
+#define UTSHC_OUT (1u << 10)
+#define UTSHC_NEXT (1u << 11)
+#define UTSHC_FORMAT_SHIFT 12   /* Two bits of TIME format */
+#define UTSHC_HERE_SHIFT 14     /* Three bits of HERE_* */
+
+/* A shell built from different sources may parse differently */
+static const char utshc_build[] = "utsh " __DATE__ " " __TIME__;
+
+typedef struct {
+    char magic[8];          /* UTSHC_MAGIC */
+    uint64_t key;           /* hash_bytes() of utshc_build and the script */
+    uint64_t source_size;
+    uint64_t body_size;
+    uint64_t body_hash;     /* hash_bytes() of the body */
+} utshc_header_t;
+
+typedef struct {
+    outbuf_t *out;          /* Compiling */
+    const unsigned char *pc; /* Running */
+    const char *base;       /* The mapped script */
+    size_t last;            /* Previous offset */
+} utshc_t;
+
+static uint64_t hash_bytes(const void *data, size_t len, uint64_t h) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {     /* FNV-1a */
+        h ^= p[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+static void utshc_put(utshc_t *c, uint64_t v) {
+    for (; v >= 0x80; v >>= 7)
+        outbuf_putc(c->out, (char)(v | 0x80));
+    outbuf_putc(c->out, (char)v);
+}
+
+static uint64_t utshc_get(utshc_t *c) {
+    uint64_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        unsigned char b = *c->pc++;
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+}
+
+static void utshc_put_word(utshc_t *c, word_t w) {
+    size_t off = w.s - c->base;
+    int64_t delta = (int64_t)(off - c->last);
+    utshc_put(c, (uint64_t)delta << 1 ^ (uint64_t)(delta >> 63));
+    utshc_put(c, w.len);
+    c->last = off;
+}
+
+static word_t utshc_get_word(utshc_t *c) {
+    uint64_t z = utshc_get(c);
+    c->last += (size_t)(int64_t)(z >> 1 ^ -(z & 1));
+    word_t w = { c->base + c->last, (int)utshc_get(c) };
+    return w;
+}
+
+static void utshc_encode(utshc_t *c, ast_t *n) {
+    utshc_put(c, n->type | (n->append ? UTSHC_APPEND : 0) | (n->meter ? UTSHC_METER : 0) |
+                 (n->left ? UTSHC_LEFT : 0) | (n->right ? UTSHC_RIGHT : 0) |
+                 (n->src ? UTSHC_SRC : 0) | (n->infile.s ? UTSHC_IN : 0) |
+                 (n->outfile.s ? UTSHC_OUT : 0) | (n->next ? UTSHC_NEXT : 0) |
+                 (unsigned)n->format << UTSHC_FORMAT_SHIFT |
+                 (unsigned)n->here << UTSHC_HERE_SHIFT);
+    if (n->src) {
+        word_t src = { n->src, n->src_len };
+        utshc_put_word(c, src);
+    }
+    if (n->type == AST_COMMAND || n->type == AST_FOR || n->type == AST_CASE ||
+        n->type == AST_CLAUSE) {
+        utshc_put(c, n->num_words);
+        for (int i = 0; i < n->num_words; i++)
+            utshc_put_word(c, n->words[i]);
+    }
+    if (n->infile.s)
+        utshc_put_word(c, n->infile);
+    if (n->outfile.s)
+        utshc_put_word(c, n->outfile);
+    if (n->type == AST_PIPELINE || n->type == AST_CASE) {
+        utshc_put(c, n->num_stages);
+        for (int i = 0; i < n->num_stages; i++)
+            utshc_encode(c, n->stages[i]);
+    }
+    if (n->left)
+        utshc_encode(c, n->left);
+    if (n->right)
+        utshc_encode(c, n->right);
+    if (n->next)
+        utshc_encode(c, n->next);
+}
+
+/* Rebuild the node whose op has just been read. */
+static ast_t *utshc_decode(utshc_t *c, uint64_t op) {
+    ast_t *n = new_ast(op & 0xf);
+    n->append = (op & UTSHC_APPEND) != 0;
+    n->meter = (op & UTSHC_METER) != 0;
+    n->format = op >> UTSHC_FORMAT_SHIFT & 3;
+    n->here = op >> UTSHC_HERE_SHIFT & 7;
+    if (op & UTSHC_SRC) {
+        word_t src = utshc_get_word(c);
+        n->src = src.s;
+        n->src_len = src.len;
+    }
+    if (n->type == AST_COMMAND || n->type == AST_FOR || n->type == AST_CASE ||
+        n->type == AST_CLAUSE) {
+        n->num_words = utshc_get(c);
+        n->words = malloc((n->num_words + 1) * sizeof(word_t));
+        if (!n->words) {
+            perror("malloc utshc_decode");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n->num_words; i++)
+            n->words[i] = utshc_get_word(c);
+    }
+    if (op & UTSHC_IN)
+        n->infile = utshc_get_word(c);
+    if (op & UTSHC_OUT)
+        n->outfile = utshc_get_word(c);
+    if (n->type == AST_PIPELINE || n->type == AST_CASE) {
+        n->num_stages = utshc_get(c);
+        n->stages = malloc(n->num_stages * sizeof(ast_t *));
+        if (!n->stages) {
+            perror("malloc utshc_decode");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n->num_stages; i++)
+            n->stages[i] = utshc_decode(c, utshc_get(c));
+    }
+    if (op & UTSHC_LEFT)
+        n->left = utshc_decode(c, utshc_get(c));
+    if (op & UTSHC_RIGHT)
+        n->right = utshc_decode(c, utshc_get(c));
+    if (op & UTSHC_NEXT)
+        n->next = utshc_decode(c, utshc_get(c));
+    return n;
+}
+
+/* Parse every line of a mapped script into c->out. */
+static void utshc_compile(utshc_t *c, size_t size) {
+    parse_quiet = 1;
+    for (size_t pos = 0; pos < size; ) {
+        const char *line = c->base + pos;
+        const char *nl = memchr(line, '\n', size - pos);
+        long len = read_unit(&line, nl ? nl - line : (long)(size - pos), more_in_memory,
+                             (void *)(c->base + size));
+        pos += len + 1;
+
+        token_t *toks = lex_line(line, len);
+        parser_t p = { toks, 0, line, toks == NULL, 0 };
+        ast_t *tree = toks ? parse_line(&p) : NULL;
+        free_tokens(toks);
+        if (p.error) {
+            word_t text = { line, len };
+            utshc_put(c, UTSHC_TEXT);
+            utshc_put_word(c, text);
+        } else if (tree) {
+            utshc_encode(c, tree);
+        }
+        free_ast(tree);
+    }
+    parse_quiet = 0;
+}
+
+/* Map a valid image matching the header `want`, or return NULL. */
+static const utshc_header_t *utshc_load(const char *path, const utshc_header_t *want, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(utshc_header_t))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+    const utshc_header_t *h = map;
+    size_t body = st.st_size - sizeof(*h);
+    if (memcmp(h->magic, want->magic, sizeof(h->magic)) != 0 || h->key != want->key ||
+        h->source_size != want->source_size || h->body_size != body ||
+        hash_bytes(h + 1, body, 14695981039346656037UL) != h->body_hash) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return h;
+}
+
+/* Write the image under a temporary name and rename it into place, so
+   that a concurrent run never maps half an image. Failing to cache is
+   not an error. */
+static void utshc_save(const char *dir, const char *path, const utshc_header_t *h, outbuf_t *b) {
+    char *tmp;
+    mkdir(dir, 0700);
+    if (asprintf(&tmp, "%s.%d", path, (int)getpid()) < 0)
+        return;
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        int ok = write_all(fd, (const char *)h, sizeof(*h)) == 0 &&
+                 write_all(fd, b->data, b->len) == 0;
+        if (close(fd) == 0 && ok && rename(tmp, path) == 0)
+            tmp[0] = '\0';
+        if (tmp[0])
+            unlink(tmp);
+    }
+    free(tmp);
+}
+
+/* Run a mapped script from its image, compiling (and caching) it first
+   if there is none. */
+static int run_compiled(script_t *s, const char *dir) {
+    utshc_header_t want = { UTSHC_MAGIC, 0, s->size, 0, 0 };
+    want.key = hash_bytes(utshc_build, sizeof(utshc_build), 14695981039346656037UL);
+    want.key = hash_bytes(s->map, s->size, want.key);
+    char *path;
+    if (asprintf(&path, "%s/%016llx.utshc", dir, (unsigned long long)want.key) < 0) {
+        perror("asprintf");
+        exit(EXIT_FAILURE);
+    }
+
+    outbuf_t built = { 0 };
+    utshc_t c = { &built, NULL, s->map, 0 };
+    size_t image_size = 0;
+    const unsigned char *end;
+    const utshc_header_t *image = utshc_load(path, &want, &image_size);
+    if (image) {
+        c.pc = (const unsigned char *)(image + 1);
+        end = c.pc + image->body_size;
+    } else {
+        prof_begin(PROF_PARSE);
+        utshc_compile(&c, s->size);
+        prof_end();
+        want.body_size = built.len;
+        want.body_hash = hash_bytes(built.data, built.len, 14695981039346656037UL);
+        utshc_save(dir, path, &want, &built);
+        c.pc = (const unsigned char *)built.data;
+        end = c.pc + built.len;
+        c.last = 0;
+    }
+    free(path);
+
+    while (c.pc < end) {
+        uint64_t op = utshc_get(&c);
+        if (op == UTSHC_TEXT) {
+            word_t line = utshc_get_word(&c);
+            exec_tail = c.pc == end;
+            run_text(line.s, line.len);
+        } else {
+            prof_begin(PROF_LINE);
+            prof_begin(PROF_PARSE);
+            ast_t *tree = utshc_decode(&c, op);
+            prof_end();
+            exec_tail = c.pc == end;
+            interrupted = 0;
+            execute_node(tree);
+            free_ast(tree);
+            prof_end();
+        }
+        exec_tail = 0;
+        notify_jobs();
+    }
+    if (image)
+        munmap((void *)image, image_size);
+    free(built.data);
+    return last_status;
+}
+
+/* ------------------------ */
+/* Process sampling         */
+/* ------------------------ */
+/* "jobs -v" reads /proc/<pid>/stat and /proc/<pid>/io of every live
+   process. The files stay open between calls and are re-read with
+   pread(), so a refresh costs two system calls per process; rates are
+   computed against the previous sample, kept in the process entry.
+   Open files are capped at a share of RLIMIT_NOFILE, so a shell with
+   thousands of jobs keeps descriptors for its own pipes and redirections;
+   processes past the cap open and close their files at every sample. */
+#define SAMPLE_FD_SHARE 4       /* At most 1/4 of the descriptor limit */
+
+static long sample_fds = 0;     /* Descriptors held by cached processes */
+
+static long sample_fd_cap(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return 0;
+    rlim_t limit = rl.rlim_cur == RLIM_INFINITY ? 1 << 20 : rl.rlim_cur;
+    return (long)(limit / SAMPLE_FD_SHARE);
+}
+
+static int sample_open(process_t *p, const char *file) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)p->pid, file);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+static void sample_close(process_t *p) {
+    if (!p->sampled)
+        return;
+    if (p->cached) {
+        if (p->stat_fd >= 0)
+            close(p->stat_fd);
+        if (p->io_fd >= 0)
+            close(p->io_fd);
+        sample_fds -= 2;
+        p->cached = 0;
+    }
+    p->sampled = 0;
+}
+
+static ssize_t pread_text(int fd, char *buf, size_t size) {
+    if (fd < 0)
+        return -1;
+    ssize_t n = pread(fd, buf, size - 1, 0);
+    if (n >= 0)
+        buf[n] = '\0';
+    return n;
+}
+
+static void print_job_samples(job_t *j, uint64_t now) {
+    static long ticks_per_sec = 0, page_kb = 0;
+    if (ticks_per_sec == 0) {
+        ticks_per_sec = sysconf(_SC_CLK_TCK);
+        page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    }
+    int header = 0;
+    for (int i = 0; i < j->num_procs; i++) {
+        process_t *p = &j->procs[i];
+        if (p->completed || p->pid <= 0)
+            continue;
+        if (!p->sampled) {
+            p->cached = sample_fds + 2 <= sample_fd_cap();
+            if (p->cached) {
+                p->stat_fd = sample_open(p, "stat");
+                p->io_fd = sample_open(p, "io");
+                sample_fds += 2;
+            }
+            p->sample_ns = (uint64_t)j->start.tv_sec * 1000000000u + j->start.tv_nsec;
+            p->sampled = 1;
+        }
+        int stat_fd = p->cached ? p->stat_fd : sample_open(p, "stat");
+        int io_fd = p->cached ? p->io_fd : sample_open(p, "io");
+
+        char buf[1024];
+        char state = '?';
+        unsigned long long ticks = 0, rchar = 0, wchar = 0;
+        long rss = 0;
+        if (pread_text(stat_fd, buf, sizeof(buf)) > 0) {
+            /* Fields after the command name, which may contain spaces */
+            char *f = strrchr(buf, ')');
+            unsigned long utime, stime;
+            if (f && sscanf(f + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu"
+                            " %*d %*d %*d %*d %*d %*d %*u %*u %ld", &state, &utime, &stime, &rss) == 4)
+                ticks = utime + stime;
+        }
+        if (pread_text(io_fd, buf, sizeof(buf)) > 0) {
+            char *at = strstr(buf, "rchar:");
+            if (at)
+                rchar = strtoull(at + 6, NULL, 10);
+            at = strstr(buf, "wchar:");
+            if (at)
+                wchar = strtoull(at + 6, NULL, 10);
+        }
+        if (!p->cached) {
+            if (stat_fd >= 0)
+                close(stat_fd);
+            if (io_fd >= 0)
+                close(io_fd);
+        }
+
+        double secs = (now - p->sample_ns) / 1e9;
+        if (secs <= 0)
+            secs = 1e-9;
+        double cpu = 100.0 * (ticks - p->sample_ticks) / ticks_per_sec / secs;
+        char rss_text[16], rd[16], wr[16];
+        format_bytes(rss_text, sizeof(rss_text), rss * page_kb * 1024.0);
+        format_bytes(rd, sizeof(rd), (rchar - p->sample_rchar) / secs);
+        format_bytes(wr, sizeof(wr), (wchar - p->sample_wchar) / secs);
+        p->sample_ns = now;
+        p->sample_ticks = ticks;
+        p->sample_rchar = rchar;
+        p->sample_wchar = wchar;
+
+        if (!header) {
+            printf("      %7s %5s %6s %8s %9s %9s  %s\n", "PID", "STATE", "CPU%", "RSS",
+                   "READ/s", "WRITE/s", "COMMAND");
+            header = 1;
+        }
+        command_t *cmd = j->cmds[i];
+        printf("      %7d %5c %6.1f %8s %9s %9s  %s\n", (int)p->pid, state, cpu, rss_text,
+               rd, wr, cmd && cmd->args[0] ? cmd->args[0] : "(subshell)");
+    }
+}
+
+/* ------------------------ */
+/* Built-in commands        */
+/* ------------------------ */
+/* Parse a count such as the N of "-j N" or "jobslots=N": digits only,
+   up to INT_MAX. Returns -1 for anything else. */
+static int parse_count(const char *text) {
+    char *end;
+    errno = 0;
+    long n = strtol(text, &end, 10);
+    if (*text < '0' || *text > '9' || *end || errno || n > INT_MAX)
+        return -1;
+    return (int)n;
+}
+
+/* pwd - print the working directory. */
+static int builtin_pwd(char **args) {
+    (void)args;
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+static int builtin_cd(char **args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "cd: expected argument\n");
+        return 1;
+    }
+    if (journal_cwd() < 0)
+        return 1;
+    if (chdir(args[1]) != 0) {
+        perror("cd");
+        return 1;
+    }
+    return 0;
+}
+
+/* jobs [-v] - list jobs; -v adds a line per live process with its CPU%,
+   RSS and I/O rates since the previous "jobs -v" (or since launch). */
+static int builtin_jobs(char **args) {
+    int verbose = args[1] && strcmp(args[1], "-v") == 0;
+    reap_children();
+    uint64_t now = prof_now();
+    job_t *j = job_list;
+    while (j) {
+        job_t *next = j->next;
+        print_job(j);
+        if (verbose)
+            print_job_samples(j, now);
+        j->notified = 1;
+        if (job_is_completed(j))
+            remove_job(j);
+        j = next;
+    }
+    return 0;
+}
+
+static int builtin_fg(char **args) {
+    job_t *j = find_job(args[1]);
+    if (!j) {
+        fprintf(stderr, "fg: %s: no such job\n", args[1] ? args[1] : "current");
+        return 1;
+    }
+    printf("%s\n", j->cmdline);
+    fflush(stdout);
+    if (j->queued) {
+        /* Jump the queue: the user wants it now */
+        launch_job(j, 1);
+        return put_job_in_foreground(j, 0);
+    }
+    return put_job_in_foreground(j, 1);
+}
+
+static int builtin_bg(char **args) {
+    job_t *j = find_job(args[1]);
+    if (!j) {
+        fprintf(stderr, "bg: %s: no such job\n", args[1] ? args[1] : "current");
+        return 1;
+    }
+    if (j->queued) {
+        fprintf(stderr, "bg: job %d is queued for a job slot\n", j->id);
+        return 1;
+    }
+    put_job_in_background(j, 1);
+    printf("[%d]+ %s &\n", j->id, j->cmdline);
+    return 0;
+}
+
+/* wait [%n|pid ...] - wait for the given jobs, or for every running or
+   queued job. Queued jobs start as earlier ones exit, so a bare "wait"
+   drains the job-slot queue. */
+static int builtin_wait(char **args) {
+    int status = 0;
+    interrupted = 0;
+    if (args[1] == NULL) {
+        for (job_t *j = job_list; j && !interrupted; j = j->next)
+            if (!job_is_stopped(j))
+                wait_for_job(j);
+        if (interrupted) {
+            printf("\n");
+            return 130;
+        }
+        return 0;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        job_t *j = find_job(args[i]);
+        if (!j) {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+        wait_for_job(j);
+        if (interrupted) {
+            printf("\n");
+            return 130;
+        }
+        status = job_exit_status(j);
+    }
+    return status;
+}
+
+/* pipeinfo - exit status and resource usage (from wait4) of every stage
+   of the last foreground pipeline. */
+static int builtin_pipeinfo(char **args) {
+    (void)args;
+    if (last_num_stages == 0) {
+        fprintf(stderr, "pipeinfo: no pipeline has run yet\n");
+        return 1;
+    }
+    printf("%-3s %7s %6s %9s %9s %9s %9s %6s %6s  %s\n", "#", "PID", "STATUS",
+           "REAL", "USER", "SYS", "MAXRSS", "VCSW", "IVCSW", "COMMAND");
+    for (int i = 0; i < last_num_stages; i++) {
+        stage_info_t *s = &last_stages[i];
+        char pid[16];
+        if (s->pid > 0)
+            snprintf(pid, sizeof(pid), "%d", (int)s->pid);
+        else
+            strcpy(pid, "-");
+        printf("%-3d %7s %6d %8.3fs %8.3fs %8.3fs %8ldK %6ld %6ld  %s\n", i, pid, s->status,
+               s->real,
+               s->ru.ru_utime.tv_sec + s->ru.ru_utime.tv_usec / 1e6,
+               s->ru.ru_stime.tv_sec + s->ru.ru_stime.tv_usec / 1e6,
+               s->ru.ru_maxrss, s->ru.ru_nvcsw, s->ru.ru_nivcsw, s->name);
+    }
+    return 0;
+}
+
+/* profile [on|off|reset|-f] - show per-phase latency percentiles of the
+   shell itself, switch profiling, or print folded stacks (-f). */
+static int builtin_profile(char **args) {
+    if (args[1] == NULL) {
+        if (!profiling)
+            printf("profiling is off (\"profile on\" starts it)\n");
+        profile_print();
+    } else if (strcmp(args[1], "on") == 0) {
+        profiling = 1;
+        prof_depth = 0;
+    } else if (strcmp(args[1], "off") == 0) {
+        profiling = 0;
+    } else if (strcmp(args[1], "reset") == 0) {
+        profile_reset();
+    } else if (strcmp(args[1], "-f") == 0) {
+        profile_print_folded(stdout);
+    } else {
+        fprintf(stderr, "profile: usage: profile [on|off|reset|-f]\n");
+        return 2;
+    }
+    return 0;
+}
+
+/* ------------------------ */
+/* parallel built-in        */
+/* ------------------------ */
+/* parallel [-j N] [-k] [--halt now|soon,fail=N|success=N] cmd [args]
+   Runs cmd once for every line of standard input, with "{}" in any
+   argument replaced by the line (or the line appended when no argument
+   contains "{}"), keeping at most N jobs running. Each job's stdout and
+   stderr are collected into buffers through the event loop and written
+   out in one piece when the job ends, in input order with -k. Jobs run
+   with stdin redirected from /dev/null. */
+typedef struct ptask {
+    long seq;             /* Position of the input line */
+    job_t *job;
+    int out_fd;           /* Read ends of the job's stdout/stderr, -1 at EOF */
+    int err_fd;
+    outbuf_t out;
+    outbuf_t err;
+    struct ptask *next;
+} ptask_t;
+
+/* Collect output from a job's pipe; at EOF stop watching it. */
+static void on_task_output(int fd, uint32_t events, void *data) {
+    (void)events;
+    ptask_t *t = data;
+    char buf[65536];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n > 0) {
+        outbuf_append(fd == t->out_fd ? &t->out : &t->err, buf, n);
+        return;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    reactor_del(fd);
+    close(fd);
+    if (fd == t->out_fd)
+        t->out_fd = -1;
+    else
+        t->err_fd = -1;
+}
+
+/* Line-at-a-time reader over fd 0 that waits through the event loop, so
+   SIGINT and finishing jobs are handled while input is slow to arrive. */
+typedef struct {
+    outbuf_t buf;
+    size_t start;         /* First unconsumed byte */
+    int eof;
+    int ready;            /* Set by on_input_ready() */
+    int direct;           /* fd 0 is a file: read it, never poll it */
+    int watched;          /* fd 0 is in the event loop, until it is ready */
+} line_input_t;
+
+/* One shot: fd 0 leaves the event loop once readable, so that it does
+   not fire on every turn while all the job slots are busy. */
+static void on_input_ready(int fd, uint32_t events, void *data) {
+    (void)events;
+    line_input_t *in = data;
+    in->ready = 1;
+    in->watched = 0;
+    reactor_del(fd);
+}
+
+static void line_input_close(line_input_t *in) {
+    if (in->watched)
+        reactor_del(STDIN_FILENO);
+    in->watched = 0;
+    free(in->buf.data);
+}
+
+static void line_input_fill(line_input_t *in) {
+    char chunk[65536];
+    ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+    if (n > 0)
+        outbuf_append(&in->buf, chunk, n);
+    else if (n == 0 || (errno != EINTR && errno != EAGAIN))
+        in->eof = 1;
+}
+
+/* Return the next line (without its newline) as a new string, NULL at
+   EOF. With block == 0, returns NULL as soon as no whole line is
+   buffered and leaves fd 0 watched by the event loop (once). */
+static char *line_input_next(line_input_t *in, int block) {
+    for (;;) {
+        char *start = in->buf.data + in->start;
+        size_t avail = in->buf.len - in->start;
+        char *nl = avail ? memchr(start, '\n', avail) : NULL;
+        if (nl || (in->eof && avail > 0)) {
+            size_t len = nl ? (size_t)(nl - start) : avail;
+            char *line = strndup(start, len);
+            if (!line) {
+                perror("strndup");
+                exit(EXIT_FAILURE);
+            }
+            in->start += nl ? len + 1 : len;
+            return line;
+        }
+        if (in->eof)
+            return NULL;
+        /* Compact before reading more */
+        memmove(in->buf.data, start, avail);
+        in->buf.len = avail;
+        in->start = 0;
+        if (in->ready || in->direct) {
+            in->ready = 0;
+            line_input_fill(in);
+            continue;
+        }
+        if (!in->watched) {
+            if (reactor_add(STDIN_FILENO, EPOLLIN, on_input_ready, in) < 0) {
+                line_input_fill(in);
+                continue;
+            }
+            in->watched = 1;
+        }
+        if (!block)
+            return NULL;
+        while (!in->ready && !interrupted)
+            if (reactor_run_once(-1) < 0)
+                break;
+        if (interrupted)
+            return NULL;
+    }
+}
+
+/* Build the argv for one input line from the template. */
+static char **parallel_argv(char **tmpl, const char *line) {
+    int n = 0, has_braces = 0;
+    while (tmpl[n]) {
+        if (strstr(tmpl[n], "{}"))
+            has_braces = 1;
+        n++;
+    }
+    char **argv = malloc((n + 2) * sizeof(char *));
+    if (!argv) {
+        perror("malloc parallel_argv");
+        exit(EXIT_FAILURE);
+    }
+    size_t line_len = strlen(line);
+    for (int i = 0; i < n; i++) {
+        size_t count = 0;
+        for (const char *p = strstr(tmpl[i], "{}"); p; p = strstr(p + 2, "{}"))
+            count++;
+        char *arg = malloc(strlen(tmpl[i]) + count * line_len + 1);
+        if (!arg) {
+            perror("malloc parallel_argv");
+            exit(EXIT_FAILURE);
+        }
+        char *dst = arg;
+        const char *src = tmpl[i];
+        const char *p;
+        while ((p = strstr(src, "{}")) != NULL) {
+            memcpy(dst, src, p - src);
+            dst += p - src;
+            memcpy(dst, line, line_len);
+            dst += line_len;
+            src = p + 2;
+        }
+        strcpy(dst, src);
+        argv[i] = arg;
+    }
+    if (!has_braces) {
+        argv[n++] = strdup(line);
+        if (!argv[n - 1]) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+    }
+    argv[n] = NULL;
+    return argv;
+}
+
+static ptask_t *parallel_spawn(char **tmpl, const char *line, long seq) {
+    int out[2], err[2];
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return NULL;
+    }
+    if (pipe2(err, O_CLOEXEC) < 0) {
+        perror("pipe");
+        close(out[0]);
+        close(out[1]);
+        return NULL;
+    }
+    command_t *cmd = calloc(1, sizeof(command_t));
+    command_t **cmds = malloc(sizeof(command_t *));
+    ptask_t *t = calloc(1, sizeof(ptask_t));
+    if (!cmd || !cmds || !t || !(cmd->infile = strdup("/dev/null"))) {
+        perror("calloc parallel_spawn");
+        exit(EXIT_FAILURE);
+    }
+    cmd->here_fd = -1;
+    cmd->args = parallel_argv(tmpl, line);
+    cmds[0] = cmd;
+
+    t->seq = seq;
+    t->job = create_job(cmds, 1, line);
+    t->job->io[1] = out[1];
+    t->job->io[2] = err[1];
+    launch_job(t->job, 0);
+    close(out[1]);
+    close(err[1]);
+    t->out_fd = out[0];
+    t->err_fd = err[0];
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+    fcntl(err[0], F_SETFL, O_NONBLOCK);
+    reactor_add(out[0], EPOLLIN, on_task_output, t);
+    reactor_add(err[0], EPOLLIN, on_task_output, t);
+    return t;
+}
+
+static void parallel_flush(ptask_t *t) {
+    fflush(stdout);
+    write_all(STDOUT_FILENO, t->out.data, t->out.len);
+    write_all(STDERR_FILENO, t->err.data, t->err.len);
+}
+
+static void parallel_free(ptask_t *t) {
+    for (int i = 0; i < 2; i++) {
+        int fd = i ? t->err_fd : t->out_fd;
+        if (fd >= 0) {
+            reactor_del(fd);
+            close(fd);
+        }
+    }
+    remove_job(t->job);
+    free(t->out.data);
+    free(t->err.data);
+    free(t);
+}
+
+static int parallel_usage(void) {
+    fprintf(stderr, "parallel: usage: parallel [-j N] [-k] [--halt now|soon,fail=N|success=N] command [args...]\n");
+    return 2;
+}
+
+static int builtin_parallel(char **args) {
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep_order = 0;
+    int halt_now = 0, halt_on_fail = 0, halt_on_success = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-'; i++) {
+        if (strncmp(args[i], "-j", 2) == 0 && (args[i][2] || args[i + 1])) {
+            const char *n = args[i][2] ? args[i] + 2 : args[++i];
+            if ((slots = parse_count(n)) < 0) {
+                fprintf(stderr, "parallel: -j %s: invalid value\n", n);
+                return 2;
+            }
+        } else if (strcmp(args[i], "-k") == 0) {
+            keep_order = 1;
+        } else if (strcmp(args[i], "--halt") == 0 && args[i + 1]) {
+            const char *spec = args[++i];
+            if (strcmp(spec, "never") == 0)
+                continue;
+            if (strncmp(spec, "now,", 4) == 0)
+                halt_now = 1;
+            else if (strncmp(spec, "soon,", 5) != 0)
+                return parallel_usage();
+            const char *cond = strchr(spec, ',') + 1;
+            if (strncmp(cond, "fail=", 5) == 0)
+                halt_on_fail = parse_count(cond + 5);
+            else if (strncmp(cond, "success=", 8) == 0)
+                halt_on_success = parse_count(cond + 8);
+            else
+                return parallel_usage();
+            if (halt_on_fail < 0 || halt_on_success < 0) {
+                fprintf(stderr, "parallel: --halt %s: invalid value\n", spec);
+                return 2;
+            }
+        } else if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            return parallel_usage();
+        }
+    }
+    if (args[i] == NULL)
+        return parallel_usage();
+    if (slots < 1)
+        slots = 1;
+    char **tmpl = &args[i];
+
+    script_sync();
+    line_input_t in = { { NULL, 0, 0 }, 0, 0, 0, 0, 0 };
+    /* epoll refuses regular files (EPERM); they never block either */
+    struct stat st;
+    in.direct = fstat(STDIN_FILENO, &st) == 0 &&
+                (S_ISREG(st.st_mode) || S_ISBLK(st.st_mode));
+    ptask_t *running = NULL;      /* Started, not yet finished */
+    ptask_t *finished = NULL;     /* Finished, waiting for earlier output (-k) */
+    long nrunning = 0, next_seq = 0, next_flush = 0;
+    int failed = 0, succeeded = 0, halting = 0, halt_status = 0;
+
+    interrupted = 0;
+    for (;;) {
+        /* Start jobs while slots and input are available */
+        while (!halting && !interrupted && nrunning < slots) {
+            char *line = line_input_next(&in, nrunning == 0);
+            if (!line)
+                break;
+            ptask_t *t = parallel_spawn(tmpl, line, next_seq++);
+            free(line);
+            if (!t) {
+                halting = 1;
+                halt_status = 1;
+                break;
+            }
+            t->next = running;
+            running = t;
+            nrunning++;
+        }
+        if (interrupted) {
+            for (ptask_t *t = running; t; t = t->next)
+                signal_job(t->job, SIGTERM);
+            halting = 1;
+            halt_status = 130;
+        }
+        if (nrunning == 0)
+            break;
+        if (reactor_run_once(-1) < 0)
+            break;
+
+        /* Retire jobs whose process and pipes are all done */
+        for (ptask_t **pp = &running; *pp; ) {
+            ptask_t *t = *pp;
+            if (!job_is_completed(t->job) || t->out_fd >= 0 || t->err_fd >= 0) {
+                pp = &t->next;
+                continue;
+            }
+            *pp = t->next;
+            nrunning--;
+            int status = job_exit_status(t->job);
+            if (status == 0)
+                succeeded++;
+            else
+                failed++;
+            if (!halting && ((halt_on_fail && status != 0 && failed >= halt_on_fail) ||
+                             (halt_on_success && status == 0 && succeeded >= halt_on_success))) {
+                halting = 1;
+                halt_status = status;
+                if (halt_now)
+                    for (ptask_t *r = running; r; r = r->next)
+                        signal_job(r->job, SIGTERM);
+            }
+            if (!keep_order) {
+                parallel_flush(t);
+                parallel_free(t);
+                continue;
+            }
+            t->next = finished;
+            finished = t;
+            /* Emit every finished job that is next in input order */
+            for (int progress = 1; progress; ) {
+                progress = 0;
+                for (ptask_t **fp = &finished; *fp; fp = &(*fp)->next) {
+                    if ((*fp)->seq == next_flush) {
+                        ptask_t *f = *fp;
+                        *fp = f->next;
+                        parallel_flush(f);
+                        parallel_free(f);
+                        next_flush++;
+                        progress = 1;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    /* With --halt, output of jobs after a gap is still shown, in order */
+    while (finished) {
+        ptask_t *best = finished;
+        for (ptask_t *f = finished; f; f = f->next)
+            if (f->seq < best->seq)
+                best = f;
+        ptask_t **fp = &finished;
+        while (*fp != best)
+            fp = &(*fp)->next;
+        *fp = best->next;
+        parallel_flush(best);
+        parallel_free(best);
+    }
+    line_input_close(&in);
+    if (interrupted)
+        printf("\n");
+    if (halting)
+        return halt_status;
+    return failed > 100 ? 101 : failed;
+}
+
+/* One entry of "history -v": number, start, duration, status, peak
+   RSS, directory and command. */
+static void print_history_entry(int i) {
+    history_entry_t *e = &history[i];
+    char when[32] = "-", secs[16] = "-", status[12] = "-", rss[16] = "-";
+    struct tm tm;
+    if (e->start && localtime_r(&e->start, &tm))
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    if (e->secs >= 0)
+        snprintf(secs, sizeof(secs), "%.3fs", e->secs);
+    if (e->status >= 0)
+        snprintf(status, sizeof(status), "%d", e->status);
+    if (e->maxrss > 0)
+        format_bytes(rss, sizeof(rss), e->maxrss * 1024.0);
+    printf("%5d  %-19s %9s %4s %7s  %s  %s\n", i + 1, when, secs, status, rss,
+           e->cwd ? e->cwd : "-", e->text);
+}
+
+static int history_by_secs(const void *a, const void *b) {
+    double x = history[*(const int *)a].secs, y = history[*(const int *)b].secs;
+    return x < y ? 1 : x > y ? -1 : *(const int *)a - *(const int *)b;
+}
+
+/* Per-command totals for "history --stats", keyed by the first word. */
+typedef struct {
+    char *name;
+    int count, failed;
+    double total, max;
+    long maxrss;
+} history_stat_t;
+
+static int history_stat_cmp(const void *a, const void *b) {
+    double x = ((const history_stat_t *)a)->total, y = ((const history_stat_t *)b)->total;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void print_history_stats(void) {
+    history_stat_t *stats = NULL;
+    int count = 0;
+    for (int i = 0; i < history_count; i++) {
+        history_entry_t *e = &history[i];
+        if (e->secs < 0)
+            continue;
+        const char *word = e->text + strspn(e->text, " \t");
+        size_t len = strcspn(word, " \t;&|<>");
+        int k;
+        for (k = 0; k < count; k++)
+            if (strlen(stats[k].name) == len && strncmp(stats[k].name, word, len) == 0)
+                break;
+        if (k == count) {
+            stats = realloc(stats, (count + 1) * sizeof(history_stat_t));
+            if (!stats) {
+                perror("realloc history stats");
+                exit(EXIT_FAILURE);
+            }
+            memset(&stats[k], 0, sizeof(history_stat_t));
+            stats[k].name = strndup(word, len);
+            if (!stats[k].name) {
+                perror("strndup");
+                exit(EXIT_FAILURE);
+            }
+            count++;
+        }
+        history_stat_t *st = &stats[k];
+        st->count++;
+        st->failed += e->status > 0;
+        st->total += e->secs;
+        if (e->secs > st->max)
+            st->max = e->secs;
+        if (e->maxrss > st->maxrss)
+            st->maxrss = e->maxrss;
+    }
+    qsort(stats, count, sizeof(history_stat_t), history_stat_cmp);
+    printf("%-16s %6s %6s %10s %10s %10s %8s\n",
+           "COMMAND", "RUNS", "FAILED", "TOTAL", "MEAN", "MAX", "MAXRSS");
+    for (int k = 0; k < count; k++) {
+        char rss[16] = "-";
+        if (stats[k].maxrss > 0)
+            format_bytes(rss, sizeof(rss), stats[k].maxrss * 1024.0);
+        printf("%-16s %6d %6d %9.3fs %9.3fs %9.3fs %8s\n", stats[k].name,
+               stats[k].count, stats[k].failed, stats[k].total,
+               stats[k].total / stats[k].count, stats[k].max, rss);
+        free(stats[k].name);
+    }
+    free(stats);
+}
+
+/* history [-v | --slowest [N] | --failed | --stats] - list the commands
+   entered, with start time, duration, status, peak RSS and directory
+   (-v), the N slowest (default 10), those that failed, or totals per
+   command name sorted by time spent. */
+static int builtin_history(char **args) {
+    if (!args[1]) {
+        print_history();
+        return 0;
+    }
+    if (strcmp(args[1], "-v") == 0) {
+        for (int i = 0; i < history_count; i++)
+            print_history_entry(i);
+    } else if (strcmp(args[1], "--failed") == 0) {
+        for (int i = 0; i < history_count; i++)
+            if (history[i].status > 0)
+                print_history_entry(i);
+    } else if (strcmp(args[1], "--slowest") == 0) {
+        int limit = args[2] ? atoi(args[2]) : 10;
+        int *order = malloc((history_count + 1) * sizeof(int));
+        if (!order) {
+            perror("malloc history");
+            exit(EXIT_FAILURE);
+        }
+        int n = 0;
+        for (int i = 0; i < history_count; i++)
+            if (history[i].secs >= 0)
+                order[n++] = i;
+        qsort(order, n, sizeof(int), history_by_secs);
+        for (int i = 0; i < n && i < limit; i++)
+            print_history_entry(order[i]);
+        free(order);
+    } else if (strcmp(args[1], "--stats") == 0) {
+        print_history_stats();
+    } else {
+        fprintf(stderr, "usage: history [-v | --slowest [N] | --failed | --stats]\n");
+        return 2;
+    }
+    return 0;
+}
+
+/* exit [n] - leave the shell with status n, or that of the last command. */
+static int builtin_exit(char **args) {
+    int status = args[1] ? atoi(args[1]) & 0xff : last_status;
+    fflush(stdout);
+    profile_finish();
+    exit(status);
+}
+
+/* ":" and "true" succeed and "false" fails: loop conditions that need
+   no process. */
+static int builtin_true(char **args) {
+    (void)args;
+    return 0;
+}
+
+static int builtin_false(char **args) {
+    (void)args;
+    return 1;
+}
+
+/* echo [-neE] [arg...] - print the arguments; -n leaves out the newline
+   and -e interprets \n, \t, \0nnn, \xHH, \c and the other escapes. */
+static int builtin_echo(char **args) {
+    int newline = 1, escapes = 0, i;
+    for (i = 1; args[i] && args[i][0] == '-' && args[i][1] &&
+                strspn(args[i] + 1, "neE") == strlen(args[i] + 1); i++)
+        for (const char *o = args[i] + 1; *o; o++) {
+            if (*o == 'n')
+                newline = 0;
+            else
+                escapes = *o == 'e';
+        }
+    for (int first = i; args[i]; i++) {
+        if (i > first)
+            putchar(' ');
+        for (const char *a = args[i]; *a; a++) {
+            if (!escapes || *a != '\\' || !a[1]) {
+                putchar(*a);
+                continue;
+            }
+            const char *esc = strchr("abefnrtv\\", *++a);
+            int c = 0, digits = 0;
+            if (esc) {
+                putchar("\a\b\033\f\n\r\t\v\\"[esc - "abefnrtv\\"]);
+            } else if (*a == 'c') {
+                return 0;
+            } else if (*a == '0') {
+                while (digits < 3 && a[1] >= '0' && a[1] <= '7')
+                    c = c * 8 + *++a - '0', digits++;
+                putchar(c);
+            } else if (*a == 'x' && isxdigit((unsigned char)a[1])) {
+                while (digits < 2 && isxdigit((unsigned char)a[1])) {
+                    a++;
+                    c = c * 16 + (isdigit((unsigned char)*a) ? *a - '0' : tolower((unsigned char)*a) - 'a' + 10);
+                    digits++;
+                }
+                putchar(c);
+            } else {
+                putchar('\\');
+                putchar(*a);
+            }
+        }
+    }
+    if (newline)
+        putchar('\n');
+    return 0;
+}
+
+/* "break [n]" and "continue [n]" in a loop are jumps (see
+   compile_break()); the built-ins only run where there is no loop to
+   leave, or when n is not a literal number. */
+static int builtin_break(char **args) {
+    char *end;
+    if (args[1] && (strtol(args[1], &end, 10) < 1 || *end || args[2])) {
+        fprintf(stderr, "utsh: %s: %s: loop count must be a literal number of 1 or more\n",
+                args[0], args[1]);
+        return 1;
+    }
+    fprintf(stderr, "utsh: %s: only meaningful in a for, while or until loop\n", args[0]);
+    return 0;
+}
+
+static int var_by_name(const void *a, const void *b) {
+    return strcmp((*(var_t * const *)a)->name, (*(var_t * const *)b)->name);
+}
+
+/* export [name[=value] ...] - mark variables for the environment of
+   commands; without arguments, list the exported variables. */
+static int builtin_export(char **args) {
+    if (args[1] == NULL) {
+        var_t **list = malloc((var_count + 1) * sizeof(var_t *));
+        if (!list) {
+            perror("malloc export");
+            exit(EXIT_FAILURE);
+        }
+        size_t n = 0;
+        for (size_t i = 0; i <= var_mask; i++)
+            if (var_slots[i] && (var_slots[i]->flags & VAR_EXPORT))
+                list[n++] = var_slots[i];
+        qsort(list, n, sizeof(var_t *), var_by_name);
+        for (size_t i = 0; i < n; i++) {
+            const char *value = var_value(list[i]);
+            printf("export %s", list[i]->name);
+            if (value) {
+                printf("='");
+                for (; *value; value++) {
+                    if (*value == '\'')
+                        fputs("'\\''", stdout);
+                    else
+                        putchar(*value);
                 }
-            } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+                printf("'");
+            }
+            printf("\n");
+        }
+        free(list);
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i]; i++) {
+        size_t len = assignment_name(args[i]);
+        if (!len && !var_name_valid(args[i], strlen(args[i]))) {
+            fprintf(stderr, "export: %s: not a valid name\n", args[i]);
+            status = 1;
+            continue;
+        }
+        var_t *v = var_intern(args[i], len ? len : strlen(args[i]));
+        if (len)
+            var_assign(v, args[i] + len + 1, strlen(args[i] + len + 1));
+        var_export(v);
+    }
+    return status;
+}
+
+/* unset name... - remove variables (and their export). */
+static int builtin_unset(char **args) {
+    int status = 0;
+    for (int i = 1; args[i]; i++) {
+        if (!var_name_valid(args[i], strlen(args[i]))) {
+            fprintf(stderr, "unset: %s: not a valid name\n", args[i]);
+            status = 1;
+            continue;
+        }
+        var_t *v = var_find(args[i], strlen(args[i]));
+        if (v)
+            var_unset(v);
+    }
+    return status;
+}
+
+/* hash [-r] - list cached command paths, or forget them with -r. */
+static int builtin_hash(char **args) {
+    if (args[1] && strcmp(args[1], "-r") == 0) {
+        path_cache_clear();
+        return 0;
+    }
+    for (int i = 1; args[i]; i++) {
+        if (!path_lookup(args[i])) {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            return 1;
+        }
+    }
+    if (args[1] == NULL)
+        for (int i = 0; i < PATH_CACHE_SIZE; i++)
+            for (path_entry_t *e = path_cache[i]; e; e = e->next)
+                printf("%s\t%s\n", e->name, e->path);
+    return 0;
+}
+
+/* ------------------------ */
+/* Shell options            */
+/* ------------------------ */
+typedef struct {
+    const char *name;
+    int *value;
+    int numeric;      /* Takes "=N"; defaults to the number of CPUs */
+} option_t;
+
+static const option_t shell_options[] = {
+    { "jobslots", &opt_jobslots, 1 },
+    { "pipefail", &opt_pipefail, 0 },
+};
+
+static const option_t *find_option(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(shell_options) / sizeof(shell_options[0]); i++)
+        if (strlen(shell_options[i].name) == len && strncmp(shell_options[i].name, name, len) == 0)
+            return &shell_options[i];
+    return NULL;
+}
+
+/* set -o                 list options
+   set -o name[=N]        enable an option (numeric ones default to the CPU count)
+   set +o name            disable an option */
+static int builtin_set(char **args) {
+    if (args[1] == NULL || (strcmp(args[1], "-o") == 0 && args[2] == NULL)) {
+        for (size_t i = 0; i < sizeof(shell_options) / sizeof(shell_options[0]); i++) {
+            const option_t *o = &shell_options[i];
+            if (o->numeric && *o->value > 0)
+                printf("%-12s%d\n", o->name, *o->value);
+            else
+                printf("%-12s%s\n", o->name, *o->value ? "on" : "off");
+        }
+        return 0;
+    }
+    int enable;
+    if (strcmp(args[1], "-o") == 0)
+        enable = 1;
+    else if (strcmp(args[1], "+o") == 0)
+        enable = 0;
+    else {
+        fprintf(stderr, "set: usage: set [-o|+o] [option[=value]]\n");
+        return 2;
+    }
+    for (int i = 2; args[i] != NULL; i++) {
+        char *eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        const option_t *o = find_option(args[i], len);
+        if (!o || (eq && !o->numeric)) {
+            fprintf(stderr, "set: %s: invalid option\n", args[i]);
+            return 2;
+        }
+        if (!enable) {
+            *o->value = 0;
+        } else if (eq) {
+            int n = parse_count(eq + 1);
+            if (n < 0) {
+                fprintf(stderr, "set: %s: invalid value\n", args[i]);
+                return 2;
+            }
+            *o->value = n;
         } else {
-            printf("Process running in background with PID %d\n", pid);
+            long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+            *o->value = o->numeric ? (ncpu > 0 ? (int)ncpu : 1) : 1;
         }
     }
-    return 1;
+    /* A raised limit may let queued jobs start right away */
+    admit_queued_jobs();
+    return 0;
+}
+
+
+static const builtin_t builtins[] = {
+    { "cd",       builtin_cd,       1 },
+    { "pwd",      builtin_pwd,      1 },
+    { "exit",     builtin_exit,     0 },
+    { ":",        builtin_true,     1 },
+    { "true",     builtin_true,     1 },
+    { "false",    builtin_false,    1 },
+    { "echo",     builtin_echo,     1 },
+    { "break",    builtin_break,    1 },
+    { "continue", builtin_break,    1 },
+    { "export",   builtin_export,   1 },
+    { "unset",    builtin_unset,    1 },
+    { "jobs",     builtin_jobs,     1 },
+    { "fg",       builtin_fg,       0 },
+    { "bg",       builtin_bg,       0 },
+    { "wait",     builtin_wait,     0 },
+    { "set",      builtin_set,      1 },
+    { "parallel", builtin_parallel, 0 },
+    { "hash",     builtin_hash,     1 },
+    { "history",  builtin_history,  1 },
+    { "pipeinfo", builtin_pipeinfo, 1 },
+    { "profile",  builtin_profile,  0 },
+};
+
+static const builtin_t *find_builtin(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+        if (strcmp(builtins[i].name, name) == 0)
+            return &builtins[i];
+    return NULL;
+}
+
+/* Run args as a built-in. Returns its exit status, or -1 if args[0]
+   is not a built-in. */
+int run_builtin(char **args) {
+    if (args[0] == NULL)
+        return -1;
+    const builtin_t *b = find_builtin(args[0]);
+    if (!b)
+        return -1;
+    trace_event(TR_BUILTIN_BEGIN, trace_fd >= 0 ? getpid() : 0, trace_node, trace_stage, 0, 0, args[0]);
+    int status = b->func(args);
+    trace_event(TR_BUILTIN_END, trace_fd >= 0 ? getpid() : 0, trace_node, trace_stage, status, 0, args[0]);
+    return status;
 }
 
 /* ------------------------ */
-/* Execute a pipeline       */
+/* Batch (DAG) mode         */
 /* ------------------------ */
-int execute_pipeline(command_t **cmds, int num_cmds) {
-    int i;
-    int in_fd = 0;  // Initially, input comes from STDIN
-    int fd[2];
-    pid_t pid;
-    
-    for (i = 0; i < num_cmds; i++) {
-        if (i < num_cmds - 1) {
-            if (pipe(fd) < 0) {
-                perror("pipe");
+/* utsh -j N -f jobs.sh runs every line of jobs.sh as a node of a
+   dependency graph, with up to N nodes at once. A line may end with an
+   annotation comment:
+
+       cc -c a.c -o a.o   #@ name: a  in: a.c a.h  out: a.o
+       cc a.o b.o -o app  #@ after: a b  in: a.o b.o  out: app
+
+   "after:" names nodes that must finish first; a node also waits for any
+   node whose "out:" lists one of its "in:" files. Lines without
+   annotations are independent. A node whose outputs all exist and are
+   newer than all its inputs is skipped. Finished nodes are appended to
+   jobs.sh.journal, so a failed run resumes where it stopped; the
+   journal is removed once every node has succeeded. */
+enum { NODE_WAITING, NODE_RUNNING, NODE_DONE, NODE_FAILED, NODE_NOT_RUN };
+
+typedef struct {
+    int lineno;
+    char *cmd;            /* Command text, annotation removed */
+    char *name;
+    char **after;         /* NULL-terminated lists */
+    char **inputs;
+    char **outputs;
+    int *deps;            /* Indices of nodes this one waits for */
+    int num_deps;
+    int state;
+    job_t *job;
+    unsigned long key;    /* Journal key: hash of the line number and text */
+} batch_node_t;
+
+typedef struct {
+    char **items;
+    int count;
+    int cap;
+} strlist_t;
+
+static void strlist_add(strlist_t *l, const char *s, size_t len) {
+    if (l->count + 2 > l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 4;
+        l->items = realloc(l->items, l->cap * sizeof(char *));
+        if (!l->items) {
+            perror("realloc strlist");
+            exit(EXIT_FAILURE);
+        }
+    }
+    l->items[l->count] = strndup(s, len);
+    if (!l->items[l->count]) {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    l->items[++l->count] = NULL;
+}
+
+static char **strlist_finish(strlist_t *l) {
+    if (l->items == NULL) {
+        l->items = calloc(1, sizeof(char *));
+        if (!l->items) {
+            perror("calloc strlist");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return l->items;
+}
+
+/* Split "#@ key: v v key: v" into the node's lists. */
+static int parse_annotation(batch_node_t *n, const char *text) {
+    strlist_t after = { 0 }, in = { 0 }, out = { 0 }, name = { 0 };
+    strlist_t *cur = NULL;
+    const char *p = text;
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+            p++;
+        if (!*p)
+            break;
+        const char *start = p;
+        while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+            p++;
+        size_t len = p - start;
+        if (start[len - 1] == ':') {
+            if (len == 6 && strncmp(start, "after:", 6) == 0)
+                cur = &after;
+            else if (len == 3 && strncmp(start, "in:", 3) == 0)
+                cur = &in;
+            else if (len == 4 && strncmp(start, "out:", 4) == 0)
+                cur = &out;
+            else if (len == 5 && strncmp(start, "name:", 5) == 0)
+                cur = &name;
+            else {
+                fprintf(stderr, "utsh: line %d: unknown annotation '%.*s'\n", n->lineno, (int)len, start);
                 return -1;
             }
+        } else if (cur == NULL) {
+            fprintf(stderr, "utsh: line %d: annotation value without a key\n", n->lineno);
+            return -1;
+        } else {
+            strlist_add(cur, start, len);
         }
-        pid = fork();
-        if (pid < 0) {
-            perror("fork");
+    }
+    n->after = strlist_finish(&after);
+    n->inputs = strlist_finish(&in);
+    n->outputs = strlist_finish(&out);
+    n->name = name.count ? name.items[0] : NULL;
+    for (int i = 1; i < name.count; i++)
+        free(name.items[i]);
+    if (name.count == 0)
+        free(name.items);
+    return 0;
+}
+
+static int batch_load(const char *path, batch_node_t **nodes_out) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    batch_node_t *nodes = NULL;
+    int count = 0, cap = 0, lineno = 0;
+    char *line = NULL;
+    size_t bufsize = 0;
+    while (getline(&line, &bufsize, f) != -1) {
+        lineno++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '\0' || *p == '\n' || *p == '#')
+            continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            nodes = realloc(nodes, cap * sizeof(batch_node_t));
+            if (!nodes) {
+                perror("realloc batch nodes");
+                exit(EXIT_FAILURE);
+            }
+        }
+        batch_node_t *n = &nodes[count];
+        memset(n, 0, sizeof(*n));
+        n->lineno = lineno;
+        char *note = strstr(p, "#@");
+        if (parse_annotation(n, note ? note + 2 : "") < 0) {
+            free(line);
+            fclose(f);
             return -1;
-        } else if (pid == 0) {
-            /* Child process */
-            if (in_fd != 0) {
-                if (dup2(in_fd, STDIN_FILENO) < 0) {
-                    perror("dup2 in_fd");
-                    exit(EXIT_FAILURE);
-                }
-                close(in_fd);
+        }
+        if (note)
+            *note = '\0';
+        size_t len = strlen(p);
+        while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t' || p[len - 1] == '\n'))
+            p[--len] = '\0';
+        n->cmd = strdup(p);
+        if (!n->cmd) {
+            perror("strdup");
+            exit(EXIT_FAILURE);
+        }
+        char key[32];
+        snprintf(key, sizeof(key), "%d:", lineno);
+        n->key = hash_string(key) ^ hash_string(line);
+        count++;
+    }
+    free(line);
+    fclose(f);
+    *nodes_out = nodes;
+    return count;
+}
+
+/* Resolve after: names and in:/out: files into dependency edges. */
+static int batch_link(batch_node_t *nodes, int count) {
+    for (int i = 0; i < count; i++) {
+        batch_node_t *n = &nodes[i];
+        n->deps = malloc(count * sizeof(int));
+        if (!n->deps) {
+            perror("malloc deps");
+            exit(EXIT_FAILURE);
+        }
+        for (int j = 0; j < count; j++) {
+            if (j == i)
+                continue;
+            int dep = 0;
+            for (char **a = n->after; *a && !dep; a++)
+                if (nodes[j].name && strcmp(*a, nodes[j].name) == 0)
+                    dep = 1;
+            for (char **in = n->inputs; *in && !dep; in++)
+                for (char **out = nodes[j].outputs; *out && !dep; out++)
+                    if (strcmp(*in, *out) == 0)
+                        dep = 1;
+            if (dep)
+                n->deps[n->num_deps++] = j;
+        }
+        for (char **a = n->after; *a; a++) {
+            int found = 0;
+            for (int j = 0; j < count && !found; j++)
+                found = nodes[j].name && strcmp(*a, nodes[j].name) == 0;
+            if (!found) {
+                fprintf(stderr, "utsh: line %d: after: unknown node '%s'\n", n->lineno, *a);
+                return -1;
             }
-            if (i < num_cmds - 1) {
-                close(fd[0]);
-                if (dup2(fd[1], STDOUT_FILENO) < 0) {
-                    perror("dup2 fd[1]");
-                    exit(EXIT_FAILURE);
-                }
-                close(fd[1]);
+        }
+    }
+    /* Reject cycles up front (Kahn's algorithm on a scratch copy). */
+    int *remaining = malloc(count * sizeof(int));
+    int *done = calloc(count, sizeof(int));
+    if (!remaining || !done) {
+        perror("malloc batch_link");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++)
+        remaining[i] = nodes[i].num_deps;
+    int finished = 0, progress = 1;
+    while (progress) {
+        progress = 0;
+        for (int i = 0; i < count; i++) {
+            if (done[i] || remaining[i] > 0)
+                continue;
+            done[i] = 1;
+            finished++;
+            progress = 1;
+            for (int k = 0; k < count; k++)
+                for (int d = 0; d < nodes[k].num_deps; d++)
+                    if (nodes[k].deps[d] == i)
+                        remaining[k]--;
+        }
+    }
+    for (int i = 0; i < count && finished < count; i++)
+        if (!done[i]) {
+            fprintf(stderr, "utsh: line %d: dependency cycle\n", nodes[i].lineno);
+            break;
+        }
+    free(remaining);
+    free(done);
+    return finished == count ? 0 : -1;
+}
+
+/* True if the node declares outputs that are all newer than its inputs. */
+static int batch_up_to_date(batch_node_t *n) {
+    if (n->outputs[0] == NULL)
+        return 0;
+    struct stat st;
+    time_t oldest_out = 0;
+    for (char **out = n->outputs; *out; out++) {
+        if (stat(*out, &st) < 0)
+            return 0;
+        if (oldest_out == 0 || st.st_mtime < oldest_out)
+            oldest_out = st.st_mtime;
+    }
+    for (char **in = n->inputs; *in; in++)
+        if (stat(*in, &st) < 0 || st.st_mtime > oldest_out)
+            return 0;
+    return 1;
+}
+
+/* Runs in the node's subshell. */
+static int batch_body(void *arg) {
+    int devnull = open("/dev/null", O_RDONLY);
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        close(devnull);
+    }
+    return run_line(arg);
+}
+
+/* Fork a non-interactive copy of the shell to run the node's line. */
+static void batch_start(batch_node_t *n) {
+    n->job = fork_subshell_job(n->cmd, batch_body, n->cmd);
+    n->state = NODE_RUNNING;
+}
+
+static void batch_not_run(batch_node_t *nodes, int count, int failed) {
+    for (int i = 0; i < count; i++) {
+        if (nodes[i].state != NODE_WAITING)
+            continue;
+        for (int d = 0; d < nodes[i].num_deps; d++) {
+            if (nodes[i].deps[d] == failed) {
+                nodes[i].state = NODE_NOT_RUN;
+                batch_not_run(nodes, count, i);
+                break;
             }
-            /* For the first command, apply input redirection if specified */
-            if (i == 0 && cmds[i]->infile != NULL) {
-                int fd_in = open(cmds[i]->infile, O_RDONLY);
-                if (fd_in < 0) {
-                    perror("open infile");
-                    exit(EXIT_FAILURE);
-                }
-                if (dup2(fd_in, STDIN_FILENO) < 0) {
-                    perror("dup2 infile");
-                    exit(EXIT_FAILURE);
-                }
-                close(fd_in);
+        }
+    }
+}
+
+int run_batch(const char *path, int slots) {
+    batch_node_t *nodes;
+    int count = batch_load(path, &nodes);
+    if (count < 0)
+        return 2;
+    if (batch_link(nodes, count) < 0)
+        return 2;
+
+    /* Pick up where an interrupted run stopped */
+    char *journal_path = malloc(strlen(path) + sizeof(".journal"));
+    if (!journal_path) {
+        perror("malloc journal");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(journal_path, "%s.journal", path);
+    FILE *jf = fopen(journal_path, "r");
+    if (jf) {
+        unsigned long key;
+        while (fscanf(jf, "done %lx\n", &key) == 1)
+            for (int i = 0; i < count; i++)
+                if (nodes[i].key == key)
+                    nodes[i].state = NODE_DONE;
+        fclose(jf);
+    }
+    int journal = open(journal_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journal < 0)
+        perror(journal_path);
+
+    int running = 0, failed = 0;
+    for (;;) {
+        /* Start ready nodes, in file order, while slots are free */
+        for (int i = 0; i < count && running < slots; i++) {
+            batch_node_t *n = &nodes[i];
+            if (n->state != NODE_WAITING)
+                continue;
+            int ready = 1;
+            for (int d = 0; d < n->num_deps && ready; d++)
+                ready = nodes[n->deps[d]].state == NODE_DONE;
+            if (!ready)
+                continue;
+            if (batch_up_to_date(n)) {
+                n->state = NODE_DONE;
+                i = -1;     /* may have made earlier nodes ready */
+                continue;
             }
-            /* For the last command, apply output redirection if specified */
-            if (i == num_cmds - 1 && cmds[i]->outfile != NULL) {
-                int fd_out = open(cmds[i]->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd_out < 0) {
-                    perror("open outfile");
-                    exit(EXIT_FAILURE);
-                }
-                if (dup2(fd_out, STDOUT_FILENO) < 0) {
-                    perror("dup2 outfile");
-                    exit(EXIT_FAILURE);
+            batch_start(n);
+            running++;
+        }
+        if (running == 0)
+            break;
+        if (reactor_run_once(-1) < 0)
+            break;
+        reap_children();
+
+        for (int i = 0; i < count; i++) {
+            batch_node_t *n = &nodes[i];
+            if (n->state != NODE_RUNNING || !job_is_completed(n->job))
+                continue;
+            int status = job_exit_status(n->job);
+            remove_job(n->job);
+            n->job = NULL;
+            running--;
+            if (status == 0) {
+                n->state = NODE_DONE;
+                if (journal >= 0) {
+                    char rec[32];
+                    int len = snprintf(rec, sizeof(rec), "done %lx\n", n->key);
+                    write_all(journal, rec, len);
                 }
-                close(fd_out);
-            }
-            if (execvp(cmds[i]->args[0], cmds[i]->args) < 0) {
-                perror("execvp");
-                exit(EXIT_FAILURE);
-            }
-        } else {
-            /* Parent process */
-            if (in_fd != 0)
-                close(in_fd);
-            if (i < num_cmds - 1) {
-                close(fd[1]);
-                in_fd = fd[0];
+            } else {
+                n->state = NODE_FAILED;
+                failed++;
+                fprintf(stderr, "utsh: line %d failed with status %d: %s\n", n->lineno, status, n->cmd);
+                batch_not_run(nodes, count, i);
             }
         }
     }
-    /* Wait for all child processes in the pipeline */
-    for (i = 0; i < num_cmds; i++) {
-        wait(NULL);
-    }
-    return 1;
+
+    int not_run = 0;
+    for (int i = 0; i < count; i++)
+        if (nodes[i].state == NODE_NOT_RUN)
+            not_run++;
+    if (journal >= 0)
+        close(journal);
+    if (failed == 0 && not_run == 0)
+        unlink(journal_path);
+    else
+        fprintf(stderr, "utsh: %d node(s) failed, %d not run; rerun to resume from %s\n",
+                failed, not_run, journal_path);
+    free(journal_path);
+    return failed || not_run ? 1 : 0;
 }
 
 /* ------------------------ */
 /* Main shell loop          */
 /* ------------------------ */
-int main(void) {
+void print_prompt(void) {
+    printf("utsh$ ");
+    fflush(stdout);
+}
+
+/* more_lines_fn for the terminal: ctx is the outbuf_t holding the
+   lines so far. */
+static long prompt_more(void *ctx, const char **text, long len) {
+    outbuf_t *unit = ctx;
+    printf("> ");
+    fflush(stdout);
+    char *line = read_line();
+    if (!line || interrupted) {
+        free(line);
+        return -1;
+    }
+    unit->len = len;
+    outbuf_putc(unit, '\n');
+    outbuf_append(unit, line, strcspn(line, "\n"));
+    free(line);
+    *text = unit->data;
+    return unit->len;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: utsh [-c command | -j N -f jobfile | script]\n");
+    exit(2);
+}
+
+/* Run a script line by line as it is read; see "Script input". */
+static int run_script(int fd) {
+    script_t s;
+    script_open(&s, fd);
+    const char *cache = getenv("UTSH_CACHE");
+    if (s.map && !s.shared && cache && *cache) {
+        int status = run_compiled(&s, cache);
+        script_close(&s);
+        return status;
+    }
+    script_input = &s;
+    for (;;) {
+        const char *line;
+        prof_begin(PROF_READ);
+        long len = script_next_line(&s, &line);
+        if (len >= 0)
+            len = read_unit(&line, len, script_more, &s);
+        prof_end();
+        if (len < 0)
+            break;
+        exec_tail = script_at_end(&s);
+        run_text(line, len);
+        exec_tail = 0;
+        notify_jobs();
+    }
+    script_input = NULL;
+    script_close(&s);
+    return last_status;
+}
+
+/* utsh -c: run each line of the string; the last one may exec in place
+   of the shell. */
+static int run_string(const char *command) {
+    const char *line = command, *end = command + strlen(command);
+    while (line) {
+        long len = read_unit(&line, strcspn(line, "\n"), more_in_memory, (void *)end);
+        const char *rest = line[len] ? line + len + 1 : NULL;
+        exec_tail = !rest || !rest[strspn(rest, " \t\n")];
+        run_text(line, len);
+        exec_tail = 0;
+        line = rest;
+    }
+    notify_jobs();
+    return last_status;
+}
+
+int main(int argc, char **argv) {
     char *line;
-    char **commands;
-    
+    const char *batch_file = NULL;
+    const char *command = NULL;
+    int slots = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:j:f:")) != -1) {
+        switch (opt) {
+        case 'c':
+            command = optarg;
+            break;
+        case 'j':
+            if ((slots = parse_count(optarg)) < 0) {
+                fprintf(stderr, "utsh: -j %s: invalid value\n", optarg);
+                exit(2);
+            }
+            break;
+        case 'f':
+            batch_file = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    const char *script = optind < argc ? argv[optind++] : NULL;
+    if (optind < argc || (slots && !batch_file) || (command && batch_file) ||
+        (script && (command || batch_file)))
+        usage();
+    int script_fd = STDIN_FILENO;
+    if (script && (script_fd = open(script, O_RDONLY | O_CLOEXEC)) < 0) {
+        perror(script);
+        return 127;
+    }
+
+    init_shell(batch_file == NULL && command == NULL && script == NULL);
+
+    const char *zygote_env = getenv("UTSH_ZYGOTE");
+    if (shell_interactive && zygote_env && *zygote_env)
+        zygote_start();
+
+    const char *trace_path = getenv("UTSH_TRACE");
+    if (trace_path && *trace_path)
+        trace_open(trace_path);
+
+    const char *prof_env = getenv("UTSH_PROFILE");
+    if (prof_env && *prof_env) {
+        profiling = 1;
+        profile_folded = strcmp(prof_env, "folded") == 0;
+    }
+
+    const char *hist_path = getenv("UTSH_HISTFILE");
+    if (shell_interactive && hist_path && *hist_path)
+        history_open(hist_path);
+
+    if (command || (!shell_interactive && !batch_file)) {
+        int status = command ? run_string(command) : run_script(script_fd);
+        profile_finish();
+        return status;
+    }
+
+    if (batch_file) {
+        if (slots <= 0) {
+            long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+            slots = ncpu > 0 ? (int)ncpu : 1;
+        }
+        int status = run_batch(batch_file, slots);
+        profile_finish();
+        return status;
+    }
+
     while (1) {
-        printf("utsh$ ");
-        fflush(stdout);
+        notify_jobs();
+        print_prompt();
         
+        prof_begin(PROF_READ);
         line = read_line();
+        if (line) {
+            /* Read the rest of a compound command at a "> " prompt */
+            outbuf_t unit = { 0 };
+            outbuf_append(&unit, line, strcspn(line, "\n"));
+            free(line);
+            const char *text = unit.data;
+            read_unit(&text, unit.len, prompt_more, &unit);
+            line = outbuf_finish(&unit);
+        }
+        prof_end();
         if (line == NULL) {  // EOF (e.g., Ctrl-D)
             break;
         }
-        
-        // Skip lines that contain only whitespace.
-        char *p = line;
-        while (*p == ' ' || *p == '\t' || *p == '\n')
-            p++;
-        if (strlen(p) == 0) {
-            free(line);
-            continue;
-        }
-        
-        /* Split the input line into separate commands by ';' */
-        commands = split_line(line, ";");
-        if (commands == NULL) {
+        if (interrupted) {      /* Ctrl-C at the "> " prompt */
             free(line);
             continue;
         }
-        
-        for (int i = 0; commands[i] != NULL; i++) {
-            char *cmd_str = commands[i];
-            // Trim leading whitespace.
-            while (*cmd_str == ' ' || *cmd_str == '\t')
-                cmd_str++;
-            // Remove trailing whitespace (including newlines).
-            size_t len = strlen(cmd_str);
-            while (len > 0 && (cmd_str[len - 1] == ' ' || cmd_str[len - 1] == '\t' || cmd_str[len - 1] == '\n')) {
-                cmd_str[len - 1] = '\0';
-                len--;
-            }
-            if (strlen(cmd_str) == 0)
-                continue;
-            
-            /* If the command is "history", print history and do not add it to the history list. */
-            if (strcmp(cmd_str, "history") == 0) {
-                print_history();
-                continue;
-            } else {
-                /* For any other command, add it to history. */
-                add_history(cmd_str);
-            }
-            
-            /* Check for pipelines */
-            if (strchr(cmd_str, '|') != NULL) {
-                char **pipe_segments = split_line(cmd_str, "|");
-                int num_segments = 0;
-                while (pipe_segments[num_segments] != NULL) {
-                    num_segments++;
-                }
-                command_t **pipeline_cmds = malloc(sizeof(command_t*) * num_segments);
-                if (!pipeline_cmds) {
-                    perror("malloc pipeline_cmds");
-                    exit(EXIT_FAILURE);
-                }
-                for (int j = 0; j < num_segments; j++) {
-                    pipeline_cmds[j] = parse_command(pipe_segments[j]);
-                    if (!pipeline_cmds[j]) {
-                        fprintf(stderr, "Error parsing command in pipeline\n");
-                        for (int k = 0; k < j; k++) {
-                            free_command(pipeline_cmds[k]);
-                        }
-                        free(pipeline_cmds);
-                        break;
-                    }
-                }
-                execute_pipeline(pipeline_cmds, num_segments);
-                for (int j = 0; j < num_segments; j++) {
-                    free_command(pipeline_cmds[j]);
-                }
-                free(pipeline_cmds);
-                free(pipe_segments);
-            } else {
-                /* Single (non-pipeline) command */
-                command_t *cmd = parse_command(cmd_str);
-                if (!cmd) {
-                    fprintf(stderr, "Error parsing command\n");
-                    continue;
-                }
-                /* Built‑in "cd" command */
-                if (cmd->args[0] != NULL && strcmp(cmd->args[0], "cd") == 0) {
-                    if (cmd->args[1] == NULL) {
-                        fprintf(stderr, "cd: expected argument\n");
-                    } else {
-                        if (chdir(cmd->args[1]) != 0) {
-                            perror("cd");
-                        }
-                    }
-                } else {
-                    execute_command(cmd);
-                }
-                free_command(cmd);
-            }
+        /* Every line except "history" itself goes into the history */
+        char *text = line + strspn(line, " \t\n");
+        int entry = -1;
+        int is_history = strncmp(text, "history", 7) == 0 &&
+                         (text[7] == '\0' || isspace((unsigned char)text[7]));
+        if (*text && !is_history) {
+            add_history(text);
+            entry = history_count - 1;
         }
-        
-        free(commands);
+        history_current = entry;
+        uint64_t started = prof_now();
+        run_line(line);
+        history_current = -1;
+        if (entry >= 0)
+            history_finish(&history[entry], (prof_now() - started) / 1e9, last_status);
         free(line);
     }
     
+    profile_finish();
+
     /* Free command history */
     for (int i = 0; i < history_count; i++) {
-        free(history[i]);
+        free(history[i].text);
+        free(history[i].cwd);
     }
     free(history);
+    if (history_fd >= 0)
+        close(history_fd);
     
     return 0;
 }
@@ -0,0 +1,174 @@
+#!/bin/sh
+# Behaviour checks for sh6.c. Each case is a script run by the shell;
+# its output (stdout and stderr together) must match the expected text.
+#
+#   sh tests.sh                 build sh6.c into a temporary directory and check it
+#   UTSH=./utsh sh tests.sh     check an existing binary instead
+
+cd "$(dirname "$0")" || exit 2
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+if [ -z "$UTSH" ]; then
+    gcc -Wall -Wextra -O2 sh6.c -o "$dir/utsh" || exit 2
+    UTSH=$dir/utsh
+fi
+case $UTSH in
+/*) ;;
+*) UTSH=$PWD/$UTSH ;;
+esac
+
+pass=0
+fail=0
+
+# check NAME EXPECTED < SCRIPT
+check() {
+    cat > "$dir/case.sh"
+    actual=$(cd "$dir" && "$UTSH" case.sh 2>&1)
+    if [ "$actual" = "$2" ]; then
+        pass=$((pass + 1))
+    else
+        fail=$((fail + 1))
+        printf 'FAIL: %s\n--- expected\n%s\n--- got\n%s\n\n' "$1" "$2" "$actual"
+    fi
+}
+
+# ------------------------
+# Control flow
+# ------------------------
+check 'for with continue and break' '1
+3
+4' <<'EOF'
+for i in 1 2 3 4 5 6; do
+    if [ $i = 2 ]; then continue; fi
+    echo $i
+    if [ $i = 4 ]; then break; fi
+done
+EOF
+
+check 'continue 2 and break 2 leave the outer loop' 'a1
+b1
+x' <<'EOF'
+for i in a b; do for j in 1 2 3; do if [ $j = 2 ]; then continue 2; fi; echo $i$j; done; done
+for i in x y; do while true; do echo $i; break 2; done; done
+EOF
+
+check 'until and case' 'once
+source' <<'EOF'
+until false; do echo once; break; done
+case foo.c in *.h) echo header;; *.c) echo source;; esac
+EOF
+
+# ------------------------
+# Arithmetic
+# ------------------------
+check 'arithmetic wraps around on overflow' '-9223372036854775808
+-9223372036854775808
+0' <<'EOF'
+echo $((9223372036854775807 + 1))
+echo $(( (-9223372036854775807 - 1) / -1 ))
+echo $(( (1 << 62) * 4 ))
+EOF
+
+check 'division by zero fails the command' 'utsh: $((1 / 0)): division by zero
+1
+utsh: $((5 % x)): division by zero
+1
+after' <<'EOF'
+echo $((1 / 0))
+echo $?
+x=0; echo $((5 % x))
+echo $?
+echo after
+EOF
+
+check 'assignments and a counting loop' '10 10 5 -1
+5' <<'EOF'
+x=7; echo $((x += 3)) $x $((x / 2)) $((-x % 3))
+i=0; while [ $i -lt 5 ]; do i=$((i + 1)); done; echo $i
+EOF
+
+# ------------------------
+# Command substitution
+# ------------------------
+check 'nested $(...) of built-ins and pipelines' '[<a>]
+/
+x Y z
+deep
+in1 in2' <<'EOF'
+cd /
+echo "[$(echo "<$(echo a | cat)>")]"
+echo "$(echo $(pwd | cat))"
+echo $(echo x; echo "$(echo y | tr y Y)"; echo z)
+v=$(echo $(echo $(echo deep | cat) | cat)); echo "$v"
+echo `for i in 1 2; do echo "$(echo in$i | cat)"; done`
+EOF
+
+check '$(...) status and trailing newlines' '[a b]
+1' <<'EOF'
+v=$(printf 'a b\n\n\n'); echo "[$v]"
+v=$(false); echo $?
+EOF
+
+# ------------------------
+# Subshells
+# ------------------------
+check '( ... ) rolls back variables and the directory' 'inner /
+outer /usr
+forked
+/
+outer /usr
+[]
+[outer] []
+3
+sub outer /usr' <<'EOF'
+cd /usr; x=outer
+( x=inner; cd /; echo "$x $(pwd)" )
+echo "$x $(pwd)"
+( x=forked; cd /; /bin/echo $x; pwd | cat )
+echo "$x $(pwd)"
+( unset x; export y=1; echo "[$x]" )
+echo "[$x] [$y]"
+( exit 3 ); echo $?
+v=$(cd /; x=sub; echo $x); echo "$v $x $(pwd)"
+EOF
+
+# ------------------------
+# Here-documents
+# ------------------------
+check 'here-documents expand unless the delimiter is quoted' 'hello world 3 $name tick
+raw $name \$x
+tab stripped
+twice
+WORLD' <<'EOF'
+name=world
+cat <<END
+hello $name $((1 + 2)) \$name `echo tick`
+END
+cat <<'END'
+raw $name \$x
+END
+cat <<-END
+	tab stripped
+		twice
+	END
+tr a-z A-Z <<< "$name"
+EOF
+
+# 3000 lines of seq are about 14 KiB: past the pipe, into a memfd
+check 'here-documents above the pipe threshold' '3000
+3000
+loop 1
+loop 2' <<'EOF'
+cat <<END | wc -l
+$(seq 3000)
+END
+tail -n 1 <<END
+$(seq 3000)
+END
+for i in 1 2; do cat <<END; done
+loop $i
+END
+EOF
+
+echo "$pass passed, $fail failed"
+[ "$fail" -eq 0 ]
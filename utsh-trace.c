@@ -0,0 +1,183 @@
+/*
+ * utsh-trace.c - Convert a utsh event trace (written when the shell runs
+ * with UTSH_TRACE=file) into Chrome trace JSON for chrome://tracing or
+ * Perfetto.
+ *
+ * Every process becomes a slice from its spawn to its exit, on a track
+ * of its own, grouped by the pipeline (parse-tree node) that started it,
+ * so overlapping stages and idle gaps show up side by side. Execs, pipes
+ * and redirections are instant events; built-ins are nested slices.
+ *
+ * Compile with:
+ *      gcc -o utsh-trace utsh-trace.c
+ *
+ * Then run:
+ *      ./utsh-trace trace.bin > trace.json
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* Must match the record written by sh6.c */
+#define TRACE_MAGIC "UTSHTRC1"
+
+enum { TR_SPAWN = 1, TR_EXEC, TR_EXIT, TR_PIPE, TR_REDIR, TR_BUILTIN_BEGIN, TR_BUILTIN_END };
+
+typedef struct {
+    uint64_t ts;
+    int32_t pid;
+    uint32_t node;
+    uint16_t type;
+    uint16_t stage;
+    int32_t arg;
+    int32_t arg2;
+    char name[20];
+} trace_event_t;
+
+/* A process seen being spawned, waiting for its exit */
+typedef struct {
+    int32_t pid;
+    uint32_t node;
+    uint16_t stage;
+    uint64_t start;
+    char name[21];
+} spawn_t;
+
+static uint64_t base;
+static int first = 1;
+
+static void print_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            printf("\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            printf("\\u%04x", *s);
+        else
+            putchar(*s);
+    }
+    putchar('"');
+}
+
+/* Start one JSON event object; the caller adds any fields and "}". */
+static void begin_event(const char *name, const char *ph, uint32_t node, int32_t pid, uint64_t ts) {
+    printf("%s\n{\"name\":", first ? "" : ",");
+    first = 0;
+    print_string(name);
+    printf(",\"ph\":\"%s\",\"pid\":%u,\"tid\":%d,\"ts\":%.3f", ph, node, pid, (ts - base) / 1e3);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: utsh-trace trace-file > trace.json\n");
+        return 2;
+    }
+    FILE *in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    char header[24];
+    uint32_t size;
+    if (fread(header, sizeof(header), 1, in) != 1 || memcmp(header, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a utsh trace\n", argv[1]);
+        return 1;
+    }
+    memcpy(&size, header + 8, sizeof(size));
+    memcpy(&base, header + 16, sizeof(base));
+    if (size != sizeof(trace_event_t)) {
+        fprintf(stderr, "%s: unsupported record size %u\n", argv[1], size);
+        return 1;
+    }
+
+    spawn_t *spawns = NULL;
+    int num_spawns = 0, cap = 0;
+    uint32_t *nodes = NULL;     /* Distinct node ids, to name their tracks */
+    int num_nodes = 0;
+    trace_event_t e;
+
+    printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    while (fread(&e, sizeof(e), 1, in) == 1) {
+        char name[21];
+        memcpy(name, e.name, sizeof(e.name));
+        name[20] = '\0';
+        int seen = 0;
+        for (int i = 0; i < num_nodes && !seen; i++)
+            seen = nodes[i] == e.node;
+        if (!seen) {
+            nodes = realloc(nodes, (num_nodes + 1) * sizeof(uint32_t));
+            if (!nodes) {
+                perror("realloc");
+                return 1;
+            }
+            nodes[num_nodes++] = e.node;
+        }
+
+        switch (e.type) {
+        case TR_SPAWN:
+            if (num_spawns == cap) {
+                cap = cap ? cap * 2 : 64;
+                spawns = realloc(spawns, cap * sizeof(spawn_t));
+                if (!spawns) {
+                    perror("realloc");
+                    return 1;
+                }
+            }
+            spawns[num_spawns].pid = e.pid;
+            spawns[num_spawns].node = e.node;
+            spawns[num_spawns].stage = e.stage;
+            spawns[num_spawns].start = e.ts;
+            strcpy(spawns[num_spawns].name, name[0] ? name : "(redirect)");
+            num_spawns++;
+            break;
+        case TR_EXIT:
+            /* Pids are reused, so match the latest spawn of this pid */
+            for (int i = num_spawns - 1; i >= 0; i--) {
+                if (spawns[i].pid != e.pid)
+                    continue;
+                begin_event(spawns[i].name, "X", spawns[i].node, e.pid, spawns[i].start);
+                printf(",\"dur\":%.3f,\"args\":{\"stage\":%u,\"status\":%d}}",
+                       (e.ts - spawns[i].start) / 1e3, spawns[i].stage, e.arg);
+                spawns[i] = spawns[--num_spawns];
+                break;
+            }
+            break;
+        case TR_EXEC:
+            begin_event("exec", "i", e.node, e.pid, e.ts);
+            printf(",\"s\":\"t\",\"args\":{\"command\":");
+            print_string(name);
+            printf("}}");
+            break;
+        case TR_PIPE:
+            begin_event("pipe", "i", e.node, e.pid, e.ts);
+            printf(",\"s\":\"t\",\"args\":{\"read_fd\":%d,\"write_fd\":%d}}", e.arg, e.arg2);
+            break;
+        case TR_REDIR:
+            begin_event(e.arg == 0 ? "redirect <" : "redirect >", "i", e.node, e.pid, e.ts);
+            printf(",\"s\":\"t\",\"args\":{\"file\":");
+            print_string(name);
+            printf(",\"fd\":%d}}", e.arg2);
+            break;
+        case TR_BUILTIN_BEGIN:
+        case TR_BUILTIN_END:
+            begin_event(name, e.type == TR_BUILTIN_BEGIN ? "B" : "E", e.node, e.pid, e.ts);
+            if (e.type == TR_BUILTIN_END)
+                printf(",\"args\":{\"status\":%d}", e.arg);
+            printf("}");
+            break;
+        }
+    }
+
+    /* Name each pipeline's group of tracks */
+    for (int i = 0; i < num_nodes; i++) {
+        printf("%s\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"node %u\"}}",
+               first ? "" : ",", nodes[i], nodes[i]);
+        first = 0;
+    }
+    printf("\n]}\n");
+    free(nodes);
+    free(spawns);
+    fclose(in);
+    return 0;
+}